@@ -0,0 +1,23 @@
+#include "kernel.cuh"
+
+#include <stdint.h>
+#include <cuda.h>
+
+__global__
+void mul(float *a, float *b, float *c, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    int j = blockIdx.y * blockDim.y + threadIdx.y;
+    if (i < n && j < n) {
+        int idx = i * n + j;
+        c[idx] = a[idx] * b[idx];
+    }
+}
+
+__global__
+void spin(unsigned long long cycles)
+{
+    long long start = clock64();
+    while (clock64() - start < cycles)
+        ;
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+
+
+__global__
+void mul(float *a, float *b, float *c, int n);
+
+__global__
+void spin(unsigned long long cycles);
\ No newline at end of file
@@ -0,0 +1,1794 @@
+#include <cuda.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <enc_cuda/enc_cuda.h>
+
+/*
+ * Benchmarks and checks of libenccuda, run as
+ *
+ *   cuda_enc_bench <mode> [args...]
+ *
+ * Modes:
+ *   alloc [iterations]   count heap allocations on the copy and launch paths
+ *   copy [bytes] [iterations]
+ *                        HtoD and DtoH bandwidth of encrypted copies
+ *   offset [bytes] [iterations]
+ *                        copies to and from pointers inside an allocation
+ *   partial [bytes] [iterations]
+ *                        4 KiB copies inside a large allocation
+ *   threads [threads] [iterations]
+ *                        concurrent cuMemAlloc, copies and cuMemFree
+ *   pinned [bytes] [iterations]
+ *                        bandwidth of copies from pageable and pinned memory
+ *   async [bytes] [streams]
+ *                        cuMemcpy*Async on several streams against sync copies
+ *   stall [bytes] [cycles]
+ *                        encrypted uploads while a long kernel runs
+ *   combine [copies] [iterations]
+ *                        tiny uploads and a launch, with write-combining
+ *   batch [copies] [bytes]
+ *                        cuda_enc_memcpy_batch against one copy at a time
+ *   sizes [bytes]
+ *                        unpipelined copies of odd sizes, up to two grid rows
+ *   large [bytes]
+ *                        _v2 copies of more than 4 GiB
+ *   launch [iterations]
+ *                        cost of sending the parameters of a launch encrypted
+ *   chain [launches] [iterations]
+ *                        dependent launches, with launch batching
+ *   global [bytes]       copies to and from a module global
+ *   dtod [bytes] [iterations]
+ *                        device to device copies between double buffers
+ *   pitch [width] [height] [iterations]
+ *                        2D and 3D copies to a pitched allocation
+ *   order [iterations]   memsets after launches and write-combined copies
+ *
+ * The library is configured from the environment, see enc_cuda.h.
+ */
+
+#define CUDA_PRINT_ERROR(e) \
+    cuda_print_error(__FILE__, __LINE__, e)
+
+static inline void cuda_print_error(char *file, int line, CUresult e)
+{
+    fprintf(stderr, "(%s:%d), error %d\n", file, line, e);
+}
+
+static char static_key[] = "0123456789abcdeF0123456789abcdeF";
+static char static_iv[] = "12345678876543211234567887654321";
+
+/* ------------------------------------------------------------------------
+ * Heap allocation counter: the executable's malloc family shadows the one
+ * of libc for the whole process, including libenccuda and libcrypto.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long heap_allocs;
+
+#define COUNT_ALLOC() __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t size)
+{
+    COUNT_ALLOC();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    COUNT_ALLOC();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    COUNT_ALLOC();
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    COUNT_ALLOC();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    COUNT_ALLOC();
+    *memptr = __libc_memalign(alignment, size);
+    return *memptr == NULL ? ENOMEM : 0;
+}
+
+static unsigned long heap_allocs_get(void)
+{
+    return __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* tvsub: ret = x - y. */
+static inline void tvsub(struct timeval *x,
+                         struct timeval *y,
+                         struct timeval *ret)
+{
+    ret->tv_sec = x->tv_sec - y->tv_sec;
+    ret->tv_usec = x->tv_usec - y->tv_usec;
+    if (ret->tv_usec < 0) {
+        ret->tv_sec--;
+        ret->tv_usec += 1000000;
+    }
+}
+
+// milliseconds since start
+static float elapsed_ms(struct timeval *start)
+{
+    struct timeval end, tv;
+    gettimeofday(&end, NULL);
+    tvsub(&end, start, &tv);
+    return tv.tv_sec * 1000.0 + (float) tv.tv_usec / 1000.0;
+}
+
+struct bench {
+    CUcontext ctx;
+    CUmodule module;
+    CUfunction function; //< mul(float *a, float *b, float *c, int n)
+};
+
+// cfg NULL: the defaults and the environment
+static CUresult bench_init_config(struct bench *b, const struct cuda_enc_config *cfg)
+{
+    CUresult res;
+    CUdevice dev;
+
+    if ((res = cuInit(0)) != CUDA_SUCCESS)
+        return res;
+    if ((res = cuDeviceGet(&dev, 0)) != CUDA_SUCCESS)
+        return res;
+    if ((res = cuCtxCreate(&b->ctx, CU_CTX_SCHED_BLOCKING_SYNC, dev)) != CUDA_SUCCESS)
+        return res;
+    if ((res = cuModuleLoad(&b->module, "./src/kernel.cubin")) != CUDA_SUCCESS)
+        return res;
+    if ((res = cuModuleGetFunction(&b->function, b->module, "_Z3mulPfS_S_i")) != CUDA_SUCCESS)
+        return res;
+    if ((res = cuFuncSetBlockShape(b->function, 16, 16, 1)) != CUDA_SUCCESS)
+        return res;
+
+    if (cfg != NULL)
+        return cuda_enc_setup_config(static_key, static_iv, cfg);
+    return cuda_enc_setup(static_key, static_iv);
+}
+
+static CUresult bench_init(struct bench *b)
+{
+    return bench_init_config(b, NULL);
+}
+
+static void bench_exit(struct bench *b)
+{
+    cuda_enc_release();
+    cuModuleUnload(b->module);
+    cuCtxDestroy(b->ctx);
+}
+
+// c = a * b on n x n floats
+static CUresult bench_set_mul_params(struct bench *b, CUdeviceptr a_dev,
+                                     CUdeviceptr b_dev, CUdeviceptr c_dev,
+                                     unsigned int n)
+{
+    CUresult res;
+    int offset = 0;
+
+    if ((res = cuParamSetv(b->function, offset, &a_dev, sizeof(a_dev))) != CUDA_SUCCESS)
+        return res;
+    offset += sizeof(a_dev);
+    if ((res = cuParamSetv(b->function, offset, &b_dev, sizeof(b_dev))) != CUDA_SUCCESS)
+        return res;
+    offset += sizeof(b_dev);
+    if ((res = cuParamSetv(b->function, offset, &c_dev, sizeof(c_dev))) != CUDA_SUCCESS)
+        return res;
+    offset += sizeof(c_dev);
+    if ((res = cuParamSetv(b->function, offset, &n, sizeof(n))) != CUDA_SUCCESS)
+        return res;
+    offset += sizeof(n);
+    return cuParamSetSize(b->function, offset);
+}
+
+/*
+ * alloc: after a warm-up round, cuMemcpyHtoD, cuMemcpyDtoH and cuLaunchGrid
+ * must not allocate heap memory.
+ */
+static int bench_alloc(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr a_dev, c_dev;
+    unsigned int n = 64;
+    size_t size = n * n * sizeof(float);
+    int iterations = argc > 0 ? atoi(argv[0]) : 100;
+
+    float *a = calloc(n * n, sizeof(float));
+    float *c = calloc(n * n, sizeof(float));
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&a_dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&c_dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = bench_set_mul_params(&b, a_dev, a_dev, c_dev, n)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    unsigned long before = 0;
+    for (int i = -1; i < iterations; i++) {
+        // iteration -1 warms up the per-thread state
+        if (i == 0)
+            before = heap_allocs_get();
+
+        if ((res = cuMemcpyHtoD(a_dev, a, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuLaunchGrid(b.function, n / 16, n / 16)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoH(c, c_dev, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    unsigned long allocs = heap_allocs_get() - before;
+
+    printf("heap allocations in %d x (HtoD, launch, DtoH): %lu\n", iterations, allocs);
+
+    cuMemFree(a_dev);
+    cuMemFree(c_dev);
+    bench_exit(&b);
+    free(a);
+    free(c);
+
+    return allocs == 0 ? 0 : -1;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * copy: bandwidth of encrypted HtoD and DtoH copies of one buffer.
+ */
+static int bench_copy(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    struct timeval tv;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 64 << 20;
+    int iterations = argc > 1 ? atoi(argv[1]) : 10;
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float h2d = elapsed_ms(&tv) / iterations;
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = cuMemcpyDtoH(res_buf, dev, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float d2h = elapsed_ms(&tv) / iterations;
+
+    int mistake = memcmp(buf, res_buf, size) != 0;
+    if (mistake)
+        printf("DtoH data differs from HtoD data\n");
+
+    printf("size: %zu bytes\n", size);
+    printf("HtoD: %f ms, %f MB/s\n", h2d, size / (h2d * 1000.0));
+    printf("DtoH: %f ms, %f MB/s\n", d2h, size / (d2h * 1000.0));
+
+    cuMemFree(dev);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return mistake ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * offset: copy random sub-ranges of a buffer through interior device
+ * pointers, then compare the whole buffer, and read sub-ranges back.
+ */
+static int bench_offset(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 12 << 20;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    int mistakes = 0;
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    srand(42);
+    for (int i = 0; i < iterations; i++) {
+        // mostly small ranges, some spanning several pipeline chunks
+        size_t max = i % 8 == 0 ? size : 64 << 10;
+        size_t offset = (size_t) rand() % size;
+        size_t len = 1 + (size_t) rand() % (max < size - offset ? max : size - offset);
+
+        for (size_t j = offset; j < offset + len; j++)
+            buf[j] = (unsigned char) (buf[j] + i + 1);
+        if ((res = cuMemcpyHtoD(dev + offset, buf + offset, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        offset = (size_t) rand() % size;
+        len = 1 + (size_t) rand() % (max < size - offset ? max : size - offset);
+        memset(res_buf + offset, 0, len);
+        if ((res = cuMemcpyDtoH(res_buf + offset, dev + offset, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+        mistakes += memcmp(buf + offset, res_buf + offset, len) != 0;
+    }
+
+    if ((res = cuMemcpyDtoH(res_buf, dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    mistakes += memcmp(buf, res_buf, size) != 0;
+
+    // past the end of the allocation
+    if (cuMemcpyHtoD(dev + size - 16, buf, 32) == CUDA_SUCCESS) {
+        printf("copy past the end of the allocation succeeded\n");
+        mistakes++;
+    }
+
+    printf("%d offset copies: %d mistakes\n", iterations, mistakes);
+
+    cuMemFree(dev);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * partial: 4 KiB copies at random offsets of a large buffer, against the
+ * same copies of a 4 KiB buffer. Only the touched CTR blocks are encrypted,
+ * so both take about as long.
+ */
+static int bench_partial(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct timeval tv;
+    CUdeviceptr dev, small_dev;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 256 << 20;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    size_t len = 4096;
+    int mistakes = 0;
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(len);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&small_dev, len)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyHtoD(small_dev, buf, len)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = cuMemcpyDtoH(res_buf, small_dev, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float small_us = elapsed_ms(&tv) * 1000 / iterations;
+    mistakes += memcmp(buf, res_buf, len) != 0;
+
+    srand(42);
+    float large_ms = 0;
+    for (int i = 0; i < iterations; i++) {
+        size_t offset = (size_t) rand() % (size - len + 1);
+
+        gettimeofday(&tv, NULL);
+        if ((res = cuMemcpyDtoH(res_buf, dev + offset, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+        large_ms += elapsed_ms(&tv);
+        mistakes += memcmp(buf + offset, res_buf, len) != 0;
+    }
+    float large_us = large_ms * 1000 / iterations;
+
+    printf("%zu bytes DtoH: %f us from %zu bytes, %f us from %zu bytes, %d mistakes\n",
+           len, large_us, size, small_us, len, mistakes);
+
+    cuMemFree(dev);
+    cuMemFree(small_dev);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    // the crypto of the whole buffer would take orders of magnitude longer
+    return mistakes || large_us > 4 * small_us + 100 ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * threads: every thread allocates buffers of its own, copies a pattern
+ * there and back, checks it, and frees them, with lookups of a buffer that
+ * lives for the whole run in between.
+ */
+struct threads_arg {
+    int id;
+    int iterations;
+    CUdeviceptr shared_dev;
+    CUresult res;
+    int mistakes;
+};
+
+#define THREADS_BUF_SIZE (16 * 1024)
+
+static void *threads_worker(void *p)
+{
+    struct threads_arg *arg = p;
+    unsigned char buf[THREADS_BUF_SIZE], res_buf[THREADS_BUF_SIZE];
+    CUdeviceptr dev;
+
+    for (int i = 0; i < arg->iterations; i++) {
+        size_t size = 1 + (i * 997 + arg->id * 131) % THREADS_BUF_SIZE;
+        memset(buf, arg->id + i, size);
+
+        if ((arg->res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+            return NULL;
+        if ((arg->res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+            return NULL;
+        if ((arg->res = cuMemcpyDtoH(res_buf, arg->shared_dev, 16)) != CUDA_SUCCESS)
+            return NULL;
+        if ((arg->res = cuMemcpyDtoH(res_buf, dev, size)) != CUDA_SUCCESS)
+            return NULL;
+        if ((arg->res = cuMemFree(dev)) != CUDA_SUCCESS)
+            return NULL;
+
+        arg->mistakes += memcmp(buf, res_buf, size) != 0;
+    }
+    return NULL;
+}
+
+static int bench_threads(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr shared_dev;
+    struct timeval tv;
+    int nthreads = argc > 0 ? atoi(argv[0]) : 8;
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    int mistakes = 0;
+
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    struct threads_arg *args = calloc(nthreads, sizeof(*args));
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&shared_dev, 16)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        args[i] = (struct threads_arg) {
+            .id = i, .iterations = iterations, .shared_dev = shared_dev,
+        };
+        pthread_create(&threads[i], NULL, threads_worker, &args[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].res != CUDA_SUCCESS) {
+            res = args[i].res;
+            goto cuda_err;
+        }
+        mistakes += args[i].mistakes;
+    }
+    float ms = elapsed_ms(&tv);
+
+    printf("%d threads x %d iterations: %f ms, %d mistakes\n",
+           nthreads, iterations, ms, mistakes);
+
+    cuMemFree(shared_dev);
+    bench_exit(&b);
+    free(threads);
+    free(args);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * pinned: bandwidth of HtoD and DtoH copies from and to pageable (malloc)
+ * and pinned (cuMemAllocHost) host memory, both encrypted and through the
+ * driver functions libenccuda overrides.
+ */
+typedef CUresult htod_func_t(CUdeviceptr, const void *, unsigned int);
+typedef CUresult dtoh_func_t(void *, CUdeviceptr, unsigned int);
+
+static CUresult pinned_bandwidth(htod_func_t *htod, dtoh_func_t *dtoh,
+                                 CUdeviceptr dev, unsigned char *buf,
+                                 size_t size, int iterations,
+                                 float *h2d, float *d2h)
+{
+    CUresult res;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = htod(dev, buf, size)) != CUDA_SUCCESS)
+            return res;
+    }
+    *h2d = size / (elapsed_ms(&tv) / iterations * 1000.0);
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = dtoh(buf, dev, size)) != CUDA_SUCCESS)
+            return res;
+    }
+    *d2h = size / (elapsed_ms(&tv) / iterations * 1000.0);
+    return CUDA_SUCCESS;
+}
+
+static int bench_pinned(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 64 << 20;
+    int iterations = argc > 1 ? atoi(argv[1]) : 10;
+    unsigned char *bufs[2] = {NULL, NULL};
+    const char *names[2] = {"pageable", "pinned"};
+    float h2d, d2h;
+
+    // the driver library is loaded already, as libenccuda depends on it
+    void *driver = dlopen("libucuda.so", RTLD_LAZY | RTLD_NOLOAD);
+    htod_func_t *raw_htod = driver ? (htod_func_t *) dlsym(driver, "cuMemcpyHtoD") : NULL;
+    dtoh_func_t *raw_dtoh = driver ? (dtoh_func_t *) dlsym(driver, "cuMemcpyDtoH") : NULL;
+    if (raw_htod == NULL || raw_dtoh == NULL) {
+        fprintf(stderr, "cant find the driver copy functions: %s\n", dlerror());
+        return -1;
+    }
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    bufs[0] = malloc(size);
+    if ((res = cuMemAllocHost((void **) &bufs[1], size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    memset(bufs[0], 1, size);
+    memset(bufs[1], 1, size);
+
+    printf("size: %zu bytes\n", size);
+    for (int i = 0; i < 2; i++) {
+        res = pinned_bandwidth(raw_htod, raw_dtoh, dev, bufs[i], size, iterations, &h2d, &d2h);
+        if (res != CUDA_SUCCESS)
+            goto cuda_err;
+        printf("%-8s plain:     HtoD %f MB/s, DtoH %f MB/s\n", names[i], h2d, d2h);
+
+        res = pinned_bandwidth(cuMemcpyHtoD, cuMemcpyDtoH, dev, bufs[i], size, iterations, &h2d, &d2h);
+        if (res != CUDA_SUCCESS)
+            goto cuda_err;
+        printf("%-8s encrypted: HtoD %f MB/s, DtoH %f MB/s\n", names[i], h2d, d2h);
+    }
+
+    cuMemFreeHost(bufs[1]);
+    free(bufs[0]);
+    cuMemFree(dev);
+    bench_exit(&b);
+    dlclose(driver);
+
+    return 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * async: round trips of one buffer per stream, first with synchronous
+ * copies, then with cuMemcpyHtoDAsync / cuMemcpyDtoHAsync on a stream per
+ * buffer, checking the data.
+ */
+static int bench_async(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct timeval tv;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 4 << 20;
+    int nstreams = argc > 1 ? atoi(argv[1]) : 4;
+    int mistakes = 0;
+
+    CUstream *streams = calloc(nstreams, sizeof(*streams));
+    CUdeviceptr *devs = calloc(nstreams, sizeof(*devs));
+    unsigned char **bufs = calloc(nstreams, sizeof(*bufs));
+    unsigned char **res_bufs = calloc(nstreams, sizeof(*res_bufs));
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (int i = 0; i < nstreams; i++) {
+        if ((res = cuStreamCreate(&streams[i], 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemAlloc(&devs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemAllocHost((void **) &bufs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemAllocHost((void **) &res_bufs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (size_t j = 0; j < size; j++)
+            bufs[i][j] = (unsigned char) (j % 251 + i);
+    }
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < nstreams; i++) {
+        if ((res = cuMemcpyHtoD(devs[i], bufs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoH(res_bufs[i], devs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float sync_ms = elapsed_ms(&tv);
+    for (int i = 0; i < nstreams; i++) {
+        mistakes += memcmp(bufs[i], res_bufs[i], size) != 0;
+        memset(res_bufs[i], 0, size);
+    }
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < nstreams; i++) {
+        if ((res = cuMemcpyHtoDAsync(devs[i], bufs[i], size, streams[i])) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    for (int i = 0; i < nstreams; i++) {
+        if ((res = cuMemcpyDtoHAsync(res_bufs[i], devs[i], size, streams[i])) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    for (int i = 0; i < nstreams; i++) {
+        if ((res = cuStreamSynchronize(streams[i])) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float async_ms = elapsed_ms(&tv);
+    for (int i = 0; i < nstreams; i++)
+        mistakes += memcmp(bufs[i], res_bufs[i], size) != 0;
+
+    printf("%d x %zu bytes round trips: sync %f ms, async %f ms, %d mistakes\n",
+           nstreams, size, sync_ms, async_ms, mistakes);
+
+    for (int i = 0; i < nstreams; i++) {
+        cuStreamDestroy(streams[i]);
+        cuMemFree(devs[i]);
+        cuMemFreeHost(bufs[i]);
+        cuMemFreeHost(res_bufs[i]);
+    }
+    bench_exit(&b);
+    free(streams);
+    free(devs);
+    free(bufs);
+    free(res_bufs);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * stall: encrypted uploads to one buffer while spin(cycles) runs on a
+ * non-blocking stream. The uploads only wait for their own work, so they
+ * complete before the kernel does.
+ */
+static int bench_stall(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUstream stream;
+    CUfunction spin;
+    CUdeviceptr dev;
+    struct timeval tv;
+    size_t size = argc > 0 ? strtoull(argv[0], NULL, 0) : 1 << 20;
+    unsigned long long cycles = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000000ull;
+    int uploads = 8;
+    int mistakes = 0;
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(size);
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuModuleGetFunction(&spin, b.module, "_Z4spiny")) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    void *args[] = {&cycles};
+    gettimeofday(&tv, NULL);
+    res = cuLaunchKernel(spin, 1, 1, 1, 1, 1, 1, 0, stream, args, NULL);
+    if (res != CUDA_SUCCESS)
+        goto cuda_err;
+
+    for (int i = 0; i < uploads; i++) {
+        memset(buf, i, size);
+        if ((res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float upload_ms = elapsed_ms(&tv);
+    int stalled = cuStreamQuery(stream) == CUDA_SUCCESS;
+
+    if ((res = cuStreamSynchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    float kernel_ms = elapsed_ms(&tv);
+
+    if ((res = cuMemcpyDtoH(res_buf, dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    mistakes += memcmp(buf, res_buf, size) != 0;
+
+    printf("%d x %zu bytes uploads: %f ms, during a %f ms kernel%s, %d mistakes\n",
+           uploads, size, upload_ms, kernel_ms,
+           stalled ? " (waited for it)" : "", mistakes);
+
+    cuMemFree(dev);
+    cuStreamDestroy(stream);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return stalled || mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * combine: rounds of tiny uploads to distinct allocations, each followed by
+ * a launch reading the first one, without and with write-combining. The
+ * combined uploads must be faster, and the launches and the data must see
+ * them.
+ */
+static int combine_round(int copies, int iterations, size_t write_combine_max,
+                         float *ms, int *mistakes)
+{
+    CUresult res;
+    struct bench b;
+    struct timeval tv;
+    struct cuda_enc_config cfg;
+    CUdeviceptr c_dev;
+    CUdeviceptr *devs = calloc(copies, sizeof(*devs));
+    unsigned char buf[64], res_buf[64];
+    float a = 0, c = 0;
+
+    cuda_enc_config_default(&cfg);
+    cfg.write_combine_max = write_combine_max;
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (int i = 0; i < copies; i++) {
+        if ((res = cuMemAlloc(&devs[i], sizeof(buf))) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    if ((res = cuMemAlloc(&c_dev, sizeof(c))) != CUDA_SUCCESS)
+        goto cuda_err;
+    // c = a * a, a being the first float of devs[0]
+    if ((res = bench_set_mul_params(&b, devs[0], devs[0], c_dev, 1)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    gettimeofday(&tv, NULL);
+    for (int it = 0; it < iterations; it++) {
+        a = it;
+        if ((res = cuMemcpyHtoD(devs[0], &a, sizeof(a))) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (int i = 1; i < copies; i++) {
+            size_t n = 1 + (i * 13) % sizeof(buf);
+            for (size_t j = 0; j < n; j++)
+                buf[j] = (unsigned char) (it * 31 + i * 7 + j);
+            if ((res = cuMemcpyHtoD(devs[i], buf, n)) != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        if ((res = cuLaunchGrid(b.function, 1, 1)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    if ((res = cuCtxSynchronize()) != CUDA_SUCCESS)
+        goto cuda_err;
+    *ms = elapsed_ms(&tv);
+
+    if ((res = cuMemcpyDtoH(&c, c_dev, sizeof(c))) != CUDA_SUCCESS)
+        goto cuda_err;
+    *mistakes += c != a * a;
+    for (int i = 1; i < copies; i++) {
+        size_t n = 1 + (i * 13) % sizeof(buf);
+        for (size_t j = 0; j < n; j++)
+            buf[j] = (unsigned char) ((iterations - 1) * 31 + i * 7 + j);
+        if ((res = cuMemcpyDtoH(res_buf, devs[i], n)) != CUDA_SUCCESS)
+            goto cuda_err;
+        *mistakes += memcmp(buf, res_buf, n) != 0;
+    }
+
+    for (int i = 0; i < copies; i++)
+        cuMemFree(devs[i]);
+    cuMemFree(c_dev);
+    bench_exit(&b);
+    free(devs);
+    return 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+static int bench_combine(int argc, char *argv[])
+{
+    int copies = argc > 0 ? atoi(argv[0]) : 64;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    float plain_ms, combined_ms;
+    int mistakes = 0;
+
+    if (copies < 1)
+        copies = 1;
+    if (combine_round(copies, iterations, 0, &plain_ms, &mistakes) != 0)
+        return -1;
+    if (combine_round(copies, iterations, 64, &combined_ms, &mistakes) != 0)
+        return -1;
+
+    printf("%d x (%d uploads, launch): %f ms, write-combined %f ms, %d mistakes\n",
+           iterations, copies, plain_ms, combined_ms, mistakes);
+
+    return mistakes || combined_ms >= plain_ms ? -1 : 0;
+}
+
+/*
+ * batch: uploads and downloads of many buffers, one cuMemcpy at a time,
+ * then with one cuda_enc_memcpy_batch per direction, checking the data. In
+ * CTR mode, where the copies are packed, the batches must be faster.
+ */
+static int bench_batch(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct timeval tv;
+    struct cuda_enc_config cfg;
+    int copies = argc > 0 ? atoi(argv[0]) : 256;
+    size_t size = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000;
+    int mistakes = 0;
+
+    if (copies < 1)
+        copies = 1;
+    CUdeviceptr *devs = calloc(copies, sizeof(*devs));
+    unsigned char *buf = malloc(copies * size);
+    unsigned char *res_buf = malloc(copies * size);
+    struct cuda_enc_copy *up = calloc(copies, sizeof(*up));
+    struct cuda_enc_copy *down = calloc(copies, sizeof(*down));
+
+    cuda_enc_config_default(&cfg);
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (int i = 0; i < copies; i++) {
+        if ((res = cuMemAlloc(&devs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        up[i] = (struct cuda_enc_copy) {devs[i], buf + i * size, size, CUDA_ENC_HTOD};
+        down[i] = (struct cuda_enc_copy) {devs[i], res_buf + i * size, size, CUDA_ENC_DTOH};
+    }
+    for (size_t j = 0; j < copies * size; j++)
+        buf[j] = (unsigned char) (j % 253);
+
+    gettimeofday(&tv, NULL);
+    for (int i = 0; i < copies; i++) {
+        if ((res = cuMemcpyHtoD(devs[i], buf + i * size, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    for (int i = 0; i < copies; i++) {
+        if ((res = cuMemcpyDtoH(res_buf + i * size, devs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    float single_ms = elapsed_ms(&tv);
+    mistakes += memcmp(buf, res_buf, copies * size) != 0;
+
+    memset(res_buf, 0, copies * size);
+    for (size_t j = 0; j < copies * size; j++)
+        buf[j] = (unsigned char) (j % 251);
+
+    gettimeofday(&tv, NULL);
+    if ((res = cuda_enc_memcpy_batch(up, copies, NULL)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuda_enc_memcpy_batch(down, copies, NULL)) != CUDA_SUCCESS)
+        goto cuda_err;
+    float batch_ms = elapsed_ms(&tv);
+    mistakes += memcmp(buf, res_buf, copies * size) != 0;
+
+    printf("%d x %zu bytes round trips: one at a time %f ms, batched %f ms, %d mistakes\n",
+           copies, size, single_ms, batch_ms, mistakes);
+
+    for (int i = 0; i < copies; i++)
+        cuMemFree(devs[i]);
+    bench_exit(&b);
+    free(devs);
+    free(buf);
+    free(res_buf);
+    free(up);
+    free(down);
+
+    return mistakes || (cfg.mode == CUDA_ENC_MODE_CTR && batch_ms >= single_ms) ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    free(devs);
+    free(buf);
+    free(res_buf);
+    free(up);
+    free(down);
+    return -1;
+}
+
+/*
+ * sizes: copies of odd sizes, at offsets 0 and 3 of one allocation, with the
+ * pipeline disabled so that each is one kernel launch. The largest ones
+ * need a second row of GPU blocks. The bytes around each copy must be
+ * untouched, and those of the copy all transferred.
+ */
+static int bench_sizes(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct cuda_enc_config cfg;
+    CUdeviceptr dev;
+    // 65535 GPU blocks of 256 AES blocks: one full grid row
+    size_t row = 65535ull * 256 * 16;
+    size_t max = argc > 0 ? strtoull(argv[0], NULL, 0) : row + 19;
+    size_t sizes[] = {1, 15, 16, 17, 4095, 4096, 4097, 1 << 20, row - 1, row, row + 3, max};
+    size_t alloc = max + 32;
+    int mistakes = 0, ncopies = 0;
+
+    unsigned char *buf = malloc(alloc);
+    unsigned char *expect = malloc(alloc);
+    unsigned char *res_buf = malloc(alloc);
+
+    cuda_enc_config_default(&cfg);
+    cfg.pipeline_chunk = 0;
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev, alloc)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    memset(expect, 0xa5, alloc);
+    if ((res = cuMemcpyHtoD(dev, expect, alloc)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t offset = 0; offset <= 3; offset += 3) {
+            size_t n = sizes[i];
+            if (n > max)
+                continue;
+
+            for (size_t j = 0; j < n; j++)
+                buf[j] = (unsigned char) (j * 7 + i);
+            memcpy(expect + offset, buf, n);
+            if ((res = cuMemcpyHtoD(dev + offset, buf, n)) != CUDA_SUCCESS)
+                goto cuda_err;
+
+            // the copy itself, then the whole allocation
+            if ((res = cuMemcpyDtoH(res_buf, dev + offset, n)) != CUDA_SUCCESS)
+                goto cuda_err;
+            mistakes += memcmp(buf, res_buf, n) != 0;
+            if ((res = cuMemcpyDtoH(res_buf, dev, alloc)) != CUDA_SUCCESS)
+                goto cuda_err;
+            mistakes += memcmp(expect, res_buf, alloc) != 0;
+            ncopies++;
+        }
+    }
+
+    printf("%d copies of 1 to %zu bytes: %d mistakes\n", ncopies, max, mistakes);
+
+    cuMemFree(dev);
+    bench_exit(&b);
+    free(buf);
+    free(expect);
+    free(res_buf);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * large: round trips of bytes, 4 GiB and more by default, through the _v2
+ * functions, synchronous then on a stream, at an unaligned offset. Needs
+ * bytes of host memory, and as much on the device.
+ */
+static int bench_large(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    CUstream stream;
+    size_t bytes = argc > 0 ? strtoull(argv[0], NULL, 0) : (4ull << 30) + 19;
+    size_t offset = 3, mistakes = 0;
+    struct timeval start;
+    float ms[2];
+
+    unsigned char *buf = malloc(bytes);
+    if (buf == NULL) {
+        fprintf(stderr, "cannot allocate %zu bytes\n", bytes);
+        return -1;
+    }
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuStreamCreate(&stream, 0)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc_v2(&dev, offset + bytes)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < bytes; i++)
+            buf[i] = (unsigned char) (i * 7 + i / 4096 + pass);
+
+        gettimeofday(&start, NULL);
+        if (pass == 0) {
+            if ((res = cuMemcpyHtoD_v2(dev + offset, buf, bytes)) != CUDA_SUCCESS)
+                goto cuda_err;
+            memset(buf, 0, bytes);
+            if ((res = cuMemcpyDtoH_v2(buf, dev + offset, bytes)) != CUDA_SUCCESS)
+                goto cuda_err;
+        } else {
+            if ((res = cuMemcpyHtoDAsync_v2(dev + offset, buf, bytes, stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+            if ((res = cuStreamSynchronize(stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+            memset(buf, 0, bytes);
+            if ((res = cuMemcpyDtoHAsync_v2(buf, dev + offset, bytes, stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+            if ((res = cuStreamSynchronize(stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        ms[pass] = elapsed_ms(&start);
+
+        for (size_t i = 0; i < bytes; i++)
+            mistakes += buf[i] != (unsigned char) (i * 7 + i / 4096 + pass);
+    }
+
+    printf("round trip of %zu bytes: %.0f ms sync, %.0f ms async, %zu mistakes\n",
+           bytes, ms[0], ms[1], mistakes);
+
+    cuMemFree_v2(dev);
+    cuStreamDestroy(stream);
+    bench_exit(&b);
+    free(buf);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    free(buf);
+    return -1;
+}
+
+/*
+ * launch: back to back launches of mul on 16 x 16 floats, one GPU block with
+ * 28 bytes of parameters: through the driver, then with the parameters
+ * sent encrypted by cuLaunchGrid, and by cuLaunchKernel from kernelParams
+ * and from a CU_LAUNCH_PARAM_BUFFER_POINTER buffer. The product must be
+ * right each time. The parameters never change: past the first launch, none
+ * are sent. Write combining and launch batching are off: the driver launch
+ * does not flush the copies and launches they hold back.
+ */
+typedef CUresult launch_grid_func_t(CUfunction f, int grid_width, int grid_height);
+
+struct mul_params {
+    CUdeviceptr a, b, c;
+    unsigned int n;
+};
+
+static CUresult launch_mul(int way, launch_grid_func_t *raw_launch, CUfunction f,
+                           struct mul_params *p)
+{
+    void *params[] = {&p->a, &p->b, &p->c, &p->n};
+    size_t size = 28;
+    void *extra[] = {
+        CU_LAUNCH_PARAM_BUFFER_POINTER, p,
+        CU_LAUNCH_PARAM_BUFFER_SIZE, &size,
+        CU_LAUNCH_PARAM_END,
+    };
+
+    switch (way) {
+    case 0:
+        return raw_launch(f, 1, 1);
+    case 1:
+        return cuLaunchGrid(f, 1, 1);
+    case 2:
+        return cuLaunchKernel(f, 1, 1, 1, 16, 16, 1, 0, NULL, params, NULL);
+    default:
+        return cuLaunchKernel(f, 1, 1, 1, 16, 16, 1, 0, NULL, NULL, extra);
+    }
+}
+
+static int bench_launch(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct mul_params p = {.n = 16};
+    size_t size = p.n * p.n * sizeof(float);
+    int iterations = argc > 0 ? atoi(argv[0]) : 1000;
+    float a[16 * 16], c[16 * 16], zero[16 * 16] = {0};
+    const char *names[4] = {"plain", "cuLaunchGrid", "kernelParams", "extra"};
+    int mistakes = 0;
+    struct timeval start;
+    struct cuda_enc_config cfg;
+
+    void *driver = dlopen("libucuda.so", RTLD_LAZY | RTLD_NOLOAD);
+    launch_grid_func_t *raw_launch = driver
+        ? (launch_grid_func_t *) dlsym(driver, "cuLaunchGrid") : NULL;
+    if (raw_launch == NULL) {
+        fprintf(stderr, "cant find the driver launch function: %s\n", dlerror());
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < p.n * p.n; i++)
+        a[i] = (float) i;
+
+    cuda_enc_config_default(&cfg);
+    cfg.write_combine_max = 0;
+    cfg.launch_batch_max = 0;
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&p.a, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&p.c, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    p.b = p.a;
+    if ((res = cuMemcpyHtoD(p.a, a, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = bench_set_mul_params(&b, p.a, p.b, p.c, p.n)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    printf("%d launches:", iterations);
+    for (int way = 0; way < 4; way++) {
+        if ((res = cuMemcpyHtoD(p.c, zero, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        gettimeofday(&start, NULL);
+        for (int i = 0; i < iterations; i++) {
+            if ((res = launch_mul(way, raw_launch, b.function, &p)) != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        if ((res = cuCtxSynchronize()) != CUDA_SUCCESS)
+            goto cuda_err;
+        printf(" %s %f us%s", names[way], elapsed_ms(&start) * 1000 / iterations,
+               way < 3 ? "," : " per launch,");
+
+        if ((res = cuMemcpyDtoH(c, p.c, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (unsigned int i = 0; i < p.n * p.n; i++)
+            mistakes += c[i] != a[i] * a[i];
+    }
+    printf(" %d mistakes\n", mistakes);
+
+    cuMemFree(p.a);
+    cuMemFree(p.c);
+    bench_exit(&b);
+    dlclose(driver);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+/*
+ * chain: rounds of dependent cuLaunchKernel launches on the NULL stream, like
+ * the Fan1/Fan2 steps of gaussian: launch i multiplies buffer i by buffer 0
+ * into buffer i + 1. Without, then with launch batching, which must be
+ * faster. The last buffer must hold the powers of buffer 0, computed the
+ * same way on the host.
+ */
+static int chain_round(int launches, int iterations, unsigned int launch_batch_max,
+                       float *ms, int *mistakes)
+{
+    CUresult res;
+    struct bench b;
+    struct timeval tv;
+    struct cuda_enc_config cfg;
+    unsigned int n = 16;
+    size_t size = n * n * sizeof(float);
+    float x0[16 * 16], expected[16 * 16], res_buf[16 * 16];
+    CUdeviceptr *devs = calloc(launches + 1, sizeof(*devs));
+
+    for (unsigned int j = 0; j < n * n; j++) {
+        x0[j] = 1.0f + (j % 2 ? -1.0f : 1.0f) * j / 1024;
+        expected[j] = x0[j];
+        for (int i = 0; i < launches; i++)
+            expected[j] *= x0[j];
+    }
+
+    cuda_enc_config_default(&cfg);
+    cfg.launch_batch_max = launch_batch_max;
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (int i = 0; i <= launches; i++) {
+        if ((res = cuMemAlloc(&devs[i], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    gettimeofday(&tv, NULL);
+    for (int it = 0; it < iterations; it++) {
+        if ((res = cuMemcpyHtoD(devs[0], x0, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (int i = 0; i < launches; i++) {
+            void *params[] = {&devs[i], &devs[0], &devs[i + 1], &n};
+            res = cuLaunchKernel(b.function, 1, 1, 1, 16, 16, 1, 0, NULL, params, NULL);
+            if (res != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        if ((res = cuMemcpyDtoH(res_buf, devs[launches], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        *mistakes += memcmp(res_buf, expected, size) != 0;
+    }
+    *ms = elapsed_ms(&tv);
+
+    for (int i = 0; i <= launches; i++)
+        cuMemFree(devs[i]);
+    bench_exit(&b);
+    free(devs);
+    return 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+static int bench_chain(int argc, char *argv[])
+{
+    int launches = argc > 0 ? atoi(argv[0]) : 32;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    float plain_ms, batched_ms;
+    int mistakes = 0;
+
+    if (launches < 1)
+        launches = 1;
+    if (chain_round(launches, iterations, 0, &plain_ms, &mistakes) != 0)
+        return -1;
+    if (chain_round(launches, iterations, 64, &batched_ms, &mistakes) != 0)
+        return -1;
+
+    printf("%d x (upload, %d launches, download): %f ms, batched %f ms, %d mistakes\n",
+           iterations, launches, plain_ms, batched_ms, mistakes);
+
+    return mistakes || batched_ms >= plain_ms ? -1 : 0;
+}
+
+/*
+ * order: with launch batching and write-combining, a deferred launch or a
+ * staged copy must reach the GPU before the memsets that follow it.
+ * c = a * a is launched on the NULL stream, or a few bytes of c uploaded,
+ * then c is cleared by cuMemsetD32 or cuMemsetD8, or filled with 1.0f by
+ * cuMemsetD32Async on a stream: the launch or the copy, sent at the next
+ * copy, would overwrite them otherwise.
+ */
+static int bench_order(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    struct cuda_enc_config cfg;
+    CUstream stream;
+    CUdeviceptr a_dev, c_dev;
+    unsigned int n = 16;
+    size_t size = n * n * sizeof(float);
+    int iterations = argc > 0 ? atoi(argv[0]) : 100;
+    float a[16 * 16], c[16 * 16], one = 1.0f;
+    unsigned int one_bits;
+    int mistakes = 0;
+
+    memcpy(&one_bits, &one, sizeof(one_bits));
+    for (unsigned int i = 0; i < n * n; i++)
+        a[i] = (float) i + 2;
+
+    cuda_enc_config_default(&cfg);
+    cfg.launch_batch_max = 64;
+    cfg.write_combine_max = 4096;
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuStreamCreate(&stream, 0)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&a_dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&c_dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyHtoD(a_dev, a, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    void *params[] = {&a_dev, &a_dev, &c_dev, &n};
+    for (int it = 0; it < iterations; it++) {
+        res = cuLaunchKernel(b.function, 1, 1, 1, 16, 16, 1, 0, NULL, params, NULL);
+        if (res != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemsetD32(c_dev, 0, n * n)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoH(c, c_dev, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (unsigned int i = 0; i < n * n; i++)
+            mistakes += c[i] != 0.0f;
+
+        res = cuLaunchKernel(b.function, 1, 1, 1, 16, 16, 1, 0, NULL, params, NULL);
+        if (res != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemsetD32Async(c_dev, one_bits, n * n, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuStreamSynchronize(stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoH(c, c_dev, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (unsigned int i = 0; i < n * n; i++)
+            mistakes += c[i] != 1.0f;
+
+        if ((res = cuMemcpyHtoD(c_dev, a, 64)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemsetD8(c_dev, 0, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoH(c, c_dev, size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (unsigned int i = 0; i < n * n; i++)
+            mistakes += c[i] != 0.0f;
+    }
+
+    printf("%d x (launch or upload, memset, download): %d mistakes\n", iterations * 3,
+           mistakes);
+
+    cuMemFree(a_dev);
+    cuMemFree(c_dev);
+    cuStreamDestroy(stream);
+    bench_exit(&b);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+typedef CUresult register_global_func_t(const char *name, size_t bytes);
+
+/*
+ * global: copies at random offsets of a module global, of about 1 MiB by
+ * default. With ucuda_stub the global is registered
+ * here, a real module must define bench_global.
+ */
+static int bench_global(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    unsigned int size;
+    size_t bytes = argc > 0 ? strtoull(argv[0], NULL, 0) : (1 << 20) + 5;
+    int mistakes = 0;
+
+    void *driver = dlopen("libucuda.so", RTLD_LAZY | RTLD_NOLOAD);
+    register_global_func_t *register_global = driver
+        ? (register_global_func_t *) dlsym(driver, "ucuda_stub_register_global") : NULL;
+    if (register_global != NULL && register_global("bench_global", bytes) != CUDA_SUCCESS)
+        return -1;
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuModuleGetGlobal(&dev, &size, b.module, "bench_global")) == CUDA_ERROR_NOT_FOUND) {
+        printf("no global bench_global in the module, skipped\n");
+        bench_exit(&b);
+        return 0;
+    } else if (res != CUDA_SUCCESS) {
+        goto cuda_err;
+    }
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    if ((res = cuMemcpyHtoD(dev, buf, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    srand(42);
+    for (int i = 0; i < 100; i++) {
+        size_t offset = (size_t) rand() % size;
+        size_t len = 1 + (size_t) rand() % (size - offset);
+
+        for (size_t j = offset; j < offset + len; j++)
+            buf[j] = (unsigned char) (buf[j] + i + 1);
+        if ((res = cuMemcpyHtoD(dev + offset, buf + offset, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        offset = (size_t) rand() % size;
+        len = 1 + (size_t) rand() % (size - offset);
+        memset(res_buf + offset, 0, len);
+        if ((res = cuMemcpyDtoH(res_buf + offset, dev + offset, len)) != CUDA_SUCCESS)
+            goto cuda_err;
+        mistakes += memcmp(buf + offset, res_buf + offset, len) != 0;
+    }
+
+    if ((res = cuMemcpyDtoH(res_buf, dev, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    mistakes += memcmp(buf, res_buf, size) != 0;
+
+    // past the end of the global
+    if (cuMemcpyHtoD(dev + size - 16, buf, 32) == CUDA_SUCCESS) {
+        printf("copy past the end of the global succeeded\n");
+        mistakes++;
+    }
+
+    printf("global of %u bytes, 100 x (HtoD, DtoH): %d mistakes\n", size, mistakes);
+
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+typedef CUresult dtod_func_t(CUdeviceptr, CUdeviceptr, unsigned int);
+
+/*
+ * dtod: double buffering, a small upload to the front buffer, then a copy of
+ * it to the back buffer, and a swap. The copies must see the uploads, even
+ * write-combined ones, and cost about as much as those of the driver.
+ */
+static int bench_dtod(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev[2], tmp;
+    unsigned int size = argc > 0 ? strtoul(argv[0], NULL, 0) : 4 << 20;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    struct timeval start;
+    float raw_ms, enc_ms;
+    int mistakes = 0;
+
+    void *driver = dlopen("libucuda.so", RTLD_LAZY | RTLD_NOLOAD);
+    dtod_func_t *raw_dtod = driver ? (dtod_func_t *) dlsym(driver, "cuMemcpyDtoD") : NULL;
+    if (raw_dtod == NULL) {
+        fprintf(stderr, "cant find the driver copy functions: %s\n", dlerror());
+        return -1;
+    }
+    if (size < 16)
+        size = 16;
+
+    unsigned char *buf = malloc(size);
+    unsigned char *res_buf = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    if ((res = bench_init(&b)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev[0], size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAlloc(&dev[1], size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyHtoD(dev[0], buf, size)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iterations; i++) {
+        size_t offset = (size_t) i * 16 % (size - 15);
+
+        memset(buf + offset, i + 1, 16);
+        if ((res = cuMemcpyHtoD(dev[0] + offset, buf + offset, 16)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((res = cuMemcpyDtoD(dev[1], dev[0], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        tmp = dev[0];
+        dev[0] = dev[1];
+        dev[1] = tmp;
+    }
+    if ((res = cuCtxSynchronize()) != CUDA_SUCCESS)
+        goto cuda_err;
+    enc_ms = elapsed_ms(&start);
+
+    if ((res = cuMemcpyDtoH(res_buf, dev[0], size)) != CUDA_SUCCESS)
+        goto cuda_err;
+    mistakes += memcmp(buf, res_buf, size) != 0;
+
+    // the same shuffle, without the uploads, through the driver
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iterations; i++) {
+        if ((res = raw_dtod(dev[1], dev[0], size)) != CUDA_SUCCESS)
+            goto cuda_err;
+        tmp = dev[0];
+        dev[0] = dev[1];
+        dev[1] = tmp;
+    }
+    if ((res = cuCtxSynchronize()) != CUDA_SUCCESS)
+        goto cuda_err;
+    raw_ms = elapsed_ms(&start);
+
+    printf("%d x (16 B HtoD, DtoD of %u B): %f ms, driver DtoD alone %f ms, %d mistakes\n",
+           iterations, size, enc_ms, raw_ms, mistakes);
+
+    cuMemFree(dev[0]);
+    cuMemFree(dev[1]);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return mistakes ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+// a 2D copy of width x height bytes between host and device
+static CUDA_MEMCPY2D pitch_copy(int htod, void *host, size_t host_pitch, CUdeviceptr dev,
+                                size_t dev_pitch, size_t width, size_t height)
+{
+    CUDA_MEMCPY2D p;
+
+    memset(&p, 0, sizeof(p));
+    p.srcMemoryType = htod ? CU_MEMORYTYPE_HOST : CU_MEMORYTYPE_DEVICE;
+    p.dstMemoryType = htod ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
+    if (htod) {
+        p.srcHost = host;
+        p.srcPitch = host_pitch;
+        p.dstDevice = dev;
+        p.dstPitch = dev_pitch;
+    } else {
+        p.srcDevice = dev;
+        p.srcPitch = dev_pitch;
+        p.dstHost = host;
+        p.dstPitch = host_pitch;
+    }
+    p.WidthInBytes = width;
+    p.Height = height;
+    return p;
+}
+
+/*
+ * pitch: cuMemcpy2D to and from a cuMemAllocPitch allocation, with host
+ * rows of another pitch, against the same rows copied one at a time, and
+ * a cuMemcpy3D of the allocation as 4 slices. All must round trip, and in
+ * CTR mode, where the rows are packed, the 2D copies must be faster.
+ */
+static int bench_pitch(int argc, char *argv[])
+{
+    CUresult res;
+    struct bench b;
+    CUdeviceptr dev;
+    unsigned int pitch;
+    size_t width = argc > 0 ? strtoull(argv[0], NULL, 0) : 1000;
+    size_t height = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    size_t host_pitch = width + 7;
+    struct timeval start;
+    struct cuda_enc_config cfg;
+    float rows_ms, copy2d_ms;
+    int mistakes = 0;
+    CUDA_MEMCPY2D p;
+
+    if (width == 0 || height < 4)
+        return -1;
+    unsigned char *buf = malloc(host_pitch * height);
+    for (size_t i = 0; i < host_pitch * height; i++)
+        buf[i] = (unsigned char) (i % 251);
+
+    cuda_enc_config_default(&cfg);
+    if ((res = bench_init_config(&b, &cfg)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemAllocPitch(&dev, &pitch, width, height, 4)) != CUDA_SUCCESS)
+        goto cuda_err;
+    // also holds the whole allocation
+    unsigned char *res_buf = malloc((pitch > host_pitch ? pitch : host_pitch) * height);
+
+    // row by row
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iterations; i++) {
+        for (size_t y = 0; y < height; y++) {
+            res = cuMemcpyHtoD(dev + y * pitch, buf + y * host_pitch, width);
+            if (res != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        memset(res_buf, 0, host_pitch * height);
+        for (size_t y = 0; y < height; y++) {
+            res = cuMemcpyDtoH(res_buf + y * host_pitch, dev + y * pitch, width);
+            if (res != CUDA_SUCCESS)
+                goto cuda_err;
+            mistakes += memcmp(buf + y * host_pitch, res_buf + y * host_pitch, width) != 0;
+        }
+    }
+    rows_ms = elapsed_ms(&start);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iterations; i++) {
+        buf[i % width] ^= 0xff;
+        p = pitch_copy(1, buf, host_pitch, dev, pitch, width, height);
+        if ((res = cuMemcpy2D(&p)) != CUDA_SUCCESS)
+            goto cuda_err;
+        memset(res_buf, 0, host_pitch * height);
+        p = pitch_copy(0, res_buf, host_pitch, dev, pitch, width, height);
+        if ((res = cuMemcpy2D(&p)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (size_t y = 0; y < height; y++)
+            mistakes += memcmp(buf + y * host_pitch, res_buf + y * host_pitch, width) != 0;
+    }
+    copy2d_ms = elapsed_ms(&start);
+
+    // a sub-rectangle, read back row by row
+    p = pitch_copy(1, buf + 3, host_pitch, dev, pitch, width / 2, height / 2);
+    p.dstXInBytes = width / 4;
+    p.dstY = height / 4;
+    if ((res = cuMemcpy2D(&p)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (size_t y = 0; y < height / 2; y++) {
+        res = cuMemcpyDtoH(res_buf, dev + (y + height / 4) * pitch + width / 4, width / 2);
+        if (res != CUDA_SUCCESS)
+            goto cuda_err;
+        mistakes += memcmp(buf + 3 + y * host_pitch, res_buf, width / 2) != 0;
+    }
+
+    // 4 slices of height / 4 rows, the host ones with a row of padding
+    CUDA_MEMCPY3D p3;
+    size_t slice = height / 4;
+    memset(&p3, 0, sizeof(p3));
+    p3.srcMemoryType = CU_MEMORYTYPE_HOST;
+    p3.srcHost = buf;
+    p3.srcPitch = host_pitch;
+    p3.srcHeight = slice + 1;
+    p3.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    p3.dstDevice = dev;
+    p3.dstPitch = pitch;
+    p3.dstHeight = slice;
+    p3.WidthInBytes = width;
+    p3.Height = slice;
+    p3.Depth = 4;
+    if ((res = cuMemcpy3D(&p3)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((res = cuMemcpyDtoH(res_buf, dev, pitch * slice * 4)) != CUDA_SUCCESS)
+        goto cuda_err;
+    for (size_t z = 0; z < 4; z++) {
+        for (size_t y = 0; y < slice; y++) {
+            mistakes += memcmp(buf + (z * (slice + 1) + y) * host_pitch,
+                               res_buf + (z * slice + y) * pitch, width) != 0;
+        }
+    }
+
+    printf("%d x (HtoD, DtoH) of %zu x %zu bytes, pitch %u: rows %f ms, 2D %f ms, %d mistakes\n",
+           iterations, width, height, pitch, rows_ms, copy2d_ms, mistakes);
+
+    cuMemFree(dev);
+    bench_exit(&b);
+    free(buf);
+    free(res_buf);
+
+    return mistakes || (cfg.mode == CUDA_ENC_MODE_CTR && copy2d_ms >= rows_ms) ? -1 : 0;
+
+cuda_err:
+    CUDA_PRINT_ERROR(res);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <mode> [args...]\n", prog);
+    fprintf(stderr, "  alloc [iterations]\n");
+    fprintf(stderr, "  copy [bytes] [iterations]\n");
+    fprintf(stderr, "  offset [bytes] [iterations]\n");
+    fprintf(stderr, "  partial [bytes] [iterations]\n");
+    fprintf(stderr, "  threads [threads] [iterations]\n");
+    fprintf(stderr, "  pinned [bytes] [iterations]\n");
+    fprintf(stderr, "  async [bytes] [streams]\n");
+    fprintf(stderr, "  stall [bytes] [cycles]\n");
+    fprintf(stderr, "  combine [copies] [iterations]\n");
+    fprintf(stderr, "  batch [copies] [bytes]\n");
+    fprintf(stderr, "  sizes [bytes]\n");
+    fprintf(stderr, "  large [bytes]\n");
+    fprintf(stderr, "  launch [iterations]\n");
+    fprintf(stderr, "  chain [launches] [iterations]\n");
+    fprintf(stderr, "  global [bytes]\n");
+    fprintf(stderr, "  dtod [bytes] [iterations]\n");
+    fprintf(stderr, "  pitch [width] [height] [iterations]\n");
+    fprintf(stderr, "  order [iterations]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "alloc") == 0) {
+        ret = bench_alloc(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "copy") == 0) {
+        ret = bench_copy(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "offset") == 0) {
+        ret = bench_offset(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "partial") == 0) {
+        ret = bench_partial(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "threads") == 0) {
+        ret = bench_threads(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "pinned") == 0) {
+        ret = bench_pinned(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "async") == 0) {
+        ret = bench_async(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "stall") == 0) {
+        ret = bench_stall(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "combine") == 0) {
+        ret = bench_combine(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        ret = bench_batch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "sizes") == 0) {
+        ret = bench_sizes(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "large") == 0) {
+        ret = bench_large(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "launch") == 0) {
+        ret = bench_launch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "chain") == 0) {
+        ret = bench_chain(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "global") == 0) {
+        ret = bench_global(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "dtod") == 0) {
+        ret = bench_dtod(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "pitch") == 0) {
+        ret = bench_pitch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "order") == 0) {
+        ret = bench_order(argc - 2, argv + 2);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (ret < 0)
+        printf("Test failed\n");
+    else
+        printf("Test passed\n");
+
+    return ret < 0 ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cuda.h>
+#include <stddef.h>
 
 /* Override some of the functions in cuda.h to present encrypted versions:
  * 
@@ -8,6 +9,11 @@
  * CUresult cuMemFree(CUdeviceptr dptr);
  * CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, unsigned int ByteCount);
  * CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount);
+ * CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice, unsigned int ByteCount, CUstream hStream);
+ * CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount, CUstream hStream);
+ *
+ * and their _v2 versions, with size_t byte counts, for buffers of 4 GiB and
+ * more.
  * 
  * /!\ The CUdeviceptr type used by these functions is _not_ compatible with
  * the CUdeviceptr type used by regular CUDA functions! Internally, the
@@ -17,33 +23,261 @@
  */
 
 
+/// Cipher of the transfers.
+enum cuda_enc_mode {
+    /// AES-256-CTR: confidentiality only.
+    CUDA_ENC_MODE_CTR,
+    /// AES-256-GCM: each copy, or pipeline chunk, is a message with its own
+    /// nonce and tag, checked by the GPU for HtoD copies and by the host
+    /// for DtoH copies. Needs ghash_gpu.cubin.
+    CUDA_ENC_MODE_GCM,
+};
+
+/// Tunables of the library. cuda_enc_config_default fills in the defaults,
+/// overridden by the environment variable given for each field.
+struct cuda_enc_config {
+    /// Host threads encrypting a copy, including the calling one
+    /// (CUDA_ENC_CPU_THREADS, default: number of online CPUs).
+    unsigned int cpu_threads;
+    /// Copies smaller than this are encrypted by the calling thread only
+    /// (CUDA_ENC_CPU_PARALLEL_MIN, default: 1 MiB).
+    size_t cpu_parallel_min;
+    /// Copies larger than this are split into chunks of this size, so that
+    /// host encryption, DMA and GPU decryption of successive chunks overlap.
+    /// Rounded up to 4 KiB, at most 1 GiB, 0 disables the pipeline
+    /// (CUDA_ENC_PIPELINE_CHUNK, default: 4 MiB).
+    size_t pipeline_chunk;
+    /// Chunks in flight in the pipeline, from 1 to 15
+    /// (CUDA_ENC_PIPELINE_DEPTH, default: 3).
+    unsigned int pipeline_depth;
+    /// Most bytes of host, and of device, memory held by the bounce buffers
+    /// borrowed by copies (CUDA_ENC_BB_POOL_CAP, default: 64 MiB). A copy
+    /// needs at most pipeline_chunk, or pipeline_depth * pipeline_chunk
+    /// when pipelined.
+    size_t bb_pool_cap;
+    /// Cipher of the transfers (CUDA_ENC_MODE, "ctr" or "gcm", default:
+    /// ctr). Copies that fail authentication return CUDA_ERROR_UNKNOWN, the
+    /// destination then holds undefined data.
+    enum cuda_enc_mode mode;
+    /// Synchronous HtoD copies of at most this many bytes are combined, and
+    /// sent at the next launch, copy, cuMemFree or cuCtxSynchronize as one
+    /// transfer. Their errors are returned by that call. At most 4 KiB, CTR
+    /// mode only (CUDA_ENC_WRITE_COMBINE, default: 0, disabled).
+    size_t write_combine_max;
+    /// cuLaunchKernel launches on the NULL stream whose parameters are
+    /// known (a function of a cubin, or extra) are deferred, up to this
+    /// many, and the changed blocks of their parameters sent with one
+    /// encryption, one DMA and one decryption kernel, ahead of the kernels.
+    /// Needs wc_gpu.cubin. They are launched at the
+    /// next copy, other launch, cuMemFree, cuStreamSynchronize,
+    /// cuEventRecord or cuCtxSynchronize, and their errors are returned by
+    /// that call. At most 64 (CUDA_ENC_LAUNCH_BATCH, default: 0, disabled).
+    unsigned int launch_batch_max;
+};
+
+/// @brief Fill cfg with the default configuration and the environment.
+void cuda_enc_config_default(struct cuda_enc_config *cfg);
+
 /// @brief Setup CUDA for encrypted memcpys.
 ///        Must be called AFTER cuCtxCreate and BEFORE any cuMemAlloc.
 ///
-/// @param key the 16 bytes symmetric key to use, transfered to the device. 
+/// @param key the 16 bytes symmetric key to use, transfered to the device.
 /// @param iv the initial counter value.
 ///
 /// @return  CUDA_SUCCESS on success, or a CUDA error.
 CUresult cuda_enc_setup(char * key, char * iv);
+
+/// @brief Same as cuda_enc_setup, with an explicit configuration.
+CUresult cuda_enc_setup_config(char *key, char *iv, const struct cuda_enc_config *cfg);
 CUresult cuda_enc_release();
+
+/// Direction of a copy of cuda_enc_memcpy_batch.
+enum cuda_enc_copy_dir {
+    CUDA_ENC_HTOD,
+    CUDA_ENC_DTOH,
+};
+
+/// One copy of cuda_enc_memcpy_batch.
+struct cuda_enc_copy {
+    CUdeviceptr dev_ptr; //< inside an allocation of cuMemAlloc
+    void *host_ptr;      //< source of HtoD copies, destination of DtoH ones
+    size_t size;
+    enum cuda_enc_copy_dir dir;
+};
+
+/// @brief Copy a batch of buffers. The copies of each direction are
+///        encrypted in one host pass, packed into one transfer, and
+///        handled on the GPU by one AES kernel and one scatter (HtoD) or
+///        gather (DtoH) kernel, whatever their number.
+///
+/// The HtoD copies run before the DtoH ones, and the device ranges of the
+/// batch must not overlap. Like cuMemcpyHtoDAsync and cuMemcpyDtoHAsync, the
+/// copies are queued on stream, and DtoH copies are done on return. In GCM
+/// mode, without wc_gpu.cubin, or when the copies of a direction add up to
+/// more than 1 GiB, the copies are done one at a time.
+///
+/// @param copies the copies, count of them.
+/// @param stream the stream, NULL for the legacy default stream.
+///
+/// @return CUDA_SUCCESS, or a CUDA error. The copies of the batch may then
+///         be partly done.
+CUresult cuda_enc_memcpy_batch(const struct cuda_enc_copy *copies, unsigned int count,
+                               CUstream stream);
 CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount);
 
+CUresult cuMemAlloc_v2(CUdeviceptr *dptr, size_t bytesize);
+CUresult cuMemFree_v2(CUdeviceptr dptr);
+CUresult cuMemcpyDtoH_v2(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount);
+CUresult cuMemcpyHtoD_v2(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount);
+CUresult cuMemcpyDtoHAsync_v2(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount,
+                              CUstream hStream);
+CUresult cuMemcpyHtoDAsync_v2(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount,
+                              CUstream hStream);
+CUresult cuMemAllocPitch_v2(CUdeviceptr *dptr, size_t *pPitch, size_t WidthInBytes,
+                            size_t Height, unsigned int ElementSizeBytes);
+CUresult cuMemcpy2D_v2(const CUDA_MEMCPY2D *pCopy);
+CUresult cuMemcpy2DUnaligned_v2(const CUDA_MEMCPY2D *pCopy);
+CUresult cuMemcpy2DAsync_v2(const CUDA_MEMCPY2D *pCopy, CUstream hStream);
+CUresult cuMemcpy3D_v2(const CUDA_MEMCPY3D *pCopy);
+CUresult cuMemcpy3DAsync_v2(const CUDA_MEMCPY3D *pCopy, CUstream hStream);
+CUresult cuMemsetD8_v2(CUdeviceptr dstDevice, unsigned char uc, size_t N);
+CUresult cuMemsetD16_v2(CUdeviceptr dstDevice, unsigned short us, size_t N);
+CUresult cuMemsetD32_v2(CUdeviceptr dstDevice, unsigned int ui, size_t N);
+CUresult cuMemsetD2D8_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned char uc, size_t Width,
+                         size_t Height);
+CUresult cuMemsetD2D16_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned short us, size_t Width,
+                          size_t Height);
+CUresult cuMemsetD2D32_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned int ui, size_t Width,
+                          size_t Height);
+CUresult cuCtxDestroy_v2(CUcontext ctx);
+
 
 // Expose the original functions
 
 typedef CUresult cu_memalloc_func_t(CUdeviceptr *dptr, unsigned int bytesize);
+typedef CUresult cu_memalloc_v2_func_t(CUdeviceptr *dptr, size_t bytesize);
 typedef CUresult cu_memfree_func_t(CUdeviceptr dptr);
 typedef CUresult cu_memcpy_d_to_h_func_t(void *dstHost, CUdeviceptr srcDevice, unsigned int ByteCount);
 typedef CUresult cu_memcpy_h_to_d_func_t(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount);
+typedef CUresult cu_memcpy_d_to_h_async_func_t(void *dstHost, CUdeviceptr srcDevice, unsigned int ByteCount, CUstream hStream);
+typedef CUresult cu_memcpy_h_to_d_async_func_t(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount, CUstream hStream);
+typedef CUresult cu_memcpy_d_to_d_func_t(CUdeviceptr dstDevice, CUdeviceptr srcDevice, unsigned int ByteCount);
+typedef CUresult cu_memcpy_d_to_d_async_func_t(CUdeviceptr dstDevice, CUdeviceptr srcDevice, unsigned int ByteCount, CUstream hStream);
+typedef CUresult cu_memcpy_2d_func_t(const CUDA_MEMCPY2D *pCopy);
+typedef CUresult cu_memcpy_2d_async_func_t(const CUDA_MEMCPY2D *pCopy, CUstream hStream);
+typedef CUresult cu_memcpy_3d_func_t(const CUDA_MEMCPY3D *pCopy);
+typedef CUresult cu_memcpy_3d_async_func_t(const CUDA_MEMCPY3D *pCopy, CUstream hStream);
 typedef CUresult cu_launch_grid_t(CUfunction f, int grid_width, int grid_height);
 typedef CUresult cu_launch_grid_t(CUfunction f, int grid_width, int grid_height);
 typedef CUresult cu_param_set_size_t(CUfunction hfunc, unsigned int numbytes);
+typedef CUresult cu_param_seti_t(CUfunction hfunc, int offset, unsigned int value);
+typedef CUresult cu_param_setf_t(CUfunction hfunc, int offset, float value);
+typedef CUresult cu_param_setv_t(CUfunction hfunc, int offset, void *ptr, unsigned int numbytes);
+typedef CUresult cu_module_load_t(CUmodule *module, const char *fname);
+typedef CUresult cu_module_unload_t(CUmodule hmod);
+typedef CUresult cu_module_get_function_t(CUfunction *hfunc, CUmodule hmod, const char *name);
+typedef CUresult cu_module_get_global_t(CUdeviceptr *dptr, unsigned int *bytes, CUmodule hmod,
+                                        const char *name);
+typedef CUresult cu_module_get_global_v2_t(CUdeviceptr *dptr, size_t *bytes, CUmodule hmod,
+                                           const char *name);
+typedef CUresult cu_launch_kernel_t(CUfunction f,
+                                    unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+                                    unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+                                    unsigned int sharedMemBytes, CUstream hStream,
+                                    void **kernelParams, void **extra);
+typedef CUresult cu_ctx_synchronize_t(void);
+typedef CUresult cu_stream_synchronize_t(CUstream hStream);
+typedef CUresult cu_event_record_t(CUevent hEvent, CUstream hStream);
+typedef CUresult cu_stream_query_t(CUstream hStream);
+typedef CUresult cu_stream_wait_event_t(CUstream hStream, CUevent hEvent, unsigned int Flags);
+typedef CUresult cu_event_query_t(CUevent hEvent);
+typedef CUresult cu_event_synchronize_t(CUevent hEvent);
+typedef CUresult cu_ctx_destroy_t(CUcontext ctx);
+typedef CUresult cu_launch_t(CUfunction f);
+typedef CUresult cu_memset_d8_t(CUdeviceptr dstDevice, unsigned char uc, unsigned int N);
+typedef CUresult cu_memset_d8_v2_t(CUdeviceptr dstDevice, unsigned char uc, size_t N);
+typedef CUresult cu_memset_d8_async_t(CUdeviceptr dstDevice, unsigned char uc, unsigned int N,
+                                      CUstream hStream);
+typedef CUresult cu_memset_d16_t(CUdeviceptr dstDevice, unsigned short us, unsigned int N);
+typedef CUresult cu_memset_d16_v2_t(CUdeviceptr dstDevice, unsigned short us, size_t N);
+typedef CUresult cu_memset_d16_async_t(CUdeviceptr dstDevice, unsigned short us, unsigned int N,
+                                       CUstream hStream);
+typedef CUresult cu_memset_d32_t(CUdeviceptr dstDevice, unsigned int ui, unsigned int N);
+typedef CUresult cu_memset_d32_v2_t(CUdeviceptr dstDevice, unsigned int ui, size_t N);
+typedef CUresult cu_memset_d32_async_t(CUdeviceptr dstDevice, unsigned int ui, unsigned int N,
+                                       CUstream hStream);
+typedef CUresult cu_memset_d2d8_t(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned char uc,
+                                  unsigned int Width, unsigned int Height);
+typedef CUresult cu_memset_d2d8_v2_t(CUdeviceptr dstDevice, size_t dstPitch, unsigned char uc,
+                                     size_t Width, size_t Height);
+typedef CUresult cu_memset_d2d8_async_t(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                        unsigned char uc, unsigned int Width, unsigned int Height,
+                                        CUstream hStream);
+typedef CUresult cu_memset_d2d16_t(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned short us,
+                                   unsigned int Width, unsigned int Height);
+typedef CUresult cu_memset_d2d16_v2_t(CUdeviceptr dstDevice, size_t dstPitch, unsigned short us,
+                                      size_t Width, size_t Height);
+typedef CUresult cu_memset_d2d16_async_t(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                         unsigned short us, unsigned int Width, unsigned int Height,
+                                         CUstream hStream);
+typedef CUresult cu_memset_d2d32_t(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned int ui,
+                                   unsigned int Width, unsigned int Height);
+typedef CUresult cu_memset_d2d32_v2_t(CUdeviceptr dstDevice, size_t dstPitch, unsigned int ui,
+                                      size_t Width, size_t Height);
+typedef CUresult cu_memset_d2d32_async_t(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                         unsigned int ui, unsigned int Width, unsigned int Height,
+                                         CUstream hStream);
 
 
 
 extern cu_memalloc_func_t * cu_memalloc;
+extern cu_memalloc_v2_func_t * cu_memalloc_v2; //< NULL with gdev
 extern cu_memfree_func_t * cu_memfree;
 extern cu_memcpy_d_to_h_func_t * cu_memcpy_dh;
 extern cu_memcpy_h_to_d_func_t * cu_memcpy_hd;
+extern cu_memcpy_d_to_h_async_func_t * cu_memcpy_dh_async;
+extern cu_memcpy_h_to_d_async_func_t * cu_memcpy_hd_async;
+extern cu_memcpy_d_to_d_func_t * cu_memcpy_dd;
+extern cu_memcpy_d_to_d_async_func_t * cu_memcpy_dd_async;
+extern cu_memcpy_2d_func_t * cu_memcpy_2d;             //< NULL if the driver has none
+extern cu_memcpy_2d_async_func_t * cu_memcpy_2d_async; //< the same
+extern cu_memcpy_3d_func_t * cu_memcpy_3d;             //< the same
+extern cu_memcpy_3d_async_func_t * cu_memcpy_3d_async; //< the same
 extern cu_launch_grid_t * cu_launch_grid;
 extern cu_param_set_size_t * cu_param_set_size;
+extern cu_param_seti_t * cu_param_seti;
+extern cu_param_setf_t * cu_param_setf;
+extern cu_param_setv_t * cu_param_setv;
+extern cu_module_load_t * cu_module_load;
+extern cu_module_unload_t * cu_module_unload;
+extern cu_module_get_function_t * cu_module_get_function;
+extern cu_module_get_global_t * cu_module_get_global;
+extern cu_module_get_global_v2_t * cu_module_get_global_v2; //< NULL with gdev
+extern cu_launch_kernel_t * cu_launch_kernel;
+extern cu_ctx_synchronize_t * cu_ctx_synchronize;
+extern cu_stream_synchronize_t * cu_stream_synchronize;
+extern cu_event_record_t * cu_event_record;
+extern cu_stream_query_t * cu_stream_query;
+extern cu_stream_wait_event_t * cu_stream_wait_event;
+extern cu_event_query_t * cu_event_query;
+extern cu_event_synchronize_t * cu_event_synchronize;
+extern cu_ctx_destroy_t * cu_ctx_destroy;
+extern cu_launch_t * cu_launch;
+extern cu_memset_d8_t * cu_memset_d8; //< NULL if the driver has none
+extern cu_memset_d8_v2_t * cu_memset_d8_v2;
+extern cu_memset_d8_async_t * cu_memset_d8_async;
+extern cu_memset_d16_t * cu_memset_d16;
+extern cu_memset_d16_v2_t * cu_memset_d16_v2;
+extern cu_memset_d16_async_t * cu_memset_d16_async;
+extern cu_memset_d32_t * cu_memset_d32;
+extern cu_memset_d32_v2_t * cu_memset_d32_v2;
+extern cu_memset_d32_async_t * cu_memset_d32_async;
+extern cu_memset_d2d8_t * cu_memset_d2d8;
+extern cu_memset_d2d8_v2_t * cu_memset_d2d8_v2;
+extern cu_memset_d2d8_async_t * cu_memset_d2d8_async;
+extern cu_memset_d2d16_t * cu_memset_d2d16;
+extern cu_memset_d2d16_v2_t * cu_memset_d2d16_v2;
+extern cu_memset_d2d16_async_t * cu_memset_d2d16_async;
+extern cu_memset_d2d32_t * cu_memset_d2d32;
+extern cu_memset_d2d32_v2_t * cu_memset_d2d32_v2;
+extern cu_memset_d2d32_async_t * cu_memset_d2d32_async;
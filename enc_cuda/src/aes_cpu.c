@@ -2,11 +2,95 @@
 #include "helpers.h"
 #include "cca_benchmark.h"
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
 
+#define AES256_KEY_SIZE 32
+
+/*
+ * Per-thread cipher contexts. The key schedule is computed once per thread
+ * (and again only if the key changes), each call then only resets the
+ * counter. After the first call of a thread, no heap allocation is done.
+ */
+struct aes_cpu_ctx {
+	// [0]: CTR, [1]: GCM, then [0]: decryption, [1]: encryption
+	EVP_CIPHER_CTX *ctx[2][2];
+	unsigned char key[2][2][AES256_KEY_SIZE];
+};
+
+static __thread struct aes_cpu_ctx *thread_ctx;
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_once = PTHREAD_ONCE_INIT;
+
+static void aes_cpu_ctx_free(void *p)
+{
+	struct aes_cpu_ctx *t = p;
+	for (int i = 0; i < 4; i++)
+		EVP_CIPHER_CTX_free(t->ctx[i / 2][i % 2]);
+	free(t);
+}
 
+static void aes_cpu_ctx_key_init(void)
+{
+	// free the contexts of a thread when it exits
+	pthread_key_create(&thread_ctx_key, aes_cpu_ctx_free);
+}
+
+// return the calling thread's context for `gcm` and `enc`, ready to
+// process a new message with key `k` and initial counter (or GCM nonce)
+// `npub`
+static EVP_CIPHER_CTX *aes_cpu_ctx_get(
+  int gcm,
+  int enc,
+  const unsigned char *npub,
+  const unsigned char *k
+)
+{
+	struct aes_cpu_ctx *t = thread_ctx;
+
+	if (t == NULL) {
+		pthread_once(&thread_ctx_once, aes_cpu_ctx_key_init);
+		t = calloc(1, sizeof(*t));
+		if (t == NULL)
+			return NULL;
+		pthread_setspecific(thread_ctx_key, t);
+		thread_ctx = t;
+	}
+
+	EVP_CIPHER_CTX *ctx = t->ctx[gcm][enc];
+	if (ctx == NULL) {
+		const EVP_CIPHER *cipher = gcm ? EVP_aes_256_gcm() : EVP_aes_256_ctr();
+		ctx = EVP_CIPHER_CTX_new();
+		if (ctx == NULL)
+			return NULL;
+		// the default GCM nonce is 12 bytes
+		if (EVP_CipherInit_ex(ctx, cipher, NULL, k, npub, enc) != 1) {
+			EVP_CIPHER_CTX_free(ctx);
+			return NULL;
+		}
+		memcpy(t->key[gcm][enc], k, AES256_KEY_SIZE);
+		t->ctx[gcm][enc] = ctx;
+		return ctx;
+	}
+
+	// new key: recompute the key schedule
+	if (memcmp(t->key[gcm][enc], k, AES256_KEY_SIZE) != 0) {
+		if (EVP_CipherInit_ex(ctx, NULL, NULL, k, npub, enc) != 1)
+			return NULL;
+		memcpy(t->key[gcm][enc], k, AES256_KEY_SIZE);
+		return ctx;
+	}
+
+	// same key: only reset the counter
+	if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, npub, enc) != 1)
+		return NULL;
+	return ctx;
+}
 
 /* AES-256-CTR mode encryption. */
 int aes256_ctr_encrypt_openssl(
@@ -16,40 +100,32 @@ int aes256_ctr_encrypt_openssl(
   const unsigned char *k
 )
 {
-	int ret = EXIT_FAILURE;
+	int flen;
     CCA_MARKER_CPU_ENC;
 
 	DEBUG_PRINTF("aes256_ctr_encrypt_openssl\n");
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	EVP_CIPHER const *cipher = EVP_aes_256_ctr();
-    if (ctx == NULL || cipher == NULL)
-        goto openssl_err;
-
-	if(EVP_EncryptInit_ex(ctx, cipher, NULL, k, npub) != 1)
+	EVP_CIPHER_CTX *ctx = aes_cpu_ctx_get(0, 1, npub, k);
+	if (ctx == NULL)
 		goto openssl_err;
-	
-	// get/set params if necessary, eg IVLEN 
-  	
+
 	// no AD yet
 	// if (EVP_EncryptUpdate(ctx, 0, &outlen, ad,adlen) != 1) goto err;
-	
+
 	// encrypt m into ciphertext c
 	if (EVP_EncryptUpdate(ctx, c, clen, m, mlen) != 1)
 		goto openssl_err;
-	
-	// add trailing padding
-	if (EVP_EncryptFinal_ex(ctx, c, clen) != 1)
-		goto openssl_err; 
 
-	ret = EXIT_SUCCESS;
-	goto cleanup;
+	// no padding in CTR mode, nothing is written
+	if (EVP_EncryptFinal_ex(ctx, c + *clen, &flen) != 1)
+		goto openssl_err;
+	*clen += flen;
+
+	return EXIT_SUCCESS;
 
 openssl_err:
 	ERR_print_errors_fp(stderr);
-cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    return ret;
+	return EXIT_FAILURE;
 }
 
 int aes256_ctr_decrypt_openssl(
@@ -59,37 +135,111 @@ int aes256_ctr_decrypt_openssl(
   const unsigned char *k
 )
 {
-	int ret = EXIT_FAILURE;
+	int flen;
     CCA_MARKER_CPU_DEC;
 
-
 	DEBUG_PRINTF("aes256_ctr_decrypt_openssl\n");
 
+	EVP_CIPHER_CTX *ctx = aes_cpu_ctx_get(0, 0, npub, k);
+	if (ctx == NULL)
+		goto openssl_err;
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	EVP_CIPHER const *cipher = EVP_aes_256_ctr();
-    if (ctx == NULL || cipher == NULL)
-        goto openssl_err;
+	// decrypt c into plaintext m
+	if (EVP_DecryptUpdate(ctx, m, mlen, c, clen) != 1)
+		goto openssl_err;
 
-	if(EVP_DecryptInit_ex(ctx, cipher, NULL, k, npub) != 1)
+	// no padding in CTR mode, nothing is written
+	if (EVP_DecryptFinal_ex(ctx, m + *mlen, &flen) != 1)
 		goto openssl_err;
+	*mlen += flen;
 
-	// get/set params if necessary, eg IVLEN and TAG
-	
-	// encrypt m into ciphertext c
-  	if (EVP_DecryptUpdate(ctx, m, mlen, c, clen) != 1)
-		goto openssl_err; 
-	
-	// add trailing padding
-	if (EVP_DecryptFinal_ex(ctx, m, mlen) != 1)
-		goto openssl_err; 
+	return EXIT_SUCCESS;
 
-	ret = EXIT_SUCCESS;
-	goto cleanup;
+openssl_err:
+	ERR_print_errors_fp(stderr);
+	return EXIT_FAILURE;
+}
+
+// EVP takes int lengths
+#define AES_CPU_UPDATE_MAX (1 << 30)
+
+/* AES-256-GCM encryption, without additional data. */
+int aes256_gcm_encrypt_openssl(
+  unsigned char *c, unsigned char tag[16],
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k
+)
+{
+	int len;
+	CCA_MARKER_CPU_ENC;
+
+	EVP_CIPHER_CTX *ctx = aes_cpu_ctx_get(1, 1, npub, k);
+	if (ctx == NULL)
+		goto openssl_err;
+
+	for (size_t done = 0; done < mlen; done += len) {
+		size_t n = mlen - done < AES_CPU_UPDATE_MAX ? mlen - done : AES_CPU_UPDATE_MAX;
+		if (EVP_EncryptUpdate(ctx, c + done, &len, m + done, n) != 1)
+			goto openssl_err;
+	}
+	if (EVP_EncryptFinal_ex(ctx, c + mlen, &len) != 1)
+		goto openssl_err;
+	if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) != 1)
+		goto openssl_err;
+
+	return EXIT_SUCCESS;
+
+openssl_err:
+	ERR_print_errors_fp(stderr);
+	return EXIT_FAILURE;
+}
+
+int aes256_gcm_decrypt_openssl(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char tag[16],
+  const unsigned char *npub,
+  const unsigned char *k
+)
+{
+	int len;
+	CCA_MARKER_CPU_DEC;
+
+	EVP_CIPHER_CTX *ctx = aes_cpu_ctx_get(1, 0, npub, k);
+	if (ctx == NULL)
+		goto openssl_err;
+
+	for (size_t done = 0; done < clen; done += len) {
+		size_t n = clen - done < AES_CPU_UPDATE_MAX ? clen - done : AES_CPU_UPDATE_MAX;
+		if (EVP_DecryptUpdate(ctx, m + done, &len, c + done, n) != 1)
+			goto openssl_err;
+	}
+	if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *) tag) != 1)
+		goto openssl_err;
+	// fails on a tag mismatch
+	if (EVP_DecryptFinal_ex(ctx, m + clen, &len) != 1)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
 
 openssl_err:
 	ERR_print_errors_fp(stderr);
-cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    return ret;
+	return EXIT_FAILURE;
+}
+
+void aes_ctr_counter_add(
+  unsigned char ctr[16],
+  const unsigned char *npub,
+  uint64_t nblocks
+)
+{
+	unsigned int carry = 0;
+
+	for (int i = 15; i >= 0; i--) {
+		unsigned int sum = npub[i] + (unsigned int) (nblocks & 0xff) + carry;
+		ctr[i] = sum & 0xff;
+		carry = sum >> 8;
+		nblocks >>= 8;
+	}
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 
 int aes256_ctr_encrypt_openssl(
   unsigned char *c,int *clen,
@@ -14,4 +17,29 @@ int aes256_ctr_decrypt_openssl(
   const unsigned char *c, int clen,
   const unsigned char *npub,
   const unsigned char *k
-);
\ No newline at end of file
+);
+
+// AES-256-GCM, without additional data, npub being the 12 bytes nonce.
+// Decryption fails if tag does not match, m then holds unauthenticated
+// plaintext.
+int aes256_gcm_encrypt_openssl(
+  unsigned char *c, unsigned char tag[16],
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k
+);
+
+int aes256_gcm_decrypt_openssl(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char tag[16],
+  const unsigned char *npub,
+  const unsigned char *k
+);
+
+// ctr = npub + nblocks, as the 128-bit big-endian counter of AES-CTR
+void aes_ctr_counter_add(
+  unsigned char ctr[16],
+  const unsigned char *npub,
+  uint64_t nblocks
+);
@@ -0,0 +1,282 @@
+#include "aes_cpu_pool.h"
+#include "aes_cpu.h"
+#include "helpers.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// smallest slice handed to a thread, and slices per thread for balancing
+#define AES_POOL_MIN_SLICE (64 * 1024)
+#define AES_POOL_SLICES_PER_THREAD 4
+
+// largest slice given to OpenSSL at once (its lengths are int)
+#define AES_POOL_MAX_SLICE ROUND_DOWN(INT_MAX, GPU_BLOCK_SIZE)
+
+struct aes_pool_job {
+    int enc;
+    unsigned char *out;
+    const unsigned char *in;
+    size_t len;
+    size_t slice;
+    size_t nslices;
+    const unsigned char *npub;
+    const unsigned char *k;
+    size_t next_slice; //< atomic, next slice to process
+    size_t done_slices; //< atomic
+    int err;
+};
+
+static struct {
+    pthread_t *workers;
+    unsigned int nworkers;
+    size_t min_parallel;
+
+    pthread_mutex_t submit_lock; //< one message at a time
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    struct aes_pool_job *job; //< protected by lock
+    unsigned long generation; //< protected by lock
+    unsigned int busy; //< workers holding job, protected by lock
+    int stop;
+} pool = {
+    .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int aes_pool_run(int enc,
+                        unsigned char *out,
+                        const unsigned char *in,
+                        size_t len,
+                        const unsigned char *npub,
+                        const unsigned char *k)
+{
+    int olen;
+
+    if (enc)
+        return aes256_ctr_encrypt_openssl(out, &olen, in, len, npub, k);
+    return aes256_ctr_decrypt_openssl(out, &olen, in, len, npub, k);
+}
+
+static void aes_pool_run_slices(struct aes_pool_job *job)
+{
+    size_t i;
+    unsigned char ctr[16];
+
+    while ((i = __atomic_fetch_add(&job->next_slice, 1, __ATOMIC_RELAXED)) < job->nslices) {
+        size_t offset = i * job->slice;
+        size_t len = job->len - offset < job->slice ? job->len - offset : job->slice;
+
+        aes_ctr_counter_add(ctr, job->npub, offset / 16);
+        if (aes_pool_run(job->enc, job->out + offset, job->in + offset, len, ctr, job->k) != EXIT_SUCCESS)
+            __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+
+        if (__atomic_add_fetch(&job->done_slices, 1, __ATOMIC_ACQ_REL) == job->nslices) {
+            pthread_mutex_lock(&pool.lock);
+            pthread_cond_broadcast(&pool.done_cond);
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+}
+
+static void *aes_pool_worker(void *arg)
+{
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.stop && (pool.generation == seen || pool.job == NULL))
+            pthread_cond_wait(&pool.job_cond, &pool.lock);
+        if (pool.stop)
+            break;
+
+        seen = pool.generation;
+        struct aes_pool_job *job = pool.job;
+        pool.busy++;
+        pthread_mutex_unlock(&pool.lock);
+
+        aes_pool_run_slices(job);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+            pthread_cond_broadcast(&pool.done_cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+int aes_cpu_pool_init(unsigned int nthreads, size_t min_parallel)
+{
+    pool.min_parallel = min_parallel;
+    pool.stop = 0;
+
+    if (nthreads <= 1)
+        return EXIT_SUCCESS;
+
+    pool.workers = calloc(nthreads - 1, sizeof(*pool.workers));
+    if (pool.workers == NULL)
+        return EXIT_FAILURE;
+
+    for (pool.nworkers = 0; pool.nworkers < nthreads - 1; pool.nworkers++) {
+        if (pthread_create(&pool.workers[pool.nworkers], NULL, aes_pool_worker, NULL) != 0) {
+            PRINT_ERROR("failed to start AES worker %u\n", pool.nworkers);
+            aes_cpu_pool_release();
+            return EXIT_FAILURE;
+        }
+    }
+
+    DEBUG_PRINTF("aes_cpu_pool: %u workers, parallel from %zu bytes\n",
+                 pool.nworkers, pool.min_parallel);
+    return EXIT_SUCCESS;
+}
+
+void aes_cpu_pool_release(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.job_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < pool.nworkers; i++)
+        pthread_join(pool.workers[i], NULL);
+
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nworkers = 0;
+}
+
+static int aes256_ctr_pool(int enc,
+                           unsigned char *out,
+                           const unsigned char *in,
+                           size_t len,
+                           const unsigned char *npub,
+                           const unsigned char *k)
+{
+    struct aes_pool_job job = {
+        .enc = enc, .out = out, .in = in, .len = len,
+        .npub = npub, .k = k,
+    };
+
+    int parallel = pool.nworkers > 0 && len >= pool.min_parallel
+        && pthread_mutex_trylock(&pool.submit_lock) == 0;
+
+    if (parallel) {
+        size_t nthreads = pool.nworkers + 1;
+        job.slice = ROUND_UP(len / (nthreads * AES_POOL_SLICES_PER_THREAD), 16);
+        if (job.slice < AES_POOL_MIN_SLICE)
+            job.slice = AES_POOL_MIN_SLICE;
+    } else {
+        job.slice = AES_POOL_MAX_SLICE;
+    }
+    if (job.slice > AES_POOL_MAX_SLICE)
+        job.slice = AES_POOL_MAX_SLICE;
+    job.nslices = (len + job.slice - 1) / job.slice;
+
+    if (!parallel || job.nslices == 1) {
+        aes_pool_run_slices(&job);
+        if (parallel)
+            pthread_mutex_unlock(&pool.submit_lock);
+        return job.err ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.job_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    aes_pool_run_slices(&job);
+
+    // wait for the last slices, then until no worker references the job
+    pthread_mutex_lock(&pool.lock);
+    pool.job = NULL;
+    while (__atomic_load_n(&job.done_slices, __ATOMIC_ACQUIRE) < job.nslices || pool.busy > 0)
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.submit_lock);
+
+    return job.err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int aes256_ctr_encrypt_pool(
+  unsigned char *c,
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k
+)
+{
+    return aes256_ctr_pool(1, c, m, mlen, npub, k);
+}
+
+int aes256_ctr_decrypt_pool(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char *npub,
+  const unsigned char *k
+)
+{
+    return aes256_ctr_pool(0, m, c, clen, npub, k);
+}
+
+static int aes256_ctr_pool_at(int enc,
+                              unsigned char *out,
+                              const unsigned char *in,
+                              size_t len,
+                              const unsigned char *npub,
+                              const unsigned char *k,
+                              uint64_t offset)
+{
+    unsigned char ctr[16];
+    size_t head = offset % 16;
+
+    aes_ctr_counter_add(ctr, npub, offset / 16);
+
+    // a partial first block goes through a whole block on the side
+    if (head != 0 && len > 0) {
+        unsigned char block[16] = {0};
+        size_t n = 16 - head < len ? 16 - head : len;
+
+        memcpy(block + head, in, n);
+        if (aes_pool_run(enc, block, block, sizeof(block), ctr, k) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        memcpy(out, block + head, n);
+
+        out += n;
+        in += n;
+        len -= n;
+        aes_ctr_counter_add(ctr, ctr, 1);
+    }
+
+    if (len == 0)
+        return EXIT_SUCCESS;
+    return aes256_ctr_pool(enc, out, in, len, ctr, k);
+}
+
+int aes256_ctr_encrypt_pool_at(
+  unsigned char *c,
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k,
+  uint64_t offset
+)
+{
+    return aes256_ctr_pool_at(1, c, m, mlen, npub, k, offset);
+}
+
+int aes256_ctr_decrypt_pool_at(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char *npub,
+  const unsigned char *k,
+  uint64_t offset
+)
+{
+    return aes256_ctr_pool_at(0, m, c, clen, npub, k, offset);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of host threads for AES-256-CTR on large buffers. CTR blocks are
+ * independent, so a message is split into slices that are processed in
+ * parallel, each starting at its own counter value (npub + offset / 16).
+ */
+
+/// @brief Start the worker threads.
+///
+/// @param nthreads total number of threads encrypting a message, including
+///        the calling one. 1 disables the pool.
+/// @param min_parallel messages shorter than this are processed by the
+///        calling thread only.
+///
+/// @return EXIT_SUCCESS or EXIT_FAILURE.
+int aes_cpu_pool_init(unsigned int nthreads, size_t min_parallel);
+void aes_cpu_pool_release(void);
+
+// Same as aes256_ctr_{en,de}crypt_openssl, for messages of any size.
+// If the pool is busy with another message, the calling thread does all
+// the work, so concurrent callers never wait for each other.
+int aes256_ctr_encrypt_pool(
+  unsigned char *c,
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k
+);
+
+int aes256_ctr_decrypt_pool(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char *npub,
+  const unsigned char *k
+);
+
+// Same as above, for a message starting offset bytes into the key stream
+// of npub: only the CTR blocks holding [offset, offset + len) are computed.
+int aes256_ctr_encrypt_pool_at(
+  unsigned char *c,
+  const unsigned char *m, size_t mlen,
+  const unsigned char *npub,
+  const unsigned char *k,
+  uint64_t offset
+);
+
+int aes256_ctr_decrypt_pool_at(
+  unsigned char *m,
+  const unsigned char *c, size_t clen,
+  const unsigned char *npub,
+  const unsigned char *k,
+  uint64_t offset
+);
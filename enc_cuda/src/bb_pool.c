@@ -0,0 +1,217 @@
+#include "bb_pool.h"
+#include "enc_cuda/enc_cuda.h"
+#include "helpers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// classes 0..3 hold 1..4 GPU blocks, then 4 classes per power of two, up
+// to 2^17 GPU blocks (512 MiB). Larger buffers are not cached.
+#define BB_POOL_CLASSES 64
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t put_cond;
+    struct bounce_buffer *free[BB_POOL_CLASSES];
+    size_t cap;
+    size_t total; //< bytes held, borrowed or not
+    size_t borrowed; //< bytes borrowed
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .put_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline unsigned int bb_log2(size_t n)
+{
+    return 63 - __builtin_clzll(n);
+}
+
+// size class of a buffer of n GPU blocks
+static unsigned int bb_class(size_t n)
+{
+    if (n <= 4)
+        return n - 1;
+
+    unsigned int e = bb_log2(n - 1);
+    size_t step = (size_t) 1 << (e - 2);
+    return 4 * (e - 1) + (ROUND_UP(n, step) / step - 5);
+}
+
+// bytes of the buffers of class cls
+static size_t bb_class_size(unsigned int cls)
+{
+    if (cls < 4)
+        return (cls + 1) * GPU_BLOCK_SIZE;
+
+    unsigned int e = cls / 4 + 1;
+    size_t step = (size_t) 1 << (e - 2);
+    return (5 + cls % 4) * step * GPU_BLOCK_SIZE;
+}
+
+static void bb_free(struct bounce_buffer *bb)
+{
+    if (bb->pending)
+        cu_event_synchronize(bb->done);
+    cuEventDestroy(bb->done);
+    cu_memfree(bb->dev);
+    cuMemFreeHost(bb->host);
+    free(bb);
+}
+
+static struct bounce_buffer *bb_alloc(size_t size, unsigned int cls)
+{
+    struct bounce_buffer *bb = calloc(1, sizeof(*bb));
+    if (bb == NULL)
+        return NULL;
+
+    bb->size = size;
+    bb->cls = cls;
+    if (cuEventCreate(&bb->done, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS) {
+        free(bb);
+        return NULL;
+    }
+    if (cuMemAllocHost(&bb->host, size) != CUDA_SUCCESS) {
+        cuEventDestroy(bb->done);
+        free(bb);
+        return NULL;
+    }
+    if (cu_memalloc(&bb->dev, size) != CUDA_SUCCESS) {
+        cuMemFreeHost(bb->host);
+        cuEventDestroy(bb->done);
+        free(bb);
+        return NULL;
+    }
+    return bb;
+}
+
+// unlink a cached buffer of class cls no stream uses anymore
+static struct bounce_buffer *bb_pool_take_idle(unsigned int cls)
+{
+    for (struct bounce_buffer **pbb = &pool.free[cls]; *pbb != NULL; pbb = &(*pbb)->next) {
+        struct bounce_buffer *bb = *pbb;
+        if (bb->pending && cu_event_query(bb->done) != CUDA_SUCCESS)
+            continue;
+        *pbb = bb->next;
+        bb->pending = 0;
+        return bb;
+    }
+    return NULL;
+}
+
+// free cached buffers until size more bytes fit under the cap
+static void bb_pool_evict(size_t size)
+{
+    for (unsigned int cls = 0; cls < BB_POOL_CLASSES && pool.total + size > pool.cap; cls++) {
+        while (pool.free[cls] != NULL && pool.total + size > pool.cap) {
+            struct bounce_buffer *bb = pool.free[cls];
+            pool.free[cls] = bb->next;
+            pool.total -= bb->size;
+            bb_free(bb);
+        }
+    }
+}
+
+void bb_pool_init(size_t cap)
+{
+    pool.cap = cap;
+}
+
+void bb_pool_release(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    for (unsigned int cls = 0; cls < BB_POOL_CLASSES; cls++) {
+        while (pool.free[cls] != NULL) {
+            struct bounce_buffer *bb = pool.free[cls];
+            pool.free[cls] = bb->next;
+            pool.total -= bb->size;
+            bb_free(bb);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+struct bounce_buffer *bb_pool_get(size_t size)
+{
+    struct bounce_buffer *bb = NULL;
+    size_t n = ROUND_UP(size ? size : 1, GPU_BLOCK_SIZE) / GPU_BLOCK_SIZE;
+    unsigned int cls = bb_class(n);
+
+    if (cls < BB_POOL_CLASSES)
+        size = bb_class_size(cls);
+    else
+        size = n * GPU_BLOCK_SIZE;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        if (cls < BB_POOL_CLASSES && pool.free[cls] != NULL) {
+            bb = bb_pool_take_idle(cls);
+            if (bb != NULL)
+                break;
+
+            // all in use by streams: wait for one unless there is room
+            if (pool.total + size > pool.cap) {
+                bb = pool.free[cls];
+                pool.free[cls] = bb->next;
+                break;
+            }
+        }
+
+        bb_pool_evict(size);
+        if (pool.total + size <= pool.cap || pool.borrowed == 0) {
+            // allocated without the lock, the bytes are reserved meanwhile
+            pool.total += size;
+            pool.borrowed += size;
+            pthread_mutex_unlock(&pool.lock);
+
+            bb = bb_alloc(size, cls);
+            if (bb != NULL)
+                return bb;
+
+            PRINT_ERROR("bb_pool: cant allocate %zu bytes\n", size);
+            pthread_mutex_lock(&pool.lock);
+            pool.total -= size;
+            pool.borrowed -= size;
+            pthread_cond_broadcast(&pool.put_cond);
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+
+        pthread_cond_wait(&pool.put_cond, &pool.lock);
+    }
+    pool.borrowed += bb->size;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (bb->pending) {
+        cu_event_synchronize(bb->done);
+        bb->pending = 0;
+    }
+    return bb;
+}
+
+void bb_pool_put(struct bounce_buffer *bb)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.borrowed -= bb->size;
+    if (bb->cls < BB_POOL_CLASSES && pool.total <= pool.cap) {
+        bb->next = pool.free[bb->cls];
+        pool.free[bb->cls] = bb;
+        bb = NULL;
+    } else {
+        pool.total -= bb->size;
+    }
+    pthread_cond_broadcast(&pool.put_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (bb != NULL)
+        bb_free(bb);
+}
+
+void bb_pool_put_async(struct bounce_buffer *bb, CUstream stream)
+{
+    if (cu_event_record(bb->done, stream) == CUDA_SUCCESS)
+        bb->pending = 1;
+    else
+        cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+}
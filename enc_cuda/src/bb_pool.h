@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cuda.h>
+#include <stddef.h>
+
+/*
+ * Pool of bounce buffers, each a host buffer and a device buffer of the
+ * same size, borrowed for the length of one transfer. Host buffers are
+ * page-locked (cuMemAllocHost), so that copies from and to them are DMA'd
+ * directly instead of through the driver's staging buffer, and can be
+ * asynchronous. Pinning is expensive, hence the pool.
+ *
+ * Sizes are rounded up to a size class (4 steps per power of two, from
+ * GPU_BLOCK_SIZE), and returned buffers are kept per class for reuse. The
+ * bytes held by the pool, borrowed or not, stay under a cap: cached buffers
+ * of other classes are freed to make room, and bb_pool_get waits for
+ * returns when all of it is borrowed. A buffer larger than the cap is
+ * still handed out when no other buffer is borrowed.
+ *
+ * A buffer still used by work queued on a stream is returned with
+ * bb_pool_put_async: it is handed out again once that work is done.
+ *
+ * A thread must not borrow a second buffer before returning the first one.
+ */
+
+struct bounce_buffer {
+    void *host;
+    CUdeviceptr dev;
+    size_t size;
+    unsigned int cls;
+    CUevent done; //< recorded by bb_pool_put_async
+    int pending; //< done is recorded and may not have completed
+    struct bounce_buffer *next;
+};
+
+/// @param cap the most bytes of host (and of device) memory held.
+void bb_pool_init(size_t cap);
+void bb_pool_release(void);
+
+/// @return a buffer of at least size bytes, or NULL if out of memory.
+struct bounce_buffer *bb_pool_get(size_t size);
+void bb_pool_put(struct bounce_buffer *bb);
+
+/// @brief Return bb once the work queued on stream so far is done.
+void bb_pool_put_async(struct bounce_buffer *bb, CUstream stream);
@@ -1,13 +1,21 @@
 #include "enc_cuda/enc_cuda.h"
 #include "helpers.h"
 #include "aes_cpu.h"
+#include "aes_cpu_pool.h"
+#include "bb_pool.h"
 #include "cca_benchmark.h"
+#include "nv_info.h"
+#include "range_index.h"
+#include "registry.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
 // for aes_set_key
 #include <dolbeau/aes_scalar.h>
@@ -16,20 +24,56 @@
 #include <dlfcn.h>
 // For dirname
 #include <libgen.h>
-#include <glib.h>
+
+// Both the unsuffixed and the _v2 entry points are defined below. CUDA
+// headers that map the former to the latter would define each one twice
+#undef cuMemAlloc
+#undef cuMemAllocPitch
+#undef cuMemFree
+#undef cuMemcpyDtoH
+#undef cuMemcpyHtoD
+#undef cuMemcpyDtoHAsync
+#undef cuMemcpyHtoDAsync
+#undef cuMemcpyDtoD
+#undef cuMemcpyDtoDAsync
+#undef cuMemcpy2D
+#undef cuMemcpy2DUnaligned
+#undef cuMemcpy2DAsync
+#undef cuMemcpy3D
+#undef cuMemcpy3DAsync
+#undef cuModuleGetGlobal
+#undef cuMemsetD8
+#undef cuMemsetD16
+#undef cuMemsetD32
+#undef cuMemsetD2D8
+#undef cuMemsetD2D16
+#undef cuMemsetD2D32
+#undef cuCtxDestroy
 
 /*
  * XXX Set to 1 to encrypt kernel params
  */
 #define CU_ENCRYPT_KERNEL_PARAM 1
 
+/*
+ * Unpipelined copies are done in segments of at most this many bytes,
+ * aligned in the allocation, so that the byte counts of the DMA and of the
+ * kernels of each segment fit in 32 bits, whatever the size of the copy.
+ * A power of two, at least GPU_BLOCK_SIZE.
+ */
+#ifndef COPY_SEGMENT_MAX
+#define COPY_SEGMENT_MAX (1ull << 30)
+#endif
+
+// the rows of cuMemAllocPitch allocations start at multiples of this
+#define ALLOC_PITCH_ALIGN 512
+
 // Internal type passed to the user as a CUdeviceptr pointer.
-// Wraps a CUdeviceptr, and associates it with two bounce buffers
-// (host and device sides)
+// Wraps a CUdeviceptr. The two bounce buffers (host and device sides) are
+// borrowed from bb_pool for each transfer.
 struct device_buf_with_bb {
     CUdeviceptr dev_ptr; //< device buffer
-    CUdeviceptr dev_bb; //< device bounce buffer
-    void *host_bb; //< host bounce buffer
+    size_t size; //< size requested by cuMemAlloc
 };
 
 // Global device-side state used for encryption:
@@ -41,37 +85,341 @@ static CUdeviceptr d_aes_erdk, d_IV;
 static unsigned char h_key[33], h_IV[33];
 static CUdeviceptr dFT0, dFT1, dFT2, dFT3, dFSb;
 
+// GCM mode: the GHASH function, and a zero counter followed by the hash key
+// H = AES(0), on the device
+static CUfunction ghash_gcm;
+static CUdeviceptr d_gcm;
+
+/*
+ * Pipelined copies (config.pipeline_chunk): chunk i of a copy uses slot
+ * i % depth, which holds its counter value, both on the host and in d_IV
+ * (slot 0 of d_IV is the initial counter), and the events ordering its
+ * stages on the copy and crypto streams.
+ */
+#define PIPELINE_MAX_DEPTH 15
+static struct {
+    pthread_mutex_t lock; //< one pipelined copy at a time
+    CUstream copy_stream, crypto_stream;
+    CUevent copied[PIPELINE_MAX_DEPTH];
+    CUevent crypted[PIPELINE_MAX_DEPTH];
+    CUevent entry, exit; //< order async copies with the caller's stream
+    unsigned char (*ctr)[16]; //< pinned, one counter per slot
+} pipeline = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Write-combining (config.write_combine_max): small synchronous HtoD copies
+ * are staged in plaintext in a pinned buffer, each at a 16 bytes aligned
+ * offset, with a descriptor of their destination. A flush encrypts the
+ * staged bytes at once and uploads them, with the descriptors, in one DMA
+ * after their counter block. One CTR kernel decrypts them in place, and one
+ * wc_scatter kernel moves each copy to its destination.
+ *
+ * The copies are flushed before any launch, other copy, memset, cuMemFree,
+ * stream or event query, synchronization or wait, cuEventRecord,
+ * cuCtxSynchronize, cuCtxDestroy or cuModuleUnload, and before a copy
+ * overlapping one of them is staged.
+ */
+#define WC_DATA_SIZE (64 << 10)
+#define WC_MAX_COPIES 256
+#define WC_COPY_MAX 4096
+
+// also the copies of cuda_enc_memcpy_batch
+struct wc_desc {
+    uint64_t dev;    //< destination of HtoD copies, source of DtoH ones
+    uint32_t offset; //< in the packed data
+    uint32_t n;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    CUfunction scatter, gather; //< NULL if wc_gpu.cubin is missing
+    CUfunction pitch_scatter, pitch_gather; //< of 2D and 3D copies, the same
+    unsigned char *host; //< pinned: counter, data, descriptors
+    CUdeviceptr dev;     //< same layout
+    size_t used;         //< bytes of staged data, a multiple of 16
+    unsigned int ncopies;
+    struct wc_desc desc[WC_MAX_COPIES];
+} wc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define WC_BUFFER_SIZE (16 + WC_DATA_SIZE + WC_MAX_COPIES * sizeof(struct wc_desc))
+
 // key: device mem pointer
-static GHashTable *hash_alloc = NULL;
+static struct registry *hash_alloc = NULL;
+// all allocations, for pointers inside them
+static struct range_index *alloc_ranges = NULL;
 
 #if CU_ENCRYPT_KERNEL_PARAM
-static GHashTable *hash_kernel_param = NULL;
 /*
- * static max size for kernel parameters
- * to account for encryption overhead of kernel parameters
+ * Kernel parameters, as set by cuParamSetSize and cuParamSet{i,f,v} for the
+ * next launch of a function. cuLaunchGrid encrypts exactly these bytes,
+ * and the GPU decrypts them, ahead of the kernel. Functions of modules
+ * loaded from a cubin also get their parameter layout, so that
+ * cuLaunchKernel can pack its kernelParams the same way.
+ *
+ * Applications load their modules before cuda_enc_setup, and use them
+ * until cuModuleUnload: this state is set up on first use, not by
+ * cuda_enc_setup, and outlives cuda_enc_release.
+ *
+ * The parameters of the last launch of a function are kept, decrypted, on
+ * the GPU: a launch only encrypts and sends the 16 bytes blocks that
+ * changed since, and wc_scatter puts them in place. Unchanged blocks are
+ * not encrypted again, so no counter is ever reused. The device copies are
+ * dropped by cuda_enc_release.
+ */
+#define KERNEL_PARAM_MAX 4096
+// the most runs of changed blocks in the parameters of one launch
+#define KERNEL_PARAM_MAX_RUNS (KERNEL_PARAM_MAX / 32)
+struct kernel_params {
+    CUfunction func;
+    CUmodule module; //< NULL if not from cuModuleGetFunction
+    int has_layout;
+    struct nv_info_kparams layout;
+    unsigned int size;
+    unsigned char bytes[KERNEL_PARAM_MAX];
+    pthread_mutex_t lock; //< the last launch
+    CUdeviceptr dev; //< 0 until the first launch after cuda_enc_setup
+    int last_valid;  //< dev holds the last launch
+    size_t last_size;
+    unsigned char last[KERNEL_PARAM_MAX]; //< zero padded
+    struct kernel_params *next; //< in kernel_params_all
+};
+
+// key: CUfunction, value: struct kernel_params
+static struct registry *hash_kernel_param = NULL;
+static struct kernel_params *kernel_params_all = NULL;
+
+/*
+ * Launch batching (config.launch_batch_max): cuLaunchKernel launches on the
+ * NULL stream are deferred, with a copy of their parameters at a 16 bytes
+ * aligned offset, and the blocks of them that changed since the previous
+ * launch of their function. A flush encrypts the changed blocks of all of
+ * them at once, uploads them with their descriptors in one DMA after their
+ * counter block, decrypts them with one CTR kernel, scatters them with one
+ * wc_scatter kernel, then launches the kernels in order, each with its
+ * copy of the parameters. Flushes alternate between two buffers, so that
+ * the upload of one does not wait for the kernels of the previous one.
+ *
+ * The launches are flushed before any copy, memset, other launch,
+ * cuMemFree, stream or event query, synchronization or wait, cuEventRecord,
+ * cuCtxSynchronize, cuCtxDestroy or cuModuleUnload, and when the batch is
+ * full.
  */
-#define KERNEL_PARAM_ENC_BUFFER_SIZE (ROUND_UP(0x2000, GPU_BLOCK_SIZE))
-static CUdeviceptr kernel_param_dev_ptr = 0;
-char *kernel_param_src_buf = NULL;
+#define LAUNCH_BATCH_MAX 64
+#define LAUNCH_BATCH_DATA_SIZE (64 << 10)
+#define LAUNCH_BATCH_MAX_RUNS 1024
+
+struct deferred_launch {
+    CUfunction f;
+    struct kernel_params *kp; //< of f
+    const struct nv_info_kparams *layout; //< to pass kernelParams, NULL for extra
+    unsigned int grid[3], block[3];
+    unsigned int shared_bytes;
+    size_t offset, size; //< of the parameters in the batch
+};
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned char *host[2]; //< pinned: counter, ciphertext
+    CUdeviceptr dev[2];     //< same layout
+    CUevent copied[2];      //< the host buffer is free again
+    unsigned int flushes;
+    unsigned int count;
+    size_t used; //< bytes of parameters, a multiple of 16
+    struct deferred_launch launch[LAUNCH_BATCH_MAX];
+    unsigned char params[LAUNCH_BATCH_DATA_SIZE]; //< plaintext
+    // the changed blocks, in plaintext until the flush
+    size_t delta_used;
+    unsigned int nruns;
+    unsigned char delta[LAUNCH_BATCH_DATA_SIZE];
+    struct wc_desc runs[LAUNCH_BATCH_MAX_RUNS];
+} launch_batch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define LAUNCH_BATCH_BUFFER_SIZE \
+    (16 + LAUNCH_BATCH_DATA_SIZE + LAUNCH_BATCH_MAX_RUNS * sizeof(struct wc_desc))
 #endif
 
+// a module, and the cubin it was loaded from
+struct kernel_module {
+    CUmodule module;
+    char path[PATH_MAX];
+    struct kernel_module *next;
+};
+
 /*
- * Some benchmarks use cuModuleGetGlobal to obtain a global variable
- * which was not allocated with cuAllocMem function.
- * Hence, lookup in hash_alloc will fail.
- * We use cu_module_get_global_buffer_dev_ptr as dev buffer
- * to do dummy gpu encryption on.
+ * Globals of modules, from cuModuleGetGlobal: copies to and from them are
+ * encrypted like those of cuMemAlloc allocations, and find them in
+ * global_ranges when they miss alloc_ranges. Like the modules, they are
+ * registered on first use, not by cuda_enc_setup, until cuModuleUnload.
  */
-static CUdeviceptr cu_module_get_global_buffer_dev_ptr;
-const static int cu_module_get_global_buffer_size = GPU_BLOCK_SIZE * 4;
+struct module_global {
+    struct device_buf_with_bb buf;
+    CUmodule module;
+    struct module_global *next;
+};
+
+static struct kernel_module *kernel_modules = NULL;
+static struct module_global *module_globals = NULL;
+static struct range_index *global_ranges = NULL;
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t modules_once = PTHREAD_ONCE_INIT;
 
 // Recover the original CUDA function pointers
 cu_memalloc_func_t *cu_memalloc;
+cu_memalloc_v2_func_t *cu_memalloc_v2;
 cu_memfree_func_t *cu_memfree;
 cu_memcpy_d_to_h_func_t *cu_memcpy_dh;
 cu_memcpy_h_to_d_func_t *cu_memcpy_hd;
+cu_memcpy_d_to_h_async_func_t *cu_memcpy_dh_async;
+cu_memcpy_h_to_d_async_func_t *cu_memcpy_hd_async;
+cu_memcpy_d_to_d_func_t *cu_memcpy_dd;
+cu_memcpy_d_to_d_async_func_t *cu_memcpy_dd_async;
+cu_memcpy_2d_func_t *cu_memcpy_2d;
+cu_memcpy_2d_async_func_t *cu_memcpy_2d_async;
+cu_memcpy_3d_func_t *cu_memcpy_3d;
+cu_memcpy_3d_async_func_t *cu_memcpy_3d_async;
 cu_launch_grid_t *cu_launch_grid;
 cu_param_set_size_t *cu_param_set_size;
+cu_param_seti_t *cu_param_seti;
+cu_param_setf_t *cu_param_setf;
+cu_param_setv_t *cu_param_setv;
+cu_module_load_t *cu_module_load;
+cu_module_unload_t *cu_module_unload;
+cu_module_get_function_t *cu_module_get_function;
+cu_module_get_global_t *cu_module_get_global;
+cu_module_get_global_v2_t *cu_module_get_global_v2;
+cu_launch_kernel_t *cu_launch_kernel;
+cu_ctx_synchronize_t *cu_ctx_synchronize;
+cu_stream_synchronize_t *cu_stream_synchronize;
+cu_event_record_t *cu_event_record;
+cu_stream_query_t *cu_stream_query;
+cu_stream_wait_event_t *cu_stream_wait_event;
+cu_event_query_t *cu_event_query;
+cu_event_synchronize_t *cu_event_synchronize;
+cu_ctx_destroy_t *cu_ctx_destroy;
+cu_launch_t *cu_launch;
+cu_memset_d8_t *cu_memset_d8;
+cu_memset_d8_v2_t *cu_memset_d8_v2;
+cu_memset_d8_async_t *cu_memset_d8_async;
+cu_memset_d16_t *cu_memset_d16;
+cu_memset_d16_v2_t *cu_memset_d16_v2;
+cu_memset_d16_async_t *cu_memset_d16_async;
+cu_memset_d32_t *cu_memset_d32;
+cu_memset_d32_v2_t *cu_memset_d32_v2;
+cu_memset_d32_async_t *cu_memset_d32_async;
+cu_memset_d2d8_t *cu_memset_d2d8;
+cu_memset_d2d8_v2_t *cu_memset_d2d8_v2;
+cu_memset_d2d8_async_t *cu_memset_d2d8_async;
+cu_memset_d2d16_t *cu_memset_d2d16;
+cu_memset_d2d16_v2_t *cu_memset_d2d16_v2;
+cu_memset_d2d16_async_t *cu_memset_d2d16_async;
+cu_memset_d2d32_t *cu_memset_d2d32;
+cu_memset_d2d32_v2_t *cu_memset_d2d32_v2;
+cu_memset_d2d32_async_t *cu_memset_d2d32_async;
+
+static struct cuda_enc_config config;
+
+static CUresult aes_265_ctr_gpu(CUdeviceptr dst, CUdeviceptr src, size_t nbytes,
+                                CUdeviceptr iv, CUstream stream);
+static CUresult wc_flush(void);
+static CUresult launch_batch_flush(void);
+static CUresult deferred_flush(void);
+
+static pthread_once_t sync_once = PTHREAD_ONCE_INIT;
+
+// applications may synchronize, or copy on the device, before cuda_enc_setup
+static void sync_init(void)
+{
+    cu_stream_synchronize = dlsym(RTLD_NEXT, "cuStreamSynchronize");
+    assert(cu_stream_synchronize != NULL);
+
+    cu_event_record = dlsym(RTLD_NEXT, "cuEventRecord");
+    assert(cu_event_record != NULL);
+
+    cu_stream_query = dlsym(RTLD_NEXT, "cuStreamQuery");
+    assert(cu_stream_query != NULL);
+
+    cu_stream_wait_event = dlsym(RTLD_NEXT, "cuStreamWaitEvent");
+    assert(cu_stream_wait_event != NULL);
+
+    cu_event_query = dlsym(RTLD_NEXT, "cuEventQuery");
+    assert(cu_event_query != NULL);
+
+    cu_event_synchronize = dlsym(RTLD_NEXT, "cuEventSynchronize");
+    assert(cu_event_synchronize != NULL);
+
+    if ((cu_ctx_destroy = dlsym(RTLD_NEXT, "cuCtxDestroy_v2")) == NULL)
+        cu_ctx_destroy = dlsym(RTLD_NEXT, "cuCtxDestroy");
+    assert(cu_ctx_destroy != NULL);
+
+    cu_memcpy_dd = dlsym(RTLD_NEXT, "cuMemcpyDtoD");
+    assert(cu_memcpy_dd != NULL);
+
+    cu_memcpy_dd_async = dlsym(RTLD_NEXT, "cuMemcpyDtoDAsync");
+    assert(cu_memcpy_dd_async != NULL);
+
+    // CUDA_MEMCPY2D and CUDA_MEMCPY3D have size_t fields, like the structs
+    // of the _v2 versions of drivers that have both. NULL if the driver has
+    // none
+    if ((cu_memcpy_2d = dlsym(RTLD_NEXT, "cuMemcpy2D_v2")) == NULL)
+        cu_memcpy_2d = dlsym(RTLD_NEXT, "cuMemcpy2D");
+    if ((cu_memcpy_2d_async = dlsym(RTLD_NEXT, "cuMemcpy2DAsync_v2")) == NULL)
+        cu_memcpy_2d_async = dlsym(RTLD_NEXT, "cuMemcpy2DAsync");
+    if ((cu_memcpy_3d = dlsym(RTLD_NEXT, "cuMemcpy3D_v2")) == NULL)
+        cu_memcpy_3d = dlsym(RTLD_NEXT, "cuMemcpy3D");
+    if ((cu_memcpy_3d_async = dlsym(RTLD_NEXT, "cuMemcpy3DAsync_v2")) == NULL)
+        cu_memcpy_3d_async = dlsym(RTLD_NEXT, "cuMemcpy3DAsync");
+
+    // the _v2 memsets take size_t sizes. NULL if the driver has none
+    cu_memset_d8 = dlsym(RTLD_NEXT, "cuMemsetD8");
+    cu_memset_d8_v2 = dlsym(RTLD_NEXT, "cuMemsetD8_v2");
+    cu_memset_d8_async = dlsym(RTLD_NEXT, "cuMemsetD8Async");
+    cu_memset_d16 = dlsym(RTLD_NEXT, "cuMemsetD16");
+    cu_memset_d16_v2 = dlsym(RTLD_NEXT, "cuMemsetD16_v2");
+    cu_memset_d16_async = dlsym(RTLD_NEXT, "cuMemsetD16Async");
+    cu_memset_d32 = dlsym(RTLD_NEXT, "cuMemsetD32");
+    cu_memset_d32_v2 = dlsym(RTLD_NEXT, "cuMemsetD32_v2");
+    cu_memset_d32_async = dlsym(RTLD_NEXT, "cuMemsetD32Async");
+    cu_memset_d2d8 = dlsym(RTLD_NEXT, "cuMemsetD2D8");
+    cu_memset_d2d8_v2 = dlsym(RTLD_NEXT, "cuMemsetD2D8_v2");
+    cu_memset_d2d8_async = dlsym(RTLD_NEXT, "cuMemsetD2D8Async");
+    cu_memset_d2d16 = dlsym(RTLD_NEXT, "cuMemsetD2D16");
+    cu_memset_d2d16_v2 = dlsym(RTLD_NEXT, "cuMemsetD2D16_v2");
+    cu_memset_d2d16_async = dlsym(RTLD_NEXT, "cuMemsetD2D16Async");
+    cu_memset_d2d32 = dlsym(RTLD_NEXT, "cuMemsetD2D32");
+    cu_memset_d2d32_v2 = dlsym(RTLD_NEXT, "cuMemsetD2D32_v2");
+    cu_memset_d2d32_async = dlsym(RTLD_NEXT, "cuMemsetD2D32Async");
+}
+
+static unsigned long long getenv_ull(const char *name, unsigned long long def)
+{
+    const char *s = getenv(name);
+    if (s == NULL || *s == '\0')
+        return def;
+    return strtoull(s, NULL, 0);
+}
+
+__attribute__((visibility("default")))
+void cuda_enc_config_default(struct cuda_enc_config *cfg)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    cfg->cpu_threads = getenv_ull("CUDA_ENC_CPU_THREADS", ncpus > 0 ? ncpus : 1);
+    cfg->cpu_parallel_min = getenv_ull("CUDA_ENC_CPU_PARALLEL_MIN", 1 << 20);
+    cfg->pipeline_chunk = getenv_ull("CUDA_ENC_PIPELINE_CHUNK", 4 << 20);
+    cfg->pipeline_depth = getenv_ull("CUDA_ENC_PIPELINE_DEPTH", 3);
+    cfg->bb_pool_cap = getenv_ull("CUDA_ENC_BB_POOL_CAP", 64 << 20);
+
+    const char *mode = getenv("CUDA_ENC_MODE");
+    cfg->mode = mode != NULL && strcmp(mode, "gcm") == 0 ? CUDA_ENC_MODE_GCM : CUDA_ENC_MODE_CTR;
+    cfg->write_combine_max = getenv_ull("CUDA_ENC_WRITE_COMBINE", 0);
+    cfg->launch_batch_max = getenv_ull("CUDA_ENC_LAUNCH_BATCH", 0);
+}
 
 static int get_lib_load_path(char *load_path, size_t load_path_buflen)
 {
@@ -108,6 +456,46 @@ __attribute__((visibility("default"))) CUresult cuda_enc_release()
      * XXX: Watch out,
      * free itself relies on some of the data to be freed
      */
+    deferred_flush();
+    #if CU_ENCRYPT_KERNEL_PARAM
+    for (int i = 0; i < 2; i++) {
+        if (launch_batch.dev[i] != 0) {
+            cu_memfree(launch_batch.dev[i]);
+            launch_batch.dev[i] = 0;
+        }
+        if (launch_batch.host[i] != NULL) {
+            cuMemFreeHost(launch_batch.host[i]);
+            launch_batch.host[i] = NULL;
+        }
+        if (launch_batch.copied[i] != NULL) {
+            cuEventDestroy(launch_batch.copied[i]);
+            launch_batch.copied[i] = NULL;
+        }
+    }
+    pthread_mutex_lock(&modules_lock);
+    for (struct kernel_params *kp = kernel_params_all; kp != NULL; kp = kp->next) {
+        pthread_mutex_lock(&kp->lock);
+        if (kp->dev != 0) {
+            cu_memfree(kp->dev);
+            kp->dev = 0;
+        }
+        kp->last_valid = 0;
+        pthread_mutex_unlock(&kp->lock);
+    }
+    pthread_mutex_unlock(&modules_lock);
+    #endif
+    if (wc.dev != 0) {
+        cu_memfree(wc.dev);
+        wc.dev = 0;
+    }
+    if (wc.host != NULL) {
+        cuMemFreeHost(wc.host);
+        wc.host = NULL;
+    }
+    wc.scatter = NULL;
+    wc.gather = NULL;
+    wc.pitch_scatter = NULL;
+    wc.pitch_gather = NULL;
     if (d_aes_erdk != 0) {
         cu_memfree(d_aes_erdk);
     }
@@ -129,42 +517,97 @@ __attribute__((visibility("default"))) CUresult cuda_enc_release()
     if (dFSb != 0) {
         cu_memfree(dFSb);
     }
-    if (cu_module_get_global_buffer_dev_ptr != 0) {
-        /* use cuMemFree not cu_memfree to delete bounce buffers */
-        cuMemFree(cu_module_get_global_buffer_dev_ptr);
+    if (d_gcm != 0) {
+        cu_memfree(d_gcm);
+        d_gcm = 0;
     }
 
-    #if CU_ENCRYPT_KERNEL_PARAM
-    if (kernel_param_dev_ptr != 0) {
-        /* use cuMemFree not cu_memfree to delete bounce buffers */
-        cuMemFree(kernel_param_dev_ptr);
-        kernel_param_dev_ptr = 0;
+    for (int i = 0; i < PIPELINE_MAX_DEPTH; i++) {
+        if (pipeline.copied[i] != NULL) {
+            cuEventDestroy(pipeline.copied[i]);
+            pipeline.copied[i] = NULL;
+        }
+        if (pipeline.crypted[i] != NULL) {
+            cuEventDestroy(pipeline.crypted[i]);
+            pipeline.crypted[i] = NULL;
+        }
     }
-    if (kernel_param_src_buf != NULL) {
-        free(kernel_param_src_buf);
+    if (pipeline.entry != NULL) {
+        cuEventDestroy(pipeline.entry);
+        pipeline.entry = NULL;
     }
-    if (hash_kernel_param != NULL) {
-        g_hash_table_destroy(hash_kernel_param);
+    if (pipeline.exit != NULL) {
+        cuEventDestroy(pipeline.exit);
+        pipeline.exit = NULL;
+    }
+    if (pipeline.copy_stream != NULL) {
+        cuStreamDestroy(pipeline.copy_stream);
+        pipeline.copy_stream = NULL;
+    }
+    if (pipeline.crypto_stream != NULL) {
+        cuStreamDestroy(pipeline.crypto_stream);
+        pipeline.crypto_stream = NULL;
+    }
+    if (pipeline.ctr != NULL) {
+        cuMemFreeHost(pipeline.ctr);
+        pipeline.ctr = NULL;
     }
-    #endif
 
     if (hash_alloc != NULL) {
-        g_hash_table_destroy(hash_alloc);
+        registry_destroy(hash_alloc);
+        hash_alloc = NULL;
+    }
+    if (alloc_ranges != NULL) {
+        range_index_destroy(alloc_ranges);
+        alloc_ranges = NULL;
     }
 
+    aes_cpu_pool_release();
+    bb_pool_release();
+
     return CUDA_SUCCESS;
 }
 
 __attribute__((visibility("default")))
 CUresult cuda_enc_setup(char *key, char *iv)
+{
+    struct cuda_enc_config cfg;
+    cuda_enc_config_default(&cfg);
+    return cuda_enc_setup_config(key, iv, &cfg);
+}
+
+__attribute__((visibility("default")))
+CUresult cuda_enc_setup_config(char *key, char *iv, const struct cuda_enc_config *cfg)
 {
     CUresult ret;
     printf("enccuda\n");
     DEBUG_PRINTF("cuda_enc_setup\n");
 
+    config = *cfg;
+    config.pipeline_chunk = ROUND_UP(config.pipeline_chunk, GPU_BLOCK_SIZE);
+    if (config.pipeline_chunk > COPY_SEGMENT_MAX)
+        config.pipeline_chunk = COPY_SEGMENT_MAX;
+    if (config.pipeline_depth < 1)
+        config.pipeline_depth = 1;
+    if (config.pipeline_depth > PIPELINE_MAX_DEPTH)
+        config.pipeline_depth = PIPELINE_MAX_DEPTH;
+    if (config.write_combine_max > WC_COPY_MAX)
+        config.write_combine_max = WC_COPY_MAX;
+    if (config.mode != CUDA_ENC_MODE_CTR)
+        config.write_combine_max = 0;
+    #if CU_ENCRYPT_KERNEL_PARAM
+    if (config.launch_batch_max > LAUNCH_BATCH_MAX)
+        config.launch_batch_max = LAUNCH_BATCH_MAX;
+    #else
+    config.launch_batch_max = 0;
+    #endif
+
     cu_memalloc = dlsym(RTLD_NEXT, "cuMemAlloc");
     assert(cu_memalloc != NULL);
 
+    // only in drivers with 64-bit sizes, gdev has none
+    cu_memalloc_v2 = dlsym(RTLD_NEXT, "cuMemAlloc_v2");
+
     cu_memfree = dlsym(RTLD_NEXT, "cuMemFree");
     assert(cu_memfree != NULL);
 
@@ -174,21 +617,40 @@ CUresult cuda_enc_setup(char *key, char *iv)
     cu_memcpy_hd = dlsym(RTLD_NEXT, "cuMemcpyHtoD");
     assert(cu_memcpy_hd != NULL);
 
+    cu_memcpy_dh_async = dlsym(RTLD_NEXT, "cuMemcpyDtoHAsync");
+    assert(cu_memcpy_dh_async != NULL);
+
+    cu_memcpy_hd_async = dlsym(RTLD_NEXT, "cuMemcpyHtoDAsync");
+    assert(cu_memcpy_hd_async != NULL);
+
     #if CU_ENCRYPT_KERNEL_PARAM
     cu_launch_grid = dlsym(RTLD_NEXT, "cuLaunchGrid");
     assert(cu_launch_grid != NULL);
 
+    cu_launch = dlsym(RTLD_NEXT, "cuLaunch");
+    assert(cu_launch != NULL);
+
     cu_param_set_size = dlsym(RTLD_NEXT, "cuParamSetSize");
     assert(cu_param_set_size != NULL);
 
-    hash_kernel_param = g_hash_table_new(g_direct_hash, g_direct_equal);
-    if (hash_kernel_param == NULL) {
-        ret = -1;
-        PRINT_ERROR("hash_kernel_param failed to alloc\n");
-        goto cuda_err;
-    }
+    cu_param_seti = dlsym(RTLD_NEXT, "cuParamSeti");
+    assert(cu_param_seti != NULL);
+
+    cu_param_setf = dlsym(RTLD_NEXT, "cuParamSetf");
+    assert(cu_param_setf != NULL);
+
+    cu_param_setv = dlsym(RTLD_NEXT, "cuParamSetv");
+    assert(cu_param_setv != NULL);
     #endif
 
+    cu_launch_kernel = dlsym(RTLD_NEXT, "cuLaunchKernel");
+    assert(cu_launch_kernel != NULL);
+
+    cu_ctx_synchronize = dlsym(RTLD_NEXT, "cuCtxSynchronize");
+    assert(cu_ctx_synchronize != NULL);
+
+    pthread_once(&sync_once, sync_init);
+
     // Get shared library path:
     char load_path[256];
     if (get_lib_load_path(load_path, sizeof(load_path) != EXIT_SUCCESS)) {
@@ -236,8 +698,8 @@ CUresult cuda_enc_setup(char *key, char *iv)
 
     DEBUG_PRINTF("mem alloc: iv and key\n");
 
-    // keys and IV
-    size_t maxb = 16;
+    // keys and IV, and one counter per pipeline slot
+    size_t maxb = 1 + PIPELINE_MAX_DEPTH;
     if ((ret = cu_memalloc(&d_aes_erdk, 256)) != CUDA_SUCCESS)
         goto cuda_err;
     if ((ret = cu_memalloc(&d_IV, 16 * maxb)) != CUDA_SUCCESS)
@@ -288,7 +750,7 @@ CUresult cuda_enc_setup(char *key, char *iv)
         goto cuda_err;
 
     // move initial counter to device
-    ret = cu_memcpy_hd(d_IV, iv, sizeof(iv));
+    ret = cu_memcpy_hd(d_IV, iv, 16);
     if (ret != CUDA_SUCCESS)
         goto cuda_err;
 
@@ -300,39 +762,113 @@ CUresult cuda_enc_setup(char *key, char *iv)
     memcpy(h_key, key, sizeof(h_key));
     memcpy(h_IV, iv, sizeof(h_IV));
 
+    if (config.mode == CUDA_ENC_MODE_GCM) {
+        DEBUG_PRINTF("init: GHASH\n");
+
+        snprintf(module_name, sizeof(module_name), "%s/../share/enc_cuda/ghash_gpu.cubin", load_path);
+        CUmodule ghash_module;
+        if ((ret = cuModuleLoad(&ghash_module, module_name)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cuModuleGetFunction(&ghash_gcm, ghash_module, "ghash_gcm")) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        // H = AES(0): encrypt a zero block with a zero counter
+        static const unsigned char zero[32];
+        if ((ret = cu_memalloc(&d_gcm, 32)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_memcpy_hd(d_gcm, zero, 32)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = aes_265_ctr_gpu(d_gcm + 16, d_gcm + 16, 16, d_gcm, NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_stream_synchronize(NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    // write-combining needs the scatter kernel, batches and 2D copies fall
+    // back to one copy at a time without it
+    DEBUG_PRINTF("init: scatter and gather\n");
+    snprintf(module_name, sizeof(module_name), "%s/../share/enc_cuda/wc_gpu.cubin", load_path);
+    CUmodule wc_module;
+    if (cuModuleLoad(&wc_module, module_name) != CUDA_SUCCESS
+        || cuModuleGetFunction(&wc.scatter, wc_module, "wc_scatter") != CUDA_SUCCESS
+        || cuModuleGetFunction(&wc.gather, wc_module, "wc_gather") != CUDA_SUCCESS
+        || cuModuleGetFunction(&wc.pitch_scatter, wc_module, "pitch_scatter") != CUDA_SUCCESS
+        || cuModuleGetFunction(&wc.pitch_gather, wc_module, "pitch_gather") != CUDA_SUCCESS) {
+        DEBUG_PRINTF("cant load %s\n", module_name);
+        wc.scatter = NULL;
+        wc.gather = NULL;
+        wc.pitch_scatter = NULL;
+        wc.pitch_gather = NULL;
+    }
+
+    if (config.write_combine_max != 0) {
+        if (wc.scatter == NULL) {
+            PRINT_ERROR("write-combining needs %s\n", module_name);
+            ret = CUDA_ERROR_FILE_NOT_FOUND;
+            goto cuda_err;
+        }
+        if ((ret = cuMemAllocHost((void **) &wc.host, WC_BUFFER_SIZE)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_memalloc(&wc.dev, WC_BUFFER_SIZE)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    #if CU_ENCRYPT_KERNEL_PARAM
+    if (config.launch_batch_max != 0 && wc.scatter == NULL) {
+        PRINT_ERROR("launch batching needs %s\n", module_name);
+        ret = CUDA_ERROR_FILE_NOT_FOUND;
+        goto cuda_err;
+    }
+    for (int i = 0; i < 2 && config.launch_batch_max != 0; i++) {
+        ret = cuMemAllocHost((void **) &launch_batch.host[i], LAUNCH_BATCH_BUFFER_SIZE);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_memalloc(&launch_batch.dev[i], LAUNCH_BATCH_BUFFER_SIZE)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cuEventCreate(&launch_batch.copied[i], CU_EVENT_DISABLE_TIMING)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+    #endif
+
     DEBUG_PRINTF("inithash table\n");
-    hash_alloc = g_hash_table_new(g_direct_hash, g_direct_equal);
+    hash_alloc = registry_create();
     if (hash_alloc == NULL) {
         ret = -1;
         goto cuda_err;
     }
-
-    #if CU_ENCRYPT_KERNEL_PARAM
-    /*
-     * Allocate a memory region used to account
-     * for kernel parameter encryption during kernel launch
-     * Arguments cant be larger than KERNEL_PARAM_ENC_BUFFER_SIZE
-     * XXX: use cuMemAlloc to allocate bounce buffer struct, must
-     *      be after init of cuMemAlloc
-     */
-    ret = cuMemAlloc(&kernel_param_dev_ptr, KERNEL_PARAM_ENC_BUFFER_SIZE);
-    if (ret != CUDA_SUCCESS) {
-        PRINT_ERROR("cant allocate kernel_param_dev_ptr with size: %d\n",
-                    KERNEL_PARAM_ENC_BUFFER_SIZE);
+    alloc_ranges = range_index_create();
+    if (alloc_ranges == NULL) {
+        ret = -1;
         goto cuda_err;
     }
-    kernel_param_src_buf = malloc(KERNEL_PARAM_ENC_BUFFER_SIZE);
-    if (kernel_param_src_buf == NULL) {
-        PRINT_ERROR("kernel_param_src_buf failed to malloc\n");
-        ret = CUDA_ERROR_OUT_OF_MEMORY;
-        goto cuda_err;
+
+    if (config.pipeline_chunk != 0) {
+        if ((ret = cuStreamCreate(&pipeline.copy_stream, 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cuStreamCreate(&pipeline.crypto_stream, 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+        ret = cuMemAllocHost((void **) &pipeline.ctr, config.pipeline_depth * 16);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cuEventCreate(&pipeline.entry, CU_EVENT_DISABLE_TIMING)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cuEventCreate(&pipeline.exit, CU_EVENT_DISABLE_TIMING)) != CUDA_SUCCESS)
+            goto cuda_err;
+        for (unsigned int i = 0; i < config.pipeline_depth; i++) {
+            if ((ret = cuEventCreate(&pipeline.copied[i], CU_EVENT_DISABLE_TIMING)) != CUDA_SUCCESS)
+                goto cuda_err;
+            if ((ret = cuEventCreate(&pipeline.crypted[i], CU_EVENT_DISABLE_TIMING)) != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        DEBUG_PRINTF("pipeline: %zu bytes chunks, depth %u\n",
+                     config.pipeline_chunk, config.pipeline_depth);
     }
-    #endif
 
-    ret = cuMemAlloc(&cu_module_get_global_buffer_dev_ptr, cu_module_get_global_buffer_size);
-    if (ret != CUDA_SUCCESS) {
-        PRINT_ERROR("cant allocate cu_module_get_global_buffer_dev_ptr with size: %d\n",
-                    cu_module_get_global_buffer_size);
+    bb_pool_init(config.bb_pool_cap);
+
+    if (aes_cpu_pool_init(config.cpu_threads, config.cpu_parallel_min) != EXIT_SUCCESS) {
+        PRINT_ERROR("cant start %u host AES threads\n", config.cpu_threads);
+        ret = CUDA_ERROR_OPERATING_SYSTEM;
         goto cuda_err;
     }
 
@@ -347,80 +883,140 @@ CUresult cuda_enc_setup(char *key, char *iv)
     return ret;
 }
 
-__attribute__((visibility("default")))
-CUresult cuMemAlloc(CUdeviceptr *dev_ptr, unsigned int bytesize)
+static CUresult mem_alloc(CUdeviceptr *dev_ptr, size_t bytesize)
 {
     assert(cu_memalloc != NULL);
     CUresult ret;
     DEBUG_PRINTF("enc_cuMemAlloc\n");
 
-    // host side structure to hold the actual device pointer, and the pointer
-    // to the two bounce buffers
-    struct device_buf_with_bb *data = malloc(sizeof(struct device_buf_with_bb));
-
-    // bounce buffer sizes
-    // the enc/dec routines will work on multiples of the GPU_BLOCK_SIZE,
-    unsigned int bb_bytesize = ROUND_UP(bytesize, GPU_BLOCK_SIZE);
-
-    // allocate host bounce bufffer
-    data->host_bb = malloc(bb_bytesize);
-    if (data->host_bb == NULL) {
-        ret = CUDA_ERROR_OPERATING_SYSTEM;
-        goto err;
+    if (cu_memalloc_v2 == NULL && bytesize > UINT_MAX) {
+        PRINT_ERROR("the driver cannot allocate %zu bytes at once\n", bytesize);
+        return CUDA_ERROR_INVALID_VALUE;
     }
 
-    // allocate device bounce buffer
-    if ((ret = cu_memalloc(&data->dev_bb, bb_bytesize)) != CUDA_SUCCESS)
+    // host side structure to hold the actual device pointer
+    struct device_buf_with_bb *data = malloc(sizeof(struct device_buf_with_bb));
+    if (data == NULL) {
+        ret = CUDA_ERROR_OPERATING_SYSTEM;
         goto cuda_err;
+    }
 
-    // allocate normal device buffer. Also bb_bytesize because
-    // encryption will read past the end of data!
-    if ((ret = cu_memalloc(&data->dev_ptr, bb_bytesize)) != CUDA_SUCCESS)
-        goto cuda_err;
+    // allocate normal device buffer. Copies decrypt in place only whole
+    // AES blocks inside [offset, offset + ByteCount), so no padding
+    if (cu_memalloc_v2 != NULL)
+        ret = cu_memalloc_v2(&data->dev_ptr, bytesize);
+    else
+        ret = cu_memalloc(&data->dev_ptr, bytesize);
+    if (ret != CUDA_SUCCESS)
+        goto free_data;
 
+    data->size = bytesize;
+    if (registry_insert(hash_alloc, data->dev_ptr, data) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_OUT_OF_MEMORY;
+        goto free_dev;
+    }
+    if (range_index_insert(alloc_ranges, data->dev_ptr, bytesize, data) != EXIT_SUCCESS) {
+        registry_remove(hash_alloc, data->dev_ptr);
+        ret = CUDA_ERROR_OUT_OF_MEMORY;
+        goto free_dev;
+    }
     *dev_ptr = data->dev_ptr;
-    g_hash_table_insert(hash_alloc, (void *) *dev_ptr, data);
 
-    ret = CUDA_SUCCESS;
-    goto cleanup;
+    return CUDA_SUCCESS;
 
+    free_dev:
+    cu_memfree(data->dev_ptr);
+    free_data:
+    free(data);
     cuda_err:
     CUDA_PRINT_ERROR(ret);
-    err:
-    cleanup:
     return ret;
 }
 
+__attribute__((visibility("default")))
+CUresult cuMemAlloc(CUdeviceptr *dev_ptr, unsigned int bytesize)
+{
+    return mem_alloc(dev_ptr, bytesize);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemAlloc_v2(CUdeviceptr *dev_ptr, size_t bytesize)
+{
+    return mem_alloc(dev_ptr, bytesize);
+}
+
+/*
+ * Pitched allocations are allocations like the others: the copies to them
+ * are looked up in alloc_ranges. The driver is not asked for the pitch, it
+ * may have no cuMemAllocPitch.
+ */
+static CUresult mem_alloc_pitch(CUdeviceptr *dev_ptr, size_t *pitch, size_t width,
+                                size_t height, unsigned int element_size)
+{
+    if (element_size != 4 && element_size != 8 && element_size != 16)
+        return CUDA_ERROR_INVALID_VALUE;
+    if (width == 0 || height == 0)
+        return CUDA_ERROR_INVALID_VALUE;
+    if (width > SIZE_MAX - ALLOC_PITCH_ALIGN)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    *pitch = ROUND_UP(width, ALLOC_PITCH_ALIGN);
+    if (height > SIZE_MAX / *pitch)
+        return CUDA_ERROR_INVALID_VALUE;
+    return mem_alloc(dev_ptr, *pitch * height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemAllocPitch(CUdeviceptr *dptr, unsigned int *pPitch, unsigned int WidthInBytes,
+                         unsigned int Height, unsigned int ElementSizeBytes)
+{
+    CUresult ret;
+    size_t pitch;
+
+    // the pitch of a width that fits in 32 bits may not
+    if (WidthInBytes > ROUND_DOWN(UINT_MAX, ALLOC_PITCH_ALIGN))
+        return CUDA_ERROR_INVALID_VALUE;
+    if ((ret = mem_alloc_pitch(dptr, &pitch, WidthInBytes, Height,
+                               ElementSizeBytes)) == CUDA_SUCCESS)
+        *pPitch = pitch;
+    return ret;
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemAllocPitch_v2(CUdeviceptr *dptr, size_t *pPitch, size_t WidthInBytes,
+                            size_t Height, unsigned int ElementSizeBytes)
+{
+    return mem_alloc_pitch(dptr, pPitch, WidthInBytes, Height, ElementSizeBytes);
+}
+
 __attribute__((visibility("default")))
 CUresult cuMemFree(CUdeviceptr dev_ptr)
 {
     assert(cu_memfree != NULL);
     CUresult ret;
 
-    struct device_buf_with_bb *data =
-        g_hash_table_lookup(hash_alloc, (const void *) dev_ptr);
+    // copies to the allocation, or kernels using it, may be pending
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    struct device_buf_with_bb *data = registry_lookup(hash_alloc, dev_ptr);
 
     if (!data) {
         ret = CUDA_ERROR_NOT_FOUND;
-        PRINT_ERROR("free: lookup failed for ptr %ld\n", dev_ptr);
+        PRINT_ERROR("free: lookup failed for ptr %llx\n", (unsigned long long) dev_ptr);
         goto cuda_err;
     }
 
+    // no more lookups may find the buffers being freed. A copy to them
+    // racing this cuMemFree is a use after free, as with the driver
+    registry_remove(hash_alloc, dev_ptr);
+    range_index_remove(alloc_ranges, dev_ptr);
+
     // free normal device buffer
     if ((ret = cu_memfree(data->dev_ptr)) != CUDA_SUCCESS) {
         goto cuda_err;
     }
 
-    // free device bounce buffer
-    if ((ret = cu_memfree(data->dev_bb)) != CUDA_SUCCESS) {
-        goto cuda_err;
-    }
-
-    // free the host side bounce buffer
-    free(data->host_bb);
-
-    g_hash_table_remove(hash_alloc, (const void *) dev_ptr);
-
     // free the wrapper data structure
     free(data);
 
@@ -431,343 +1027,2831 @@ CUresult cuMemFree(CUdeviceptr dev_ptr)
     return ret;
 }
 
+__attribute__((visibility("default")))
+CUresult cuMemFree_v2(CUdeviceptr dev_ptr)
+{
+    return cuMemFree(dev_ptr);
+}
+
 // /!\ here dst and src are REAL CUdeviceptr, and not pointers to the wrapper
-static CUresult aes_265_ctr_gpu(CUdeviceptr dst, CUdeviceptr src, unsigned int bb_buflen)
+// iv is the device address of the counter of the first block. nbytes is a
+// multiple of the AES block: the grid covers exactly nbytes / 16 blocks, and
+// nothing past dst + nbytes is written, so dst may be src. Byte counts that
+// are not are rounded by the callers to the CTR blocks they touch, the
+// bytes around the copy going through the bounce buffer. The kernel only
+// gets the address of the first counter, so a launch cant be split here:
+// callers keep each one within COPY_SEGMENT_MAX bytes, like the segments
+// and pipeline chunks they encrypt.
+static CUresult aes_265_ctr_gpu(CUdeviceptr dst, CUdeviceptr src, size_t nbytes,
+                                CUdeviceptr iv, CUstream stream)
 {
-    DEBUG_PRINTF("aes_265_ctr_gpu dst: %lx, src: %lx, s: %lx\n", dst, src, bb_buflen);
+    DEBUG_PRINTF("aes_265_ctr_gpu dst: %llx, src: %llx, s: %zx\n",
+                 (unsigned long long) dst, (unsigned long long) src, nbytes);
     CCA_MARKER_GPU_ENC_KERNEL;
 
-    // How many GPU blocks = batch of AES blocks?
-    assert((bb_buflen & GPU_BLOCK_MASK) == 0);
-    int nfullgpuaesblock = bb_buflen / GPU_BLOCK_SIZE;
+    assert((nbytes & 15) == 0);
+    assert(nbytes <= COPY_SEGMENT_MAX);
+    if (nbytes == 0)
+        return CUDA_SUCCESS;
+
+    // How many AES blocks, and GPU blocks = batch of 256 AES blocks?
+    uint32_t nfullaesblock = nbytes / 16;
+    unsigned int ngpublock = (nfullaesblock + 255ull) / 256;
 
     // gridsize
-    int gx, gy, gz;
+    unsigned int gx, gy, gz;
     // blocksize
-    int bx, by, bz;
+    unsigned int bx, by, bz;
 
-    gy = gz = 1;
-    gx = nfullgpuaesblock;
-    while (gx >= 65536) {
-        gx /= 2;
-        gy *= 2;
-    }
-    nfullgpuaesblock = gx * gy;
+    // The kernel numbers its threads (x + y * gridDim.x) * 256 + tid, and
+    // those past the last AES block do nothing. Below 65535 GPU blocks
+    // (256 MiB) the grid is one row, above it the fewest rows of at most
+    // 65535: gx * gy >= ngpublock, with fewer than gy idle GPU blocks.
+    gz = 1;
+    gy = (ngpublock + 65534) / 65535;
+    gx = (ngpublock + gy - 1) / gy;
 
     by = bz = 1;
     bx = 256;
 
-    // we don't want to have any leftover to process on the host!
-    size_t dataleft = bb_buflen - (nfullgpuaesblock * GPU_BLOCK_SIZE);
-    assert(dataleft == 0);
-
-    // How many AES blocks in total?
-    int nfullaesblock = 256 * nfullgpuaesblock;
-
     void *kernel_args[] = {
         &src, &dst, // in, out
         &d_aes_erdk,             // diagonalized subkeys
         &nfullaesblock,
-        &dFT0, &dFT1, &dFT2, &dFT3, &dFSb, &d_IV};
+        &dFT0, &dFT1, &dFT2, &dFT3, &dFSb, &iv};
 
 
     // dynamic memory. XXX: random value here! would 0 work ?
     size_t sharedMemBytes = 64;
 
-    return cuLaunchKernel(
+    return cu_launch_kernel(
         aes_ctr_dolbeau,
         gx, gy, gz,
         bx, by, bz,
         sharedMemBytes,
-        0, // default stream
+        stream,
         kernel_args,
         NULL);
 }
 
+static CUresult memcpy_hd_on(CUdeviceptr dst, const void *src, size_t n, CUstream stream)
+{
+    if (stream != NULL)
+        return cu_memcpy_hd_async(dst, src, n, stream);
+    return cu_memcpy_hd(dst, src, n);
+}
 
-inline static CUresult do_cuMemcpyHtoD(CUdeviceptr dstDevice,
-                         const void *srcHost,
-                         unsigned int ByteCount,
-                         struct device_buf_with_bb *data
-)
+static CUresult memcpy_dh_on(void *dst, CUdeviceptr src, size_t n, CUstream stream)
 {
+    if (stream != NULL)
+        return cu_memcpy_dh_async(dst, src, n, stream);
+    return cu_memcpy_dh(dst, src, n);
+}
 
-    assert(cu_memcpy_hd != NULL);
-    CUresult ret;
+static CUresult memcpy_dd_on(CUdeviceptr dst, CUdeviceptr src, size_t n, CUstream stream)
+{
+    if (stream != NULL)
+        return cu_memcpy_dd_async(dst, src, n, stream);
+    return cu_memcpy_dd(dst, src, n);
+}
 
-    CUdeviceptr dev_ptr = dstDevice;
-    CUdeviceptr dev_bb = data->dev_bb;
-    char *host_bb = data->host_bb;
+/*
+ * Counter space: each copy reserves the counters of the CTR blocks it
+ * encrypts, so that no two copies, or two writes of the same bytes, share
+ * key stream. Reserving is one atomic add, and the chunks of a copy derive
+ * their counters from its reservation without coordinating.
+ */
+static uint64_t ctr_space_next;
 
-    /*
-     * XXX: The current dummy implementation accounts for the encryption
-     * overhead but does not rely on encryption results.
-     * We may later transfer encrypted payload once correctly working
-     *
-     * Host to Device:
-     * - 1.) Host: Enc srcHost to dummy buffer
-     * - 2.) Host: transfer unencrypted payload
-     * - 3.) Dev: Decrypt (unencrypted payload) to dummy buffer
-     */
+/*
+ * Reserve the counters of the blocks [lo16, hi16) of an allocation, and
+ * return the key stream position of its byte 0: byte p of the copy is
+ * encrypted with the key stream of h_IV at position origin + p, the block
+ * at p (16-aligned) with the counter h_IV + (origin + p) / 16.
+ */
+static uint64_t ctr_space_reserve(size_t lo16, size_t hi16)
+{
+    uint64_t base = __atomic_fetch_add(&ctr_space_next, (hi16 - lo16) / 16, __ATOMIC_RELAXED);
+    return base * 16 - lo16;
+}
 
-    // XXX: here we encrypt just the buffer, but decrypt
-    //  buffer + padding on the device, then truncate. This works
-    //  because there is no authentication, but won't with GCM!
-    //  We need to also encrypt the padding that will be decrypted.
-    //  Possible using the openssl interface directly (update twice)
-    unsigned int bb_buflen = ROUND_UP(ByteCount, GPU_BLOCK_SIZE);
-    DEBUG_PRINTF("encrypt host bounce buffer\n");
+/*
+ * Copies work on the CTR blocks [lo16, hi16) holding [offset, offset + n).
+ * When offset and n are both multiples of 16, the ciphertext is decrypted
+ * (or encrypted) in place in device memory. Otherwise, the kernel would
+ * clobber the bytes around the copy: the blocks go through the device side
+ * of the bounce buffer, and a device to device copy moves the exact bytes.
+ *
+ * The bounce buffer holds the counter of block lo16 in its first 16 bytes,
+ * then the blocks, byte offset then being at bb + 16 + (offset - lo16).
+ */
+static int copy_aligned(size_t offset, size_t n)
+{
+    return ((offset | n) & 15) == 0;
+}
 
-    int clen;
-    if (aes256_ctr_encrypt_openssl(
-        host_bb, &clen,   // c
-        srcHost, ByteCount, // m
-        h_IV, h_key) != EXIT_SUCCESS) {
-        ret = CUDA_ERROR_UNKNOWN;
-        goto cuda_err;
-    }
-    assert(clen <= bb_buflen);
+/*
+ * GCM mode: each copy, and each chunk of a pipelined copy, is an AES-GCM
+ * message of its own, without additional data, under a fresh nonce made of
+ * the first 4 bytes of h_IV and a 64-bit message count. The bounce buffer
+ * holds a header, then the ciphertext of the message:
+ *
+ *   J0 (16 bytes): nonce || 1, the counter block encrypting the tag
+ *   J1 (16 bytes): nonce || 2, the counter block of the first block
+ *   V  (16 bytes): the tag, XORed with GHASH(C) and AES(J0) on the device
+ *
+ * The host does AES-CTR and GHASH in one pass (OpenSSL). The GPU runs the
+ * CTR kernel from J1 (no copy wraps the low 32 bits, so its 128-bit
+ * increment is the 32-bit one of GCM), and the GHASH kernel over C.
+ */
+#define GCM_HDR 48
 
-    DEBUG_PRINTF("copy bounce buffer on device\n");
-    ret = cu_memcpy_hd(dev_ptr, srcHost, ByteCount);
-    if (ret != CUDA_SUCCESS) {
-        goto cuda_err;
-    }
+static uint64_t gcm_nonce_next;
 
-    DEBUG_PRINTF("decrypt on device from bounce buffer to destination\n");
+static void gcm_header(unsigned char *hdr)
+{
+    uint64_t n = __atomic_fetch_add(&gcm_nonce_next, 1, __ATOMIC_RELAXED);
+
+    memcpy(hdr, h_IV, 4);
+    for (int i = 0; i < 8; i++)
+        hdr[4 + i] = n >> (56 - 8 * i);
+    memcpy(hdr + 12, "\0\0\0\1", 4);
+    memcpy(hdr + 16, hdr, 12);
+    memcpy(hdr + 28, "\0\0\0\2", 4);
+    memset(hdr + 32, 0, 16);
+}
 
-    cuCtxSynchronize();
+// tag ^= GHASH_H(the nbytes at src, and their length block)
+static CUresult ghash_gpu(CUdeviceptr tag, CUdeviceptr src, unsigned int nbytes,
+                          CUstream stream)
+{
+    DEBUG_PRINTF("ghash_gpu tag: %llx, src: %llx, s: %x\n",
+                 (unsigned long long) tag, (unsigned long long) src, nbytes);
 
-    // XXX: data->dev_bb contains the decrypted garbage
-    ret = aes_265_ctr_gpu(dev_bb, dev_ptr, bb_buflen);
-    if (ret != CUDA_SUCCESS) {
-        goto cuda_err;
-    }
+    // about 32 blocks per thread: each thread then spends about as long on
+    // its segment as on shifting it, by up to 2^28 blocks
+    unsigned int nthreads = ((nbytes + 15) / 16 + 1 + 31) / 32;
+    int gx = (nthreads + 255) / 256;
+    if (gx > 65535)
+        gx = 65535;
 
-    return CUDA_SUCCESS;
+    CUdeviceptr H = d_gcm + 16;
+    void *kernel_args[] = {&src, &nbytes, &H, &tag};
 
-    cuda_err:
-    CUDA_PRINT_ERROR(ret);
-    return ret;
+    return cu_launch_kernel(ghash_gcm, gx, 1, 1, 256, 1, 1, 0, stream, kernel_args, NULL);
+}
 
+// HtoD, on the host: a fresh header, the ciphertext of the n bytes at m and
+// its tag, in V
+static int gcm_seal(unsigned char *hdr, const void *m, size_t n)
+{
+    gcm_header(hdr);
+    return aes256_gcm_encrypt_openssl(hdr + GCM_HDR, hdr + 32, m, n, hdr, h_key);
 }
 
+// HtoD: upload the header, and the ciphertext, to dst if the copy is aligned
+static CUresult gcm_htod_copy(CUdeviceptr dst, const unsigned char *hdr,
+                              CUdeviceptr dev_hdr, size_t n, int aligned, CUstream stream)
+{
+    CUresult ret;
 
-inline static CUresult do_cuMemcpyDtoH(
-    void *dstHost,
-    CUdeviceptr srcDevice,
-    unsigned int ByteCount,
-    struct device_buf_with_bb *data
-)
+    if (!aligned)
+        return memcpy_hd_on(dev_hdr, hdr, GCM_HDR + n, stream);
+    if ((ret = memcpy_hd_on(dev_hdr, hdr, GCM_HDR, stream)) != CUDA_SUCCESS)
+        return ret;
+    return memcpy_hd_on(dst, hdr + GCM_HDR, n, stream);
+}
+
+// V ^= AES(J0), and C ^= the CTR stream from J1, for a copy of n bytes in the
+// bounce buffer. V and C are contiguous and J1 follows J0: one launch covers
+// both, unless that makes it larger than a segment
+static CUresult gcm_ctr_vc(CUdeviceptr dev_hdr, size_t n, CUstream stream)
 {
-    assert(cu_memcpy_hd != NULL);
     CUresult ret;
-    unsigned int bb_buflen = ROUND_UP(ByteCount, GPU_BLOCK_SIZE);
-    CUdeviceptr dev_ptr = srcDevice;
-    CUdeviceptr dev_bb = data->dev_bb;
-    const char *host_bb = data->host_bb;
+    CUdeviceptr v = dev_hdr + 32;
 
-    /*
-    * XXX: The current dummy implementation accounts for the encryption
-    * overhead but does not rely on encryption results.
-    * We may later transfer encrypted payload once correctly working
-    *
-    * Device to Host:
-    * - 1.) Dev: Encrypt data to dummy buffer
-    * - 2.) Host: Decrypt garbage host buffer to dstHost
-    * - 3.) Dev: transfer unencrypted payload
-    *
-    * Due to the dummy implementation we
-    * switch 2 and 3. in order not to allocate an additional buffer.
-    * This way we write to dstHost twice. Once garbage and 2nd the result.
-    */
-    ret = aes_265_ctr_gpu(dev_bb, dev_ptr, bb_buflen);
-    if (ret != CUDA_SUCCESS)
-        goto cuda_err;
+    if (16 + ROUND_UP(n, 16) <= COPY_SEGMENT_MAX)
+        return aes_265_ctr_gpu(v, v, 16 + ROUND_UP(n, 16), dev_hdr, stream);
+    if ((ret = aes_265_ctr_gpu(v, v, 16, dev_hdr, stream)) != CUDA_SUCCESS)
+        return ret;
+    return aes_265_ctr_gpu(dev_hdr + GCM_HDR, dev_hdr + GCM_HDR, ROUND_UP(n, 16),
+                           dev_hdr + 16, stream);
+}
 
-    DEBUG_PRINTF("decrypt on host from bounce buffer to destination\n");
-    cuCtxSynchronize();
-
-    // decrypt on host from bounce buffer
-    int mlen;
-    if (aes256_ctr_decrypt_openssl(
-        dstHost, &mlen,
-        host_bb, ByteCount,
-        h_IV, h_key
-    ) != EXIT_SUCCESS) {
-        ret = CUDA_ERROR_UNKNOWN;
-        goto cuda_err;
-    }
+// HtoD: authenticate and decrypt on the device, and download V to hdr
+static CUresult gcm_htod_open(CUdeviceptr dst, unsigned char *hdr,
+                              CUdeviceptr dev_hdr, size_t n, int aligned, CUstream stream)
+{
+    CUresult ret;
+    CUdeviceptr v = dev_hdr + 32;
 
-    if ((ret = cu_memcpy_dh(dstHost, dev_ptr, ByteCount)) != CUDA_SUCCESS) {
-        goto cuda_err;
+    if (aligned) {
+        if ((ret = ghash_gpu(v, dst, n, stream)) != CUDA_SUCCESS)
+            return ret;
+        if ((ret = aes_265_ctr_gpu(v, v, 16, dev_hdr, stream)) != CUDA_SUCCESS)
+            return ret;
+        ret = aes_265_ctr_gpu(dst, dst, n, dev_hdr + 16, stream);
+    } else {
+        if ((ret = ghash_gpu(v, dev_hdr + GCM_HDR, n, stream)) != CUDA_SUCCESS)
+            return ret;
+        if ((ret = gcm_ctr_vc(dev_hdr, n, stream)) != CUDA_SUCCESS)
+            return ret;
+        ret = memcpy_dd_on(dst, dev_hdr + GCM_HDR, n, stream);
     }
+    if (ret != CUDA_SUCCESS)
+        return ret;
+    return memcpy_dh_on(hdr + 32, v, 16, stream);
+}
 
-    return CUDA_SUCCESS;
+// HtoD: once gcm_htod_open is done, V is 0 if the tag matched
+static CUresult gcm_htod_check(const unsigned char *hdr)
+{
+    static const unsigned char zero[16];
 
-    cuda_err:
-    CUDA_PRINT_ERROR(ret);
-    return ret;
+    if (memcmp(hdr + 32, zero, 16) != 0) {
+        PRINT_ERROR("HtoD copy failed authentication\n");
+        return CUDA_ERROR_UNKNOWN;
+    }
+    return CUDA_SUCCESS;
 }
 
-__attribute__((visibility("default")))
-CUresult cuMemcpyDtoH(
-    void *dstHost,
-    CUdeviceptr srcDevice,
-    unsigned int ByteCount)
+// DtoH: upload a fresh header, encrypt the n bytes at src into the bounce
+// buffer, and compute their tag in V
+static CUresult gcm_dtoh_seal(CUdeviceptr src, unsigned char *hdr,
+                              CUdeviceptr dev_hdr, size_t n, int aligned, CUstream stream)
 {
-    struct device_buf_with_bb *data;
+    CUresult ret;
+    CUdeviceptr v = dev_hdr + 32, c = dev_hdr + GCM_HDR;
+
+    gcm_header(hdr);
+    if ((ret = memcpy_hd_on(dev_hdr, hdr, GCM_HDR, stream)) != CUDA_SUCCESS)
+        return ret;
+
+    if (aligned) {
+        if ((ret = aes_265_ctr_gpu(v, v, 16, dev_hdr, stream)) != CUDA_SUCCESS)
+            return ret;
+        ret = aes_265_ctr_gpu(c, src, n, dev_hdr + 16, stream);
+    } else {
+        if ((ret = memcpy_dd_on(c, src, n, stream)) != CUDA_SUCCESS)
+            return ret;
+        ret = gcm_ctr_vc(dev_hdr, n, stream);
+    }
+    if (ret != CUDA_SUCCESS)
+        return ret;
+    return ghash_gpu(v, c, n, stream);
+}
+
+// DtoH, on the host, once V and C are downloaded to hdr
+static CUresult gcm_open(void *dst, const unsigned char *hdr, size_t n)
+{
+    if (aes256_gcm_decrypt_openssl(dst, hdr + GCM_HDR, n, hdr + 32, hdr, h_key) != EXIT_SUCCESS) {
+        PRINT_ERROR("DtoH copy failed authentication\n");
+        return CUDA_ERROR_UNKNOWN;
+    }
+    return CUDA_SUCCESS;
+}
+
+/*
+ * GCM mode of do_cuMemcpyHtoD. The tag is checked on the device, so an
+ * async copy too waits for stream before returning, to report a forgery.
+ */
+static CUresult do_gcm_htod(CUdeviceptr dstDevice, const void *srcHost,
+                            size_t ByteCount, size_t offset, CUstream stream)
+{
+    CUresult ret;
+    int aligned = copy_aligned(offset, ByteCount);
+    struct bounce_buffer *bb = bb_pool_get(GCM_HDR + ROUND_UP(ByteCount, 16));
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    if (gcm_seal(bb->host, srcHost, ByteCount) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
+    }
+    ret = gcm_htod_copy(dstDevice, bb->host, bb->dev, ByteCount, aligned, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    ret = gcm_htod_open(dstDevice, bb->host, bb->dev, ByteCount, aligned, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = cu_stream_synchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    ret = gcm_htod_check(bb->host);
+    bb_pool_put(bb);
+    return ret;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+// GCM mode of do_cuMemcpyDtoH
+static CUresult do_gcm_dtoh(void *dstHost, CUdeviceptr srcDevice,
+                            size_t ByteCount, size_t offset, CUstream stream)
+{
+    CUresult ret;
+    int aligned = copy_aligned(offset, ByteCount);
+    struct bounce_buffer *bb = bb_pool_get(GCM_HDR + ROUND_UP(ByteCount, 16));
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    unsigned char *hdr = bb->host;
+
+    ret = gcm_dtoh_seal(srcDevice, hdr, bb->dev, ByteCount, aligned, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    ret = memcpy_dh_on(hdr + 32, bb->dev + 32, 16 + ByteCount, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = cu_stream_synchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    ret = gcm_open(dstHost, hdr, ByteCount);
+    bb_pool_put(bb);
+    return ret;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+/*
+ * The copy and the decryption are queued on stream, the legacy default
+ * stream if NULL, and the bounce buffer goes back to the pool once they are
+ * done. Nothing waits for the work of other streams. On the NULL stream,
+ * the plaintext is in place on return.
+ */
+inline static CUresult do_cuMemcpyHtoD(CUdeviceptr dstDevice,
+                         const void *srcHost,
+                         size_t ByteCount,
+                         size_t offset,
+                         CUstream stream
+)
+{
+
+    assert(cu_memcpy_hd != NULL);
+    CUresult ret;
+
+    size_t lo16 = ROUND_DOWN(offset, 16);
+    size_t head = offset - lo16;
+    size_t span = ROUND_UP(offset + ByteCount, 16) - lo16;
+    int aligned = copy_aligned(offset, ByteCount);
+    uint64_t origin = ctr_space_reserve(lo16, lo16 + span);
+
+    struct bounce_buffer *bb = bb_pool_get(16 + span);
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    unsigned char *host_ctr = bb->host;
+    unsigned char *host_blocks = host_ctr + 16;
+    CUdeviceptr dev_blocks = bb->dev + 16;
+
+    DEBUG_PRINTF("encrypt host bounce buffer\n");
+
+    aes_ctr_counter_add(host_ctr, h_IV, (origin + lo16) / 16);
+    if (aes256_ctr_encrypt_pool_at(
+        host_blocks + head,   // c
+        srcHost, ByteCount, // m
+        h_IV, h_key, origin + offset) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
+    }
+
+    DEBUG_PRINTF("copy ciphertext on device\n");
+    if (aligned) {
+        if ((ret = memcpy_hd_on(bb->dev, host_ctr, 16, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = memcpy_hd_on(dstDevice, host_blocks, ByteCount, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+    } else {
+        // the counter and the blocks in one go
+        if ((ret = memcpy_hd_on(bb->dev, host_ctr, 16 + span, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    DEBUG_PRINTF("decrypt on device in place\n");
+    if (aligned) {
+        ret = aes_265_ctr_gpu(dstDevice, dstDevice, ByteCount, bb->dev, stream);
+    } else {
+        ret = aes_265_ctr_gpu(dev_blocks, dev_blocks, span, bb->dev, stream);
+        if (ret == CUDA_SUCCESS)
+            ret = memcpy_dd_on(dstDevice, dev_blocks + head, ByteCount, stream);
+    }
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+
+    if (stream == NULL) {
+        if ((ret = cu_stream_synchronize(NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+        bb_pool_put(bb);
+        return CUDA_SUCCESS;
+    }
+    bb_pool_put_async(bb, stream);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+
+}
+
+
+/*
+ * Only the work queued on stream, the legacy default stream if NULL, is
+ * waited for before the host decryption, and the copy is queued on it.
+ * The GPU encrypts out of place into the bounce buffer, which the host
+ * decrypts into dstHost.
+ */
+inline static CUresult do_cuMemcpyDtoH(
+    void *dstHost,
+    CUdeviceptr srcDevice,
+    size_t ByteCount,
+    size_t offset,
+    CUstream stream
+)
+{
+    assert(cu_memcpy_hd != NULL);
+    CUresult ret;
+
+    size_t lo16 = ROUND_DOWN(offset, 16);
+    size_t head = offset - lo16;
+    size_t span = ROUND_UP(offset + ByteCount, 16) - lo16;
+    uint64_t origin = ctr_space_reserve(lo16, lo16 + span);
+
+    struct bounce_buffer *bb = bb_pool_get(16 + span);
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    unsigned char *host_ctr = bb->host;
+    unsigned char *host_blocks = host_ctr + 16;
+    CUdeviceptr dev_blocks = bb->dev + 16;
+    CUdeviceptr gpu_src = srcDevice;
+
+    aes_ctr_counter_add(host_ctr, h_IV, (origin + lo16) / 16);
+    if ((ret = memcpy_hd_on(bb->dev, host_ctr, 16, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    if (!copy_aligned(offset, ByteCount)) {
+        ret = memcpy_dd_on(dev_blocks + head, srcDevice, ByteCount, stream);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        gpu_src = dev_blocks;
+    }
+    ret = aes_265_ctr_gpu(dev_blocks, gpu_src, span, bb->dev, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+
+    ret = memcpy_dh_on(host_blocks + head, dev_blocks + head, ByteCount, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+
+    DEBUG_PRINTF("decrypt on host from bounce buffer to destination\n");
+    if ((ret = cu_stream_synchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    if (aes256_ctr_decrypt_pool_at(
+        dstHost,
+        host_blocks + head, ByteCount,
+        h_IV, h_key, origin + offset
+    ) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
+    }
+
+    bb_pool_put(bb);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+/*
+ * Copies of more than one chunk go through the pipeline, unless another
+ * thread uses it: that copy then takes the serial path instead of waiting.
+ * On success, the caller must unlock pipeline.lock.
+ */
+static int pipeline_acquire(size_t ByteCount)
+{
+    return config.pipeline_chunk != 0 && ByteCount > config.pipeline_chunk
+        && pthread_mutex_trylock(&pipeline.lock) == 0;
+}
+
+/*
+ * Chunks are aligned in the allocation, so that the CTR blocks of two
+ * chunks never overlap. Chunk i of a copy of [offset, end) holds the bytes
+ * [lo, hi), within the CTR blocks [ctr_lo, ctr_lo + ctr_len). Only the
+ * first and the last chunks may be unaligned.
+ */
+struct pipeline_chunk {
+    size_t lo, hi;
+    size_t ctr_lo, ctr_len;
+};
+
+static unsigned int pipeline_nchunks(size_t offset, size_t end)
+{
+    size_t first = ROUND_DOWN(offset, config.pipeline_chunk);
+    return (end - first + config.pipeline_chunk - 1) / config.pipeline_chunk;
+}
+
+// bytes of the bounce buffer per slot: a chunk, and its GCM header
+static size_t pipeline_slot_size(void)
+{
+    return config.pipeline_chunk + (config.mode == CUDA_ENC_MODE_GCM ? GCM_HDR : 0);
+}
+
+static void pipeline_chunk_get(size_t offset, size_t end, unsigned int i,
+                               struct pipeline_chunk *c)
+{
+    size_t start = ROUND_DOWN(offset, config.pipeline_chunk) + i * config.pipeline_chunk;
+
+    c->lo = offset > start ? offset : start;
+    c->hi = end < start + config.pipeline_chunk ? end : start + config.pipeline_chunk;
+    c->ctr_lo = ROUND_DOWN(c->lo, 16);
+    c->ctr_len = ROUND_UP(c->hi, 16) - c->ctr_lo;
+}
+
+/*
+ * Same as do_cuMemcpyHtoD, chunk by chunk. The host encrypts chunk i while
+ * chunk i-1 is copied on copy_stream and chunk i-2 is decrypted on
+ * crypto_stream, each stage waiting for the previous one through the
+ * slot's events. Up to pipeline_depth chunks are in flight, slot s using
+ * its own pipeline_slot_size bytes of one bounce buffer, and the counter
+ * s + 1 of d_IV.
+ *
+ * With a stream, the chunks are copied after the work queued on it so far,
+ * and the work queued on it next runs after the last chunk is decrypted.
+ * In GCM mode, the tag of chunk i is checked when its slot is reused, and
+ * the copy is complete on return.
+ */
+static CUresult do_cuMemcpyHtoD_pipelined(CUdeviceptr dstDevice,
+                                          const void *srcHost,
+                                          size_t ByteCount,
+                                          size_t offset,
+                                          CUstream stream)
+{
+    CUresult ret;
+    int gcm = config.mode == CUDA_ENC_MODE_GCM;
+    size_t end = offset + ByteCount;
+    unsigned int nchunks = pipeline_nchunks(offset, end);
+    uint64_t origin = gcm ? 0 : ctr_space_reserve(ROUND_DOWN(offset, 16), ROUND_UP(end, 16));
+    struct bounce_buffer *bb = bb_pool_get(config.pipeline_depth * pipeline_slot_size());
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    if (stream != NULL) {
+        if ((ret = cu_event_record(pipeline.entry, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_stream_wait_event(pipeline.copy_stream, pipeline.entry, 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    for (unsigned int i = 0; i < nchunks; i++) {
+        unsigned int slot = i % config.pipeline_depth;
+        CUdeviceptr d_ctr = d_IV + 16 * (1 + slot);
+        unsigned char *host_bb = (unsigned char *) bb->host + slot * pipeline_slot_size();
+        CUdeviceptr dev_bb = bb->dev + slot * pipeline_slot_size();
+        struct pipeline_chunk c;
+
+        pipeline_chunk_get(offset, end, i, &c);
+        CUdeviceptr dst = dstDevice + (c.lo - offset);
+        const unsigned char *src = (const unsigned char *) srcHost + (c.lo - offset);
+        size_t head = c.lo - c.ctr_lo;
+        int aligned = copy_aligned(c.lo, c.hi - c.lo);
+
+        // the previous chunk of the slot no longer needs its buffers
+        if ((ret = cu_event_synchronize(pipeline.crypted[slot])) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        if (gcm) {
+            if (i >= config.pipeline_depth && (ret = gcm_htod_check(host_bb)) != CUDA_SUCCESS)
+                goto cuda_err;
+            if (gcm_seal(host_bb, src, c.hi - c.lo) != EXIT_SUCCESS) {
+                ret = CUDA_ERROR_UNKNOWN;
+                goto cuda_err;
+            }
+            ret = gcm_htod_copy(dst, host_bb, dev_bb, c.hi - c.lo, aligned, pipeline.copy_stream);
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+        } else {
+            if (aes256_ctr_encrypt_pool_at(
+                host_bb + head,
+                src, c.hi - c.lo,
+                h_IV, h_key, origin + c.lo) != EXIT_SUCCESS) {
+                ret = CUDA_ERROR_UNKNOWN;
+                goto cuda_err;
+            }
+
+            if (aligned)
+                ret = cu_memcpy_hd_async(dst, host_bb, c.hi - c.lo, pipeline.copy_stream);
+            else
+                ret = cu_memcpy_hd_async(dev_bb, host_bb, c.ctr_len, pipeline.copy_stream);
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+            aes_ctr_counter_add(pipeline.ctr[slot], h_IV, (origin + c.ctr_lo) / 16);
+            ret = cu_memcpy_hd_async(d_ctr, pipeline.ctr[slot], 16, pipeline.copy_stream);
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        if ((ret = cu_event_record(pipeline.copied[slot], pipeline.copy_stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+
+        ret = cu_stream_wait_event(pipeline.crypto_stream, pipeline.copied[slot], 0);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        if (gcm) {
+            ret = gcm_htod_open(dst, host_bb, dev_bb, c.hi - c.lo, aligned, pipeline.crypto_stream);
+        } else if (aligned) {
+            ret = aes_265_ctr_gpu(dst, dst, c.hi - c.lo, d_ctr, pipeline.crypto_stream);
+        } else {
+            ret = aes_265_ctr_gpu(dev_bb, dev_bb, c.ctr_len, d_ctr, pipeline.crypto_stream);
+            if (ret == CUDA_SUCCESS)
+                ret = cu_memcpy_dd_async(dst, dev_bb + head, c.hi - c.lo, pipeline.crypto_stream);
+        }
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_event_record(pipeline.crypted[slot], pipeline.crypto_stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    // the tags of the last chunks of each slot
+    if (gcm) {
+        if ((ret = cu_stream_synchronize(pipeline.crypto_stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        unsigned int first = nchunks > config.pipeline_depth ? nchunks - config.pipeline_depth : 0;
+        for (unsigned int i = first; i < nchunks; i++) {
+            unsigned int slot = i % config.pipeline_depth;
+            ret = gcm_htod_check((unsigned char *) bb->host + slot * pipeline_slot_size());
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+        bb_pool_put(bb);
+        return CUDA_SUCCESS;
+    }
+
+    // the copy is complete once the last chunk is decrypted
+    if (stream != NULL) {
+        if ((ret = cu_event_record(pipeline.exit, pipeline.crypto_stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_stream_wait_event(stream, pipeline.exit, 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+        bb_pool_put_async(bb, pipeline.crypto_stream);
+        return CUDA_SUCCESS;
+    }
+    if ((ret = cu_stream_synchronize(pipeline.crypto_stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    bb_pool_put(bb);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(pipeline.copy_stream);
+    cu_stream_synchronize(pipeline.crypto_stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+/*
+ * Same as do_cuMemcpyDtoH, chunk by chunk: the GPU encrypts chunk i on
+ * crypto_stream while chunk i-1 is copied on copy_stream and the host
+ * decrypts chunk i-2. The host stage lags pipeline_depth - 1 chunks behind,
+ * so a slot is free again once its host stage is done.
+ *
+ * With a stream, the chunks are encrypted after the work queued on it so
+ * far. The copy is complete on return.
+ */
+static CUresult do_cuMemcpyDtoH_pipelined(void *dstHost,
+                                          CUdeviceptr srcDevice,
+                                          size_t ByteCount,
+                                          size_t offset,
+                                          CUstream stream)
+{
+    CUresult ret;
+    int gcm = config.mode == CUDA_ENC_MODE_GCM;
+    size_t end = offset + ByteCount;
+    unsigned int nchunks = pipeline_nchunks(offset, end);
+    uint64_t origin = gcm ? 0 : ctr_space_reserve(ROUND_DOWN(offset, 16), ROUND_UP(end, 16));
+    unsigned int lag = config.pipeline_depth - 1;
+    struct pipeline_chunk c;
+    struct bounce_buffer *bb = bb_pool_get(config.pipeline_depth * pipeline_slot_size());
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    if (stream != NULL) {
+        if ((ret = cu_event_record(pipeline.entry, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_stream_wait_event(pipeline.crypto_stream, pipeline.entry, 0)) != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    for (unsigned int i = 0; i < nchunks + lag; i++) {
+        if (i < nchunks) {
+            unsigned int slot = i % config.pipeline_depth;
+            CUdeviceptr d_ctr = d_IV + 16 * (1 + slot);
+            unsigned char *host_bb = (unsigned char *) bb->host + slot * pipeline_slot_size();
+            CUdeviceptr dev_bb = bb->dev + slot * pipeline_slot_size();
+
+            pipeline_chunk_get(offset, end, i, &c);
+            CUdeviceptr src = srcDevice + (c.lo - offset);
+            size_t head = c.lo - c.ctr_lo;
+            int aligned = copy_aligned(c.lo, c.hi - c.lo);
+
+            // the host stage of the previous chunk of the slot is done, but
+            // an async HtoD may still be uploading the counter of the slot
+            if ((ret = cu_event_synchronize(pipeline.copied[slot])) != CUDA_SUCCESS)
+                goto cuda_err;
+            if (gcm) {
+                ret = gcm_dtoh_seal(src, host_bb, dev_bb, c.hi - c.lo, aligned,
+                                    pipeline.crypto_stream);
+                if (ret != CUDA_SUCCESS)
+                    goto cuda_err;
+            } else {
+                aes_ctr_counter_add(pipeline.ctr[slot], h_IV, (origin + c.ctr_lo) / 16);
+                ret = cu_memcpy_hd_async(d_ctr, pipeline.ctr[slot], 16, pipeline.crypto_stream);
+                if (ret != CUDA_SUCCESS)
+                    goto cuda_err;
+                if (!aligned) {
+                    ret = cu_memcpy_dd_async(dev_bb + head, src, c.hi - c.lo, pipeline.crypto_stream);
+                    if (ret != CUDA_SUCCESS)
+                        goto cuda_err;
+                    src = dev_bb;
+                }
+                ret = aes_265_ctr_gpu(dev_bb, src, c.ctr_len, d_ctr, pipeline.crypto_stream);
+                if (ret != CUDA_SUCCESS)
+                    goto cuda_err;
+            }
+            if ((ret = cu_event_record(pipeline.crypted[slot], pipeline.crypto_stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+
+            ret = cu_stream_wait_event(pipeline.copy_stream, pipeline.crypted[slot], 0);
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+            if (gcm)
+                ret = cu_memcpy_dh_async(host_bb + 32, dev_bb + 32, 16 + c.hi - c.lo,
+                                         pipeline.copy_stream);
+            else
+                ret = cu_memcpy_dh_async(host_bb + head, dev_bb + head, c.hi - c.lo,
+                                         pipeline.copy_stream);
+            if (ret != CUDA_SUCCESS)
+                goto cuda_err;
+            if ((ret = cu_event_record(pipeline.copied[slot], pipeline.copy_stream)) != CUDA_SUCCESS)
+                goto cuda_err;
+        }
+
+        if (i >= lag) {
+            unsigned int j = i - lag;
+            unsigned int slot = j % config.pipeline_depth;
+            unsigned char *host_bb = (unsigned char *) bb->host + slot * pipeline_slot_size();
+
+            pipeline_chunk_get(offset, end, j, &c);
+            if ((ret = cu_event_synchronize(pipeline.copied[slot])) != CUDA_SUCCESS)
+                goto cuda_err;
+
+            if (gcm) {
+                ret = gcm_open((unsigned char *) dstHost + (c.lo - offset), host_bb, c.hi - c.lo);
+                if (ret != CUDA_SUCCESS)
+                    goto cuda_err;
+            } else if (aes256_ctr_decrypt_pool_at(
+                (unsigned char *) dstHost + (c.lo - offset),
+                host_bb + (c.lo - c.ctr_lo), c.hi - c.lo,
+                h_IV, h_key, origin + c.lo) != EXIT_SUCCESS) {
+                ret = CUDA_ERROR_UNKNOWN;
+                goto cuda_err;
+            }
+        }
+    }
+
+    bb_pool_put(bb);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(pipeline.crypto_stream);
+    cu_stream_synchronize(pipeline.copy_stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+// wc_scatter or wc_gather of ndesc copies of nbytes in all
+static CUresult wc_kernel(CUfunction f, CUdeviceptr data, CUdeviceptr desc,
+                          unsigned int ndesc, size_t nbytes, CUstream stream)
+{
+    // the grid strides over each copy: one thread per 16 bytes of the
+    // average copy
+    unsigned int gx = (nbytes / ndesc + 16 * 256 - 1) / (16 * 256);
+    if (gx > 1024)
+        gx = 1024;
+    void *kernel_args[] = {&data, &desc, &ndesc};
+
+    return cu_launch_kernel(f, gx, 1, 1, 256, 1, 1, 0, stream, kernel_args, NULL);
+}
+
+static CUresult wc_flush_locked(void)
+{
+    CUresult ret;
+    size_t desc_bytes = wc.ncopies * sizeof(struct wc_desc);
+    unsigned char *data = wc.host + 16;
+    CUdeviceptr dev_data = wc.dev + 16;
+
+    if (wc.ncopies == 0)
+        return CUDA_SUCCESS;
+    DEBUG_PRINTF("wc_flush: %u copies, %zu bytes\n", wc.ncopies, wc.used);
+
+    uint64_t origin = ctr_space_reserve(0, wc.used);
+    aes_ctr_counter_add(wc.host, h_IV, origin / 16);
+    if (aes256_ctr_encrypt_pool_at(data, data, wc.used, h_IV, h_key, origin) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
+    }
+    memcpy(data + wc.used, wc.desc, desc_bytes);
+
+    // the host buffer is free again on return, the device one is reused by
+    // the next flush after the kernels, on the same stream
+    if ((ret = cu_memcpy_hd(wc.dev, wc.host, 16 + wc.used + desc_bytes)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = aes_265_ctr_gpu(dev_data, dev_data, wc.used, wc.dev, NULL)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    ret = wc_kernel(wc.scatter, dev_data, dev_data + wc.used, wc.ncopies, wc.used, NULL);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+
+    wc.used = 0;
+    wc.ncopies = 0;
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    // the copies are lost
+    wc.used = 0;
+    wc.ncopies = 0;
+    return ret;
+}
+
+static CUresult wc_flush(void)
+{
+    CUresult ret;
+
+    if (config.write_combine_max == 0)
+        return CUDA_SUCCESS;
+
+    pthread_mutex_lock(&wc.lock);
+    ret = wc_flush_locked();
+    pthread_mutex_unlock(&wc.lock);
+    return ret;
+}
+
+// a launch sends the staged copies before it is deferred, and a copy the
+// deferred launches before it is staged: at most one of them is pending
+static CUresult deferred_flush(void)
+{
+    CUresult ret;
+
+    if ((ret = launch_batch_flush()) != CUDA_SUCCESS)
+        return ret;
+    return wc_flush();
+}
+
+static int wc_overlaps(CUdeviceptr dst, unsigned int n)
+{
+    for (unsigned int i = 0; i < wc.ncopies; i++) {
+        if (dst < wc.desc[i].dev + wc.desc[i].n && wc.desc[i].dev < dst + n)
+            return 1;
+    }
+    return 0;
+}
+
+// stage a copy of n <= config.write_combine_max bytes
+static CUresult wc_add(CUdeviceptr dst, const void *src, unsigned int n)
+{
+    CUresult ret = CUDA_SUCCESS;
+
+    pthread_mutex_lock(&wc.lock);
+    if (wc.ncopies == WC_MAX_COPIES || wc.used + n > WC_DATA_SIZE || wc_overlaps(dst, n))
+        ret = wc_flush_locked();
+    if (ret == CUDA_SUCCESS) {
+        struct wc_desc *d = &wc.desc[wc.ncopies++];
+        d->dev = dst;
+        d->offset = wc.used;
+        d->n = n;
+        memcpy(wc.host + 16 + wc.used, src, n);
+        wc.used += ROUND_UP(n, 16);
+    }
+    pthread_mutex_unlock(&wc.lock);
+    return ret;
+}
+
+/*
+ * Find the allocation holding [ptr, ptr + ByteCount), and the offset of ptr
+ * in it. Copies to the start of an allocation hit hash_alloc, copies to
+ * interior pointers go through alloc_ranges, copies to globals of modules
+ * through global_ranges.
+ */
+static CUresult lookup_alloc(CUdeviceptr ptr, size_t ByteCount,
+                             struct device_buf_with_bb **pdata, size_t *offset)
+{
+    uint64_t base = ptr;
+    struct device_buf_with_bb *data;
+
+    data = registry_lookup(hash_alloc, ptr);
+    if (!data)
+        data = range_index_lookup(alloc_ranges, ptr, &base);
+    if (!data && global_ranges != NULL)
+        data = range_index_lookup(global_ranges, ptr, &base);
+    if (!data) {
+        PRINT_ERROR("%llx is neither in an allocation of cuMemAlloc nor in a global of "
+                    "cuModuleGetGlobal\n", (unsigned long long) ptr);
+        return CUDA_ERROR_NOT_FOUND;
+    }
+    if (ptr - base + ByteCount > data->size) {
+        PRINT_ERROR("copy of %zu bytes at offset %llu overflows an allocation of %zu bytes\n",
+                    ByteCount, ptr - base, data->size);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    *pdata = data;
+    *offset = ptr - base;
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Unpipelined copies, segment by segment: each segment reserves counters of
+ * its own, or is a GCM message of its own.
+ */
+static CUresult memcpy_dtoh_segments(void *dstHost, CUdeviceptr srcDevice,
+                                     size_t ByteCount, size_t offset, CUstream stream)
+{
+    CUresult ret = CUDA_SUCCESS;
+    size_t end = offset + ByteCount;
+
+    for (size_t lo = offset, hi; lo < end && ret == CUDA_SUCCESS; lo = hi) {
+        hi = ROUND_DOWN(lo, COPY_SEGMENT_MAX) + COPY_SEGMENT_MAX;
+        hi = hi < end ? hi : end;
+
+        void *dst = (unsigned char *) dstHost + (lo - offset);
+        CUdeviceptr src = srcDevice + (lo - offset);
+        if (config.mode == CUDA_ENC_MODE_GCM)
+            ret = do_gcm_dtoh(dst, src, hi - lo, lo, stream);
+        else
+            ret = do_cuMemcpyDtoH(dst, src, hi - lo, lo, stream);
+    }
+    return ret;
+}
+
+static CUresult memcpy_htod_segments(CUdeviceptr dstDevice, const void *srcHost,
+                                     size_t ByteCount, size_t offset, CUstream stream)
+{
+    CUresult ret = CUDA_SUCCESS;
+    size_t end = offset + ByteCount;
+
+    for (size_t lo = offset, hi; lo < end && ret == CUDA_SUCCESS; lo = hi) {
+        hi = ROUND_DOWN(lo, COPY_SEGMENT_MAX) + COPY_SEGMENT_MAX;
+        hi = hi < end ? hi : end;
+
+        CUdeviceptr dst = dstDevice + (lo - offset);
+        const void *src = (const unsigned char *) srcHost + (lo - offset);
+        if (config.mode == CUDA_ENC_MODE_GCM)
+            ret = do_gcm_htod(dst, src, hi - lo, lo, stream);
+        else
+            ret = do_cuMemcpyHtoD(dst, src, hi - lo, lo, stream);
+    }
+    return ret;
+}
+
+static CUresult memcpy_dtoh(void *dstHost, CUdeviceptr srcDevice,
+                            size_t ByteCount, CUstream stream)
+{
+    CUresult ret;
+    struct device_buf_with_bb *data;
+    size_t offset;
     assert(cu_memcpy_dh != NULL);
 
-    data = g_hash_table_lookup(hash_alloc, (const void *) srcDevice);
-    if (!data) {
-        /*
-         * Workaround:
-         * dstDevice was obtained with cuModuleGetGlobal
-         * and not explicitly allocated. Use preallocated memory for encryption buffers.
-         */
-        data = g_hash_table_lookup(hash_alloc, (const void *) cu_module_get_global_buffer_dev_ptr);
-        if (!data) {
-            PRINT_ERROR("hash_alloc lookup failed for cu_module_get_global_buffer_dev_ptr \n");
-            return CUDA_ERROR_NOT_FOUND;
+    if ((ret = lookup_alloc(srcDevice, ByteCount, &data, &offset)) != CUDA_SUCCESS)
+        return ret;
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    if (ByteCount == 0)
+        return CUDA_SUCCESS;
+
+    if (pipeline_acquire(ByteCount)) {
+        ret = do_cuMemcpyDtoH_pipelined(dstHost, srcDevice, ByteCount, offset, stream);
+        pthread_mutex_unlock(&pipeline.lock);
+        return ret;
+    }
+    return memcpy_dtoh_segments(dstHost, srcDevice, ByteCount, offset, stream);
+}
+
+static CUresult memcpy_htod(CUdeviceptr dstDevice, const void *srcHost,
+                            size_t ByteCount, CUstream stream)
+{
+    CUresult ret;
+    struct device_buf_with_bb *data;
+    size_t offset;
+    assert(cu_memcpy_hd != NULL);
+
+    if ((ret = lookup_alloc(dstDevice, ByteCount, &data, &offset)) != CUDA_SUCCESS)
+        return ret;
+
+    if (ByteCount == 0)
+        return CUDA_SUCCESS;
+
+    if (stream == NULL && ByteCount <= config.write_combine_max) {
+        if ((ret = launch_batch_flush()) != CUDA_SUCCESS)
+            return ret;
+        return wc_add(dstDevice, srcHost, ByteCount);
+    }
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    if (pipeline_acquire(ByteCount)) {
+        ret = do_cuMemcpyHtoD_pipelined(dstDevice, srcHost, ByteCount, offset, stream);
+        pthread_mutex_unlock(&pipeline.lock);
+        return ret;
+    }
+    return memcpy_htod_segments(dstDevice, srcHost, ByteCount, offset, stream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoH(
+    void *dstHost,
+    CUdeviceptr srcDevice,
+    unsigned int ByteCount)
+{
+    return memcpy_dtoh(dstHost, srcDevice, ByteCount, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyHtoD(
+    CUdeviceptr dstDevice,
+    const void *srcHost,
+    unsigned int ByteCount)
+{
+    return memcpy_htod(dstDevice, srcHost, ByteCount, NULL);
+}
+
+/*
+ * The crypto kernels of async copies run on hStream, so that they only wait
+ * for the work queued on it. The host decryption of DtoH copies needs the
+ * data though: cuMemcpyDtoHAsync returns once the work queued on hStream
+ * before it is done. On the NULL stream, both are synchronous.
+ */
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoHAsync(
+    void *dstHost,
+    CUdeviceptr srcDevice,
+    unsigned int ByteCount,
+    CUstream hStream)
+{
+    return memcpy_dtoh(dstHost, srcDevice, ByteCount, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyHtoDAsync(
+    CUdeviceptr dstDevice,
+    const void *srcHost,
+    unsigned int ByteCount,
+    CUstream hStream)
+{
+    return memcpy_htod(dstDevice, srcHost, ByteCount, hStream);
+}
+
+// the same, with 64-bit byte counts
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoH_v2(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount)
+{
+    return memcpy_dtoh(dstHost, srcDevice, ByteCount, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyHtoD_v2(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount)
+{
+    return memcpy_htod(dstDevice, srcHost, ByteCount, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoHAsync_v2(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount,
+                              CUstream hStream)
+{
+    return memcpy_dtoh(dstHost, srcDevice, ByteCount, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyHtoDAsync_v2(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount,
+                              CUstream hStream)
+{
+    return memcpy_htod(dstDevice, srcHost, ByteCount, hStream);
+}
+
+/*
+ * Device memory holds plaintext, so DtoD copies stay on the device without
+ * any crypto, and counters are reserved per copy, not per byte, so there is
+ * nothing to update. Pending write-combined copies may target src or dst,
+ * and deferred launches write them, so those go first.
+ */
+static CUresult memcpy_dtod(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                            size_t ByteCount, CUstream stream)
+{
+    CUresult ret = CUDA_SUCCESS;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    // the driver takes 32-bit byte counts
+    for (size_t lo = 0, n; lo < ByteCount && ret == CUDA_SUCCESS; lo += n) {
+        n = ByteCount - lo < COPY_SEGMENT_MAX ? ByteCount - lo : COPY_SEGMENT_MAX;
+        ret = memcpy_dd_on(dstDevice + lo, srcDevice + lo, n, stream);
+    }
+    return ret;
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice, unsigned int ByteCount)
+{
+    return memcpy_dtod(dstDevice, srcDevice, ByteCount, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                           unsigned int ByteCount, CUstream hStream)
+{
+    return memcpy_dtod(dstDevice, srcDevice, ByteCount, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoD_v2(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t ByteCount)
+{
+    return memcpy_dtod(dstDevice, srcDevice, ByteCount, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpyDtoDAsync_v2(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t ByteCount,
+                              CUstream hStream)
+{
+    return memcpy_dtod(dstDevice, srcDevice, ByteCount, hStream);
+}
+
+// the copies of one direction of a batch, one at a time
+static CUresult memcpy_batch_serial(const struct cuda_enc_copy *copies, unsigned int count,
+                                    enum cuda_enc_copy_dir dir, CUstream stream)
+{
+    CUresult ret;
+
+    for (unsigned int i = 0; i < count; i++) {
+        const struct cuda_enc_copy *c = &copies[i];
+        if (c->dir != dir)
+            continue;
+        if (dir == CUDA_ENC_HTOD)
+            ret = memcpy_htod(c->dev_ptr, c->host_ptr, c->size, stream);
+        else
+            ret = memcpy_dtoh(c->host_ptr, c->dev_ptr, c->size, stream);
+        if (ret != CUDA_SUCCESS)
+            return ret;
+    }
+    return CUDA_SUCCESS;
+}
+
+/*
+ * The copies of one direction of a batch, packed in one bounce buffer as
+ * [counter | descriptors | data], each copy at a 16 bytes aligned offset of
+ * the data, all encrypted under one counter reservation. HtoD copies are
+ * uploaded in one DMA, DtoH ones gathered and downloaded in one.
+ */
+static CUresult memcpy_batch_dir(const struct cuda_enc_copy *copies, unsigned int count,
+                                 enum cuda_enc_copy_dir dir, CUstream stream)
+{
+    CUresult ret;
+    size_t used = 0, off = 0;
+    unsigned int ndesc = 0, j = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (copies[i].dir == dir && copies[i].size != 0) {
+            used += ROUND_UP(copies[i].size, 16);
+            ndesc++;
+        }
+    }
+    if (ndesc == 0)
+        return CUDA_SUCCESS;
+    // too large to pack: each copy is split in segments instead
+    if (used > COPY_SEGMENT_MAX)
+        return memcpy_batch_serial(copies, count, dir, stream);
+
+    size_t desc_bytes = ROUND_UP(ndesc * sizeof(struct wc_desc), 16);
+    struct bounce_buffer *bb = bb_pool_get(16 + desc_bytes + used);
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    struct wc_desc *desc = (struct wc_desc *) ((unsigned char *) bb->host + 16);
+    unsigned char *data = (unsigned char *) bb->host + 16 + desc_bytes;
+    CUdeviceptr dev_desc = bb->dev + 16;
+    CUdeviceptr dev_data = dev_desc + desc_bytes;
+    uint64_t origin = ctr_space_reserve(0, used);
+
+    aes_ctr_counter_add(bb->host, h_IV, origin / 16);
+    for (unsigned int i = 0; i < count; i++) {
+        const struct cuda_enc_copy *c = &copies[i];
+        if (c->dir != dir || c->size == 0)
+            continue;
+
+        desc[j].dev = c->dev_ptr;
+        desc[j].offset = off;
+        desc[j].n = c->size;
+        j++;
+        if (dir == CUDA_ENC_HTOD && aes256_ctr_encrypt_pool_at(
+            data + off, c->host_ptr, c->size, h_IV, h_key, origin + off) != EXIT_SUCCESS) {
+            ret = CUDA_ERROR_UNKNOWN;
+            goto cuda_err;
+        }
+        off += ROUND_UP(c->size, 16);
+    }
+
+    if (dir == CUDA_ENC_HTOD) {
+        if ((ret = memcpy_hd_on(bb->dev, bb->host, 16 + desc_bytes + used, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = aes_265_ctr_gpu(dev_data, dev_data, used, bb->dev, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        ret = wc_kernel(wc.scatter, dev_data, dev_desc, ndesc, used, stream);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+
+        if (stream == NULL) {
+            if ((ret = cu_stream_synchronize(NULL)) != CUDA_SUCCESS)
+                goto cuda_err;
+            bb_pool_put(bb);
+            return CUDA_SUCCESS;
+        }
+        bb_pool_put_async(bb, stream);
+        return CUDA_SUCCESS;
+    }
+
+    if ((ret = memcpy_hd_on(bb->dev, bb->host, 16 + desc_bytes, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = wc_kernel(wc.gather, dev_data, dev_desc, ndesc, used, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = aes_265_ctr_gpu(dev_data, dev_data, used, bb->dev, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = memcpy_dh_on(data, dev_data, used, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = cu_stream_synchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    off = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        const struct cuda_enc_copy *c = &copies[i];
+        if (c->dir != dir || c->size == 0)
+            continue;
+
+        if (aes256_ctr_decrypt_pool_at(c->host_ptr, data + off, c->size,
+                                       h_IV, h_key, origin + off) != EXIT_SUCCESS) {
+            ret = CUDA_ERROR_UNKNOWN;
+            goto cuda_err;
+        }
+        off += ROUND_UP(c->size, 16);
+    }
+
+    bb_pool_put(bb);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+__attribute__((visibility("default")))
+CUresult cuda_enc_memcpy_batch(const struct cuda_enc_copy *copies, unsigned int count,
+                               CUstream stream)
+{
+    CUresult ret;
+    struct device_buf_with_bb *data;
+    size_t offset;
+
+    for (unsigned int i = 0; i < count; i++) {
+        ret = lookup_alloc(copies[i].dev_ptr, copies[i].size, &data, &offset);
+        if (ret != CUDA_SUCCESS)
+            return ret;
+    }
+
+    if (config.mode != CUDA_ENC_MODE_CTR || wc.scatter == NULL) {
+        if ((ret = memcpy_batch_serial(copies, count, CUDA_ENC_HTOD, stream)) != CUDA_SUCCESS)
+            return ret;
+        return memcpy_batch_serial(copies, count, CUDA_ENC_DTOH, stream);
+    }
+
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if ((ret = memcpy_batch_dir(copies, count, CUDA_ENC_HTOD, stream)) != CUDA_SUCCESS)
+        return ret;
+    return memcpy_batch_dir(copies, count, CUDA_ENC_DTOH, stream);
+}
+
+/*
+ * 2D and 3D copies, as rows of width bytes: row r of an end is at
+ * (r / height) * slice_pitch + (r % height) * pitch from its start. Between
+ * host and device, the rows are packed in one bounce buffer, stride bytes
+ * apart, encrypted in one host pass under one counter reservation and moved
+ * in one DMA. One CTR kernel and one pitch_scatter or pitch_gather kernel
+ * then handle all the rows, instead of one encrypted copy per row.
+ */
+struct copy_pitched {
+    CUmemorytype type[2]; //< of the source and the destination
+    unsigned char *host[2];
+    CUdeviceptr dev[2];
+    size_t pitch[2], slice_pitch[2];
+    size_t width, height, depth;
+};
+
+// set end i of c, at (x, y, z) of a pitched region with rows of pitch bytes
+// and slices of height rows
+static void copy_pitched_end(struct copy_pitched *c, int i, CUmemorytype type,
+                             const void *host, CUdeviceptr dev, size_t x, size_t y,
+                             size_t z, size_t pitch, size_t height)
+{
+    size_t offset = (z * height + y) * pitch + x;
+
+    c->type[i] = type;
+    c->host[i] = type == CU_MEMORYTYPE_HOST ? (unsigned char *) host + offset : NULL;
+    c->dev[i] = type == CU_MEMORYTYPE_DEVICE ? dev + offset : 0;
+    c->pitch[i] = pitch;
+    c->slice_pitch[i] = pitch * height;
+}
+
+static size_t copy_pitched_row(const struct copy_pitched *c, int i, size_t r)
+{
+    return (r / c->height) * c->slice_pitch[i] + (r % c->height) * c->pitch[i];
+}
+
+// the pitch_scatter or pitch_gather of rows rows from stride bytes apart at
+// data to rows of pitch bytes at dev, slices of height rows
+static CUresult pitch_kernel(CUfunction f, CUdeviceptr data, uint32_t stride, CUdeviceptr dev,
+                             uint64_t pitch, uint64_t slice_pitch, uint32_t width,
+                             uint32_t height, uint32_t rows, CUstream stream)
+{
+    unsigned int gx = (width + 16 * 256 - 1) / (16 * 256);
+    unsigned int gy = rows < 65535 ? rows : 65535;
+    void *kernel_args[] = {&data, &stride, &dev, &pitch, &slice_pitch, &width, &height, &rows};
+
+    return cu_launch_kernel(f, gx < 64 ? gx : 64, gy, 1, 256, 1, 1, 0, stream, kernel_args, NULL);
+}
+
+// rows [r0, r0 + n) of c, from the host to the device or back, packed
+static CUresult memcpy_pitched_rows(const struct copy_pitched *c, size_t r0, size_t n,
+                                    int htod, CUstream stream)
+{
+    CUresult ret;
+    size_t stride = ROUND_UP(c->width, 16);
+    size_t used = n * stride;
+    int d = htod ? 1 : 0, h = 1 - d;
+    CUdeviceptr dev = c->dev[d] + copy_pitched_row(c, d, r0);
+    // whole slices, or rows of one slice
+    uint32_t height = n >= c->height ? c->height : n;
+
+    struct bounce_buffer *bb = bb_pool_get(16 + used);
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    unsigned char *data = (unsigned char *) bb->host + 16;
+    CUdeviceptr dev_data = bb->dev + 16;
+    uint64_t origin = ctr_space_reserve(0, used);
+
+    aes_ctr_counter_add(bb->host, h_IV, origin / 16);
+    if (htod) {
+        for (size_t k = 0; k < n; k++) {
+            memcpy(data + k * stride, c->host[h] + copy_pitched_row(c, h, r0 + k), c->width);
+            memset(data + k * stride + c->width, 0, stride - c->width);
+        }
+        if (aes256_ctr_encrypt_pool_at(data, data, used, h_IV, h_key, origin) != EXIT_SUCCESS) {
+            ret = CUDA_ERROR_UNKNOWN;
+            goto cuda_err;
+        }
+        if ((ret = memcpy_hd_on(bb->dev, bb->host, 16 + used, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = aes_265_ctr_gpu(dev_data, dev_data, used, bb->dev, stream)) != CUDA_SUCCESS)
+            goto cuda_err;
+        ret = pitch_kernel(wc.pitch_scatter, dev_data, stride, dev, c->pitch[d],
+                           c->slice_pitch[d], c->width, height, n, stream);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+
+        if (stream == NULL) {
+            if ((ret = cu_stream_synchronize(NULL)) != CUDA_SUCCESS)
+                goto cuda_err;
+            bb_pool_put(bb);
+            return CUDA_SUCCESS;
+        }
+        bb_pool_put_async(bb, stream);
+        return CUDA_SUCCESS;
+    }
+
+    if ((ret = memcpy_hd_on(bb->dev, bb->host, 16, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    ret = pitch_kernel(wc.pitch_gather, dev_data, stride, dev, c->pitch[d],
+                       c->slice_pitch[d], c->width, height, n, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = aes_265_ctr_gpu(dev_data, dev_data, used, bb->dev, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = memcpy_dh_on(data, dev_data, used, stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+    if ((ret = cu_stream_synchronize(stream)) != CUDA_SUCCESS)
+        goto cuda_err;
+
+    if (aes256_ctr_decrypt_pool_at(data, data, used, h_IV, h_key, origin) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
+    }
+    for (size_t k = 0; k < n; k++)
+        memcpy(c->host[h] + copy_pitched_row(c, h, r0 + k), data + k * stride, c->width);
+
+    bb_pool_put(bb);
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
+
+static CUresult memcpy_pitched(const struct copy_pitched *c, CUstream stream)
+{
+    CUresult ret = CUDA_SUCCESS;
+    int htod = c->type[0] == CU_MEMORYTYPE_HOST && c->type[1] == CU_MEMORYTYPE_DEVICE;
+    int d = htod ? 1 : 0, h = 1 - d;
+    size_t rows = c->height * c->depth;
+    size_t stride = ROUND_UP(c->width, 16);
+    struct device_buf_with_bb *data;
+    size_t offset;
+
+    if (c->width == 0 || rows == 0)
+        return CUDA_SUCCESS;
+    if (c->width > c->pitch[0] || c->width > c->pitch[1])
+        return CUDA_ERROR_INVALID_VALUE;
+
+    // host to host and device to device copies cross no bus
+    if (c->type[0] == c->type[1]) {
+        if ((ret = deferred_flush()) != CUDA_SUCCESS)
+            return ret;
+        for (size_t r = 0; r < rows && ret == CUDA_SUCCESS; r++) {
+            size_t src = copy_pitched_row(c, 0, r), dst = copy_pitched_row(c, 1, r);
+            if (c->type[0] == CU_MEMORYTYPE_HOST)
+                memcpy(c->host[1] + dst, c->host[0] + src, c->width);
+            else
+                ret = memcpy_dd_on(c->dev[1] + dst, c->dev[0] + src, c->width, stream);
+        }
+        return ret;
+    }
+
+    // all the rows lie in one allocation
+    ret = lookup_alloc(c->dev[d], copy_pitched_row(c, d, rows - 1) + c->width, &data, &offset);
+    if (ret != CUDA_SUCCESS)
+        return ret;
+
+    if (config.mode != CUDA_ENC_MODE_CTR || wc.pitch_scatter == NULL || stride > COPY_SEGMENT_MAX) {
+        for (size_t r = 0; r < rows && ret == CUDA_SUCCESS; r++) {
+            CUdeviceptr dev = c->dev[d] + copy_pitched_row(c, d, r);
+            unsigned char *host = c->host[h] + copy_pitched_row(c, h, r);
+            if (htod)
+                ret = memcpy_htod(dev, host, c->width, stream);
+            else
+                ret = memcpy_dtoh(host, dev, c->width, stream);
+        }
+        return ret;
+    }
+
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    // groups of whole slices if one fits, else of rows of one slice
+    size_t max = COPY_SEGMENT_MAX / stride;
+    if (max >= c->height)
+        max = max / c->height * c->height;
+    for (size_t r = 0, n; r < rows && ret == CUDA_SUCCESS; r += n) {
+        n = rows - r < max ? rows - r : max;
+        if (max < c->height && r % c->height + n > c->height)
+            n = c->height - r % c->height;
+        ret = memcpy_pitched_rows(c, r, n, htod, stream);
+    }
+    return ret;
+}
+
+/*
+ * Copies without host memory go to the driver, or row by row between
+ * device buffers if it has no 2D or 3D copies. Copies between host memory
+ * and arrays or unified memory are refused: the layout of arrays is opaque,
+ * so they would cross the bus in the clear.
+ */
+static int copy_pitched_on_device(CUmemorytype src, CUmemorytype dst)
+{
+    return src != CU_MEMORYTYPE_HOST && dst != CU_MEMORYTYPE_HOST;
+}
+
+static CUresult copy_pitched_check(CUmemorytype src, CUmemorytype dst)
+{
+    if (src == CU_MEMORYTYPE_DEVICE && dst == CU_MEMORYTYPE_DEVICE)
+        return CUDA_SUCCESS;
+    if (copy_pitched_on_device(src, dst)) {
+        PRINT_ERROR("the driver has no 2D or 3D copies of arrays\n");
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if ((src != CU_MEMORYTYPE_HOST && src != CU_MEMORYTYPE_DEVICE)
+        || (dst != CU_MEMORYTYPE_HOST && dst != CU_MEMORYTYPE_DEVICE)) {
+        PRINT_ERROR("copy between host memory and memory type %d\n",
+                    src == CU_MEMORYTYPE_HOST ? dst : src);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return CUDA_SUCCESS;
+}
+
+static CUresult memcpy_2d(const CUDA_MEMCPY2D *p, CUstream stream)
+{
+    CUresult ret;
+    struct copy_pitched c = {.width = p->WidthInBytes, .height = p->Height, .depth = 1};
+
+    if (copy_pitched_on_device(p->srcMemoryType, p->dstMemoryType)) {
+        if ((ret = deferred_flush()) != CUDA_SUCCESS)
+            return ret;
+        if (stream != NULL && cu_memcpy_2d_async != NULL)
+            return cu_memcpy_2d_async(p, stream);
+        if (stream == NULL && cu_memcpy_2d != NULL)
+            return cu_memcpy_2d(p);
+    }
+    if ((ret = copy_pitched_check(p->srcMemoryType, p->dstMemoryType)) != CUDA_SUCCESS)
+        return ret;
+
+    copy_pitched_end(&c, 0, p->srcMemoryType, p->srcHost, p->srcDevice, p->srcXInBytes,
+                     p->srcY, 0, p->srcPitch, p->Height);
+    copy_pitched_end(&c, 1, p->dstMemoryType, p->dstHost, p->dstDevice, p->dstXInBytes,
+                     p->dstY, 0, p->dstPitch, p->Height);
+    return memcpy_pitched(&c, stream);
+}
+
+static CUresult memcpy_3d(const CUDA_MEMCPY3D *p, CUstream stream)
+{
+    CUresult ret;
+    struct copy_pitched c = {.width = p->WidthInBytes, .height = p->Height, .depth = p->Depth};
+
+    if (copy_pitched_on_device(p->srcMemoryType, p->dstMemoryType)) {
+        if ((ret = deferred_flush()) != CUDA_SUCCESS)
+            return ret;
+        if (stream != NULL && cu_memcpy_3d_async != NULL)
+            return cu_memcpy_3d_async(p, stream);
+        if (stream == NULL && cu_memcpy_3d != NULL)
+            return cu_memcpy_3d(p);
+    }
+    if ((ret = copy_pitched_check(p->srcMemoryType, p->dstMemoryType)) != CUDA_SUCCESS)
+        return ret;
+    if (p->srcLOD != 0 || p->dstLOD != 0)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    copy_pitched_end(&c, 0, p->srcMemoryType, p->srcHost, p->srcDevice, p->srcXInBytes,
+                     p->srcY, p->srcZ, p->srcPitch, p->srcHeight);
+    copy_pitched_end(&c, 1, p->dstMemoryType, p->dstHost, p->dstDevice, p->dstXInBytes,
+                     p->dstY, p->dstZ, p->dstPitch, p->dstHeight);
+    // each end has slices of its own height
+    if (p->Depth > 1 && (p->srcHeight < p->Height || p->dstHeight < p->Height))
+        return CUDA_ERROR_INVALID_VALUE;
+    return memcpy_pitched(&c, stream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy2D(const CUDA_MEMCPY2D *pCopy)
+{
+    return memcpy_2d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy2DUnaligned(const CUDA_MEMCPY2D *pCopy)
+{
+    return memcpy_2d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream hStream)
+{
+    return memcpy_2d(pCopy, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy3D(const CUDA_MEMCPY3D *pCopy)
+{
+    return memcpy_3d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy3DAsync(const CUDA_MEMCPY3D *pCopy, CUstream hStream)
+{
+    return memcpy_3d(pCopy, hStream);
+}
+
+// the same, under the names of drivers whose unsuffixed versions take 32-bit
+// fields
+__attribute__((visibility("default")))
+CUresult cuMemcpy2D_v2(const CUDA_MEMCPY2D *pCopy)
+{
+    return memcpy_2d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy2DUnaligned_v2(const CUDA_MEMCPY2D *pCopy)
+{
+    return memcpy_2d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy2DAsync_v2(const CUDA_MEMCPY2D *pCopy, CUstream hStream)
+{
+    return memcpy_2d(pCopy, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy3D_v2(const CUDA_MEMCPY3D *pCopy)
+{
+    return memcpy_3d(pCopy, NULL);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemcpy3DAsync_v2(const CUDA_MEMCPY3D *pCopy, CUstream hStream)
+{
+    return memcpy_3d(pCopy, hStream);
+}
+
+/*
+ * The memsets are not encrypted, but a deferred launch may read or write
+ * their destination, and a staged copy would overwrite it once flushed: both
+ * are sent first. The _v2 versions fall back on the unsuffixed ones of
+ * drivers that have only those, when the sizes fit.
+ */
+__attribute__((visibility("default")))
+CUresult cuMemsetD8(CUdeviceptr dstDevice, unsigned char uc, unsigned int N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d8 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d8(dstDevice, uc, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD8_v2(CUdeviceptr dstDevice, unsigned char uc, size_t N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d8_v2 != NULL)
+        return cu_memset_d8_v2(dstDevice, uc, N);
+    if (cu_memset_d8 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (N > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d8(dstDevice, uc, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD8Async(CUdeviceptr dstDevice, unsigned char uc, unsigned int N, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d8_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d8_async(dstDevice, uc, N, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD16(CUdeviceptr dstDevice, unsigned short us, unsigned int N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d16 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d16(dstDevice, us, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD16_v2(CUdeviceptr dstDevice, unsigned short us, size_t N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d16_v2 != NULL)
+        return cu_memset_d16_v2(dstDevice, us, N);
+    if (cu_memset_d16 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (N > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d16(dstDevice, us, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD16Async(CUdeviceptr dstDevice, unsigned short us, unsigned int N,
+                          CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d16_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d16_async(dstDevice, us, N, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD32(CUdeviceptr dstDevice, unsigned int ui, unsigned int N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d32 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d32(dstDevice, ui, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD32_v2(CUdeviceptr dstDevice, unsigned int ui, size_t N)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d32_v2 != NULL)
+        return cu_memset_d32_v2(dstDevice, ui, N);
+    if (cu_memset_d32 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (N > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d32(dstDevice, ui, N);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD32Async(CUdeviceptr dstDevice, unsigned int ui, unsigned int N, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d32_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d32_async(dstDevice, ui, N, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D8(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned char uc,
+                      unsigned int Width, unsigned int Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d8 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d8(dstDevice, dstPitch, uc, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D8_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned char uc, size_t Width,
+                         size_t Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d8_v2 != NULL)
+        return cu_memset_d2d8_v2(dstDevice, dstPitch, uc, Width, Height);
+    if (cu_memset_d2d8 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (dstPitch > UINT_MAX || Width > UINT_MAX || Height > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d2d8(dstDevice, dstPitch, uc, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D8Async(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned char uc,
+                           unsigned int Width, unsigned int Height, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d8_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d8_async(dstDevice, dstPitch, uc, Width, Height, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D16(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned short us,
+                       unsigned int Width, unsigned int Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d16 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d16(dstDevice, dstPitch, us, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D16_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned short us, size_t Width,
+                          size_t Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d16_v2 != NULL)
+        return cu_memset_d2d16_v2(dstDevice, dstPitch, us, Width, Height);
+    if (cu_memset_d2d16 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (dstPitch > UINT_MAX || Width > UINT_MAX || Height > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d2d16(dstDevice, dstPitch, us, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D16Async(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned short us,
+                            unsigned int Width, unsigned int Height, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d16_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d16_async(dstDevice, dstPitch, us, Width, Height, hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D32(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned int ui,
+                       unsigned int Width, unsigned int Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d32 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d32(dstDevice, dstPitch, ui, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D32_v2(CUdeviceptr dstDevice, size_t dstPitch, unsigned int ui, size_t Width,
+                          size_t Height)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d32_v2 != NULL)
+        return cu_memset_d2d32_v2(dstDevice, dstPitch, ui, Width, Height);
+    if (cu_memset_d2d32 == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    if (dstPitch > UINT_MAX || Width > UINT_MAX || Height > UINT_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+    return cu_memset_d2d32(dstDevice, dstPitch, ui, Width, Height);
+}
+
+__attribute__((visibility("default")))
+CUresult cuMemsetD2D32Async(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned int ui,
+                            unsigned int Width, unsigned int Height, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (cu_memset_d2d32_async == NULL)
+        return CUDA_ERROR_NOT_FOUND;
+    return cu_memset_d2d32_async(dstDevice, dstPitch, ui, Width, Height, hStream);
+}
+
+// the module functions may be called before cuda_enc_setup
+static void modules_init(void)
+{
+    cu_module_load = dlsym(RTLD_NEXT, "cuModuleLoad");
+    assert(cu_module_load != NULL);
+
+    cu_module_unload = dlsym(RTLD_NEXT, "cuModuleUnload");
+    assert(cu_module_unload != NULL);
+
+    cu_module_get_function = dlsym(RTLD_NEXT, "cuModuleGetFunction");
+    assert(cu_module_get_function != NULL);
+
+    cu_module_get_global = dlsym(RTLD_NEXT, "cuModuleGetGlobal");
+    assert(cu_module_get_global != NULL);
+
+    // only in drivers with 64-bit sizes, gdev has none
+    cu_module_get_global_v2 = dlsym(RTLD_NEXT, "cuModuleGetGlobal_v2");
+
+    global_ranges = range_index_create();
+    if (global_ranges == NULL)
+        PRINT_ERROR("global_ranges failed to alloc\n");
+
+    #if CU_ENCRYPT_KERNEL_PARAM
+    hash_kernel_param = registry_create();
+    if (hash_kernel_param == NULL)
+        PRINT_ERROR("hash_kernel_param failed to alloc\n");
+    #endif
+}
+
+#if CU_ENCRYPT_KERNEL_PARAM
+// the parameters of f, or NULL
+static struct kernel_params *kernel_params_find(CUfunction f)
+{
+    pthread_once(&modules_once, modules_init);
+    if (hash_kernel_param == NULL)
+        return NULL;
+    return registry_lookup(hash_kernel_param, (uintptr_t) f);
+}
+
+// the parameters of f, created on first use. NULL if out of memory
+static struct kernel_params *kernel_params_get(CUfunction f)
+{
+    struct kernel_params *kp = kernel_params_find(f);
+    if (kp != NULL || hash_kernel_param == NULL)
+        return kp;
+
+    pthread_mutex_lock(&modules_lock);
+    kp = registry_lookup(hash_kernel_param, (uintptr_t) f);
+    if (kp == NULL && (kp = calloc(1, sizeof(*kp))) != NULL) {
+        kp->func = f;
+        pthread_mutex_init(&kp->lock, NULL);
+        if (registry_insert(hash_kernel_param, (uintptr_t) f, kp) != EXIT_SUCCESS) {
+            pthread_mutex_destroy(&kp->lock);
+            free(kp);
+            kp = NULL;
+        } else {
+            kp->next = kernel_params_all;
+            kernel_params_all = kp;
+        }
+    }
+    pthread_mutex_unlock(&modules_lock);
+    return kp;
+}
+#endif
+
+__attribute__((visibility("default")))
+CUresult cuModuleLoad(CUmodule *module, const char *fname)
+{
+    CUresult ret;
+    struct kernel_module *m;
+
+    pthread_once(&modules_once, modules_init);
+    if ((ret = cu_module_load(module, fname)) != CUDA_SUCCESS)
+        return ret;
+
+    if ((m = malloc(sizeof(*m))) == NULL) {
+        cu_module_unload(*module);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    m->module = *module;
+    snprintf(m->path, sizeof(m->path), "%s", fname);
+
+    pthread_mutex_lock(&modules_lock);
+    m->next = kernel_modules;
+    kernel_modules = m;
+    pthread_mutex_unlock(&modules_lock);
+    return CUDA_SUCCESS;
+}
+
+__attribute__((visibility("default")))
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod, const char *name)
+{
+    CUresult ret;
+
+    pthread_once(&modules_once, modules_init);
+    if ((ret = cu_module_get_function(hfunc, hmod, name)) != CUDA_SUCCESS)
+        return ret;
+
+    #if CU_ENCRYPT_KERNEL_PARAM
+    struct kernel_params *kp;
+    struct kernel_module *m;
+    struct nv_info_kparams layout;
+    int has_layout;
+
+    if ((kp = kernel_params_get(*hfunc)) == NULL) {
+        // the function still works, cuLaunchKernel passes its parameters through
+        PRINT_ERROR("cant record the parameters of %s, cuLaunchKernel cant encrypt them\n", name);
+        return CUDA_SUCCESS;
+    }
+
+    pthread_mutex_lock(&modules_lock);
+    for (m = kernel_modules; m != NULL && m->module != hmod; m = m->next)
+        ;
+    has_layout = m != NULL && nv_info_kparams(m->path, name, &layout) == EXIT_SUCCESS;
+    // modules_lock then kp->lock, as in cuda_enc_release
+    pthread_mutex_lock(&kp->lock);
+    kp->module = hmod;
+    kp->has_layout = has_layout;
+    if (has_layout)
+        kp->layout = layout;
+    pthread_mutex_unlock(&kp->lock);
+    pthread_mutex_unlock(&modules_lock);
+
+    if (!has_layout)
+        DEBUG_PRINTF("no parameter layout for %s, cuLaunchKernel cant encrypt them\n", name);
+    #endif
+    return CUDA_SUCCESS;
+}
+
+// register the global at dev, once: a global is looked up by every copy
+static CUresult module_global_register(CUmodule hmod, CUdeviceptr dev, size_t size)
+{
+    CUresult ret = CUDA_SUCCESS;
+    struct module_global *g;
+
+    if (global_ranges == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    if (size == 0)
+        return CUDA_SUCCESS;
+
+    pthread_mutex_lock(&modules_lock);
+    if (range_index_lookup(global_ranges, dev, NULL) == NULL) {
+        if ((g = malloc(sizeof(*g))) == NULL) {
+            ret = CUDA_ERROR_OUT_OF_MEMORY;
+            goto unlock;
         }
-        if (ByteCount > cu_module_get_global_buffer_size) {
-            PRINT_ERROR("req. size %d is too large. statically allocated: %d \n",
-                        ByteCount, cu_module_get_global_buffer_size);
-            return CUDA_ERROR_OUT_OF_MEMORY;
+        g->buf.dev_ptr = dev;
+        g->buf.size = size;
+        g->module = hmod;
+        if (range_index_insert(global_ranges, dev, size, &g->buf) != EXIT_SUCCESS) {
+            free(g);
+            ret = CUDA_ERROR_OUT_OF_MEMORY;
+            goto unlock;
         }
+        g->next = module_globals;
+        module_globals = g;
     }
-    return do_cuMemcpyDtoH(dstHost, srcDevice, ByteCount, data);
+    unlock:
+    pthread_mutex_unlock(&modules_lock);
+    return ret;
 }
 
+/*
+ * Copies to and from the global are encrypted, like those of allocations of
+ * cuMemAlloc, with bounce buffers of their own size.
+ */
 __attribute__((visibility("default")))
-CUresult cuMemcpyHtoD(
-    CUdeviceptr dstDevice,
-    const void *srcHost,
-    unsigned int ByteCount)
+CUresult cuModuleGetGlobal(CUdeviceptr *dptr, unsigned int *bytes, CUmodule hmod,
+                           const char *name)
 {
-    assert(cu_memcpy_hd != NULL);
-    struct device_buf_with_bb *data;
+    CUresult ret;
+    CUdeviceptr dev;
+    unsigned int size;
 
-    data = g_hash_table_lookup(hash_alloc, (const void *) dstDevice);
-    if (!data) {
-        /*
-         * Workaround:
-         * dstDevice was obtained with cuModuleGetGlobal
-         * and not explicitly allocated. Use preallocated memory for encryption buffers.
-         */
-        data = g_hash_table_lookup(hash_alloc, (const void *) cu_module_get_global_buffer_dev_ptr);
-        if (!data) {
-            PRINT_ERROR("hash_alloc lookup failed for cu_module_get_global_buffer_dev_ptr \n");
-            return CUDA_ERROR_NOT_FOUND;
+    pthread_once(&modules_once, modules_init);
+    if ((ret = cu_module_get_global(&dev, &size, hmod, name)) != CUDA_SUCCESS)
+        return ret;
+    if ((ret = module_global_register(hmod, dev, size)) != CUDA_SUCCESS)
+        return ret;
+
+    if (dptr != NULL)
+        *dptr = dev;
+    if (bytes != NULL)
+        *bytes = size;
+    return CUDA_SUCCESS;
+}
+
+__attribute__((visibility("default")))
+CUresult cuModuleGetGlobal_v2(CUdeviceptr *dptr, size_t *bytes, CUmodule hmod,
+                              const char *name)
+{
+    CUresult ret;
+    CUdeviceptr dev;
+    size_t size;
+    unsigned int size32;
+
+    pthread_once(&modules_once, modules_init);
+    if (cu_module_get_global_v2 != NULL) {
+        ret = cu_module_get_global_v2(&dev, &size, hmod, name);
+    } else {
+        ret = cu_module_get_global(&dev, &size32, hmod, name);
+        size = size32;
+    }
+    if (ret != CUDA_SUCCESS)
+        return ret;
+    if ((ret = module_global_register(hmod, dev, size)) != CUDA_SUCCESS)
+        return ret;
+
+    if (dptr != NULL)
+        *dptr = dev;
+    if (bytes != NULL)
+        *bytes = size;
+    return CUDA_SUCCESS;
+}
+
+__attribute__((visibility("default")))
+CUresult cuModuleUnload(CUmodule hmod)
+{
+    CUresult ret;
+
+    pthread_once(&modules_once, modules_init);
+    // deferred launches may use its functions, and their layouts, deferred
+    // copies its globals
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    pthread_mutex_lock(&modules_lock);
+    #if CU_ENCRYPT_KERNEL_PARAM
+    for (struct kernel_params **pkp = &kernel_params_all; *pkp != NULL;) {
+        struct kernel_params *kp = *pkp;
+        if (kp->module != hmod) {
+            pkp = &kp->next;
+            continue;
+        }
+        *pkp = kp->next;
+        registry_remove(hash_kernel_param, (uintptr_t) kp->func);
+        if (kp->dev != 0)
+            cu_memfree(kp->dev);
+        pthread_mutex_destroy(&kp->lock);
+        free(kp);
+    }
+    #endif
+    for (struct module_global **pg = &module_globals; *pg != NULL;) {
+        struct module_global *g = *pg;
+        if (g->module != hmod) {
+            pg = &g->next;
+            continue;
         }
-        if (ByteCount > cu_module_get_global_buffer_size) {
-            PRINT_ERROR("req. size %d is too large. statically allocated: %d \n",
-                        ByteCount, cu_module_get_global_buffer_size);
-            return CUDA_ERROR_OUT_OF_MEMORY;
+        *pg = g->next;
+        range_index_remove(global_ranges, g->buf.dev_ptr);
+        free(g);
+    }
+    for (struct kernel_module **pm = &kernel_modules; *pm != NULL; pm = &(*pm)->next) {
+        if ((*pm)->module == hmod) {
+            struct kernel_module *m = *pm;
+            *pm = m->next;
+            free(m);
+            break;
         }
     }
-    return do_cuMemcpyHtoD(dstDevice, srcHost, ByteCount, data);
+    pthread_mutex_unlock(&modules_lock);
+
+    return cu_module_unload(hmod);
 }
 
 #if CU_ENCRYPT_KERNEL_PARAM
+// record numbytes of parameters at offset, the driver checks them
+static void kernel_params_set(CUfunction f, int offset, const void *ptr, unsigned int numbytes)
+{
+    struct kernel_params *kp = kernel_params_get(f);
+
+    if (kp == NULL || offset < 0 || offset > KERNEL_PARAM_MAX
+        || numbytes > (unsigned int) (KERNEL_PARAM_MAX - offset)) {
+        PRINT_ERROR("cant record %u bytes of kernel parameters at offset %d\n", numbytes, offset);
+        return;
+    }
+    memcpy(kp->bytes + offset, ptr, numbytes);
+    if (offset + numbytes > kp->size)
+        kp->size = offset + numbytes;
+}
+
 __attribute__((visibility("default")))
 CUresult cuParamSetSize(CUfunction hfunc, unsigned int numbytes)
 {
-    if (numbytes > KERNEL_PARAM_ENC_BUFFER_SIZE) {
-        numbytes = KERNEL_PARAM_ENC_BUFFER_SIZE;
-        PRINT_ERROR("cuParamSetSize size: %ud is larger than prealloced %d bytes\n",
-                    numbytes,
-                    KERNEL_PARAM_ENC_BUFFER_SIZE
-        );
-    }
-    g_hash_table_insert(hash_kernel_param, hfunc,
-                        GINT_TO_POINTER(ROUND_UP(numbytes, GPU_BLOCK_SIZE)));
+    struct kernel_params *kp = kernel_params_get(hfunc);
+
+    if (kp == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    if (numbytes > KERNEL_PARAM_MAX)
+        PRINT_ERROR("cuParamSetSize size: %u is larger than the %d bytes recorded\n",
+                    numbytes, KERNEL_PARAM_MAX);
+    kp->size = numbytes < KERNEL_PARAM_MAX ? numbytes : KERNEL_PARAM_MAX;
     return cu_param_set_size(hfunc, numbytes);
 }
 
-static CUresult launch_encryption_overhead(
-    CUfunction f,
-    int grid_width,
-    int grid_height)
+__attribute__((visibility("default")))
+CUresult cuParamSeti(CUfunction hfunc, int offset, unsigned int value)
+{
+    kernel_params_set(hfunc, offset, &value, sizeof(value));
+    return cu_param_seti(hfunc, offset, value);
+}
+
+__attribute__((visibility("default")))
+CUresult cuParamSetf(CUfunction hfunc, int offset, float value)
+{
+    kernel_params_set(hfunc, offset, &value, sizeof(value));
+    return cu_param_setf(hfunc, offset, value);
+}
+
+__attribute__((visibility("default")))
+CUresult cuParamSetv(CUfunction hfunc, int offset, void *ptr, unsigned int numbytes)
+{
+    kernel_params_set(hfunc, offset, ptr, numbytes);
+    return cu_param_setv(hfunc, offset, ptr, numbytes);
+}
+
+/*
+ * Send nbytes of parameters encrypted, and decrypt them on the GPU, queued
+ * on stream ahead of the kernel: one DMA of the counter, the ciphertext and
+ * the descriptors of nruns runs of blocks, a CTR kernel of one GPU block
+ * per 4 KiB of parameters, and a wc_scatter kernel putting the runs in
+ * place. A single run is decrypted in place directly, without runs the
+ * parameters are decrypted where they land.
+ * The kernel itself still reads the parameters the driver passes it.
+ */
+static CUresult kernel_params_upload(const unsigned char *data, size_t nbytes,
+                                     const struct wc_desc *runs, unsigned int nruns,
+                                     CUstream stream)
 {
     CUresult ret;
-    struct device_buf_with_bb *data;
-    unsigned char *host_bb = NULL;
-    unsigned char *src_host = NULL;
-    long byte_count;
-    byte_count = (long) g_hash_table_lookup(hash_kernel_param, (const void *) f);
-    if (!byte_count) {
-        ret = CUDA_ERROR_NOT_FOUND;
-        /*
-         * possible that kernel has no params, ignore error
-         */
-        DEBUG_PRINTF("encoverhead: lookup failed for ptr %llx. Does kernel have args?\n", f);
-        return ret;
+    size_t n16 = ROUND_UP(nbytes, 16);
+    size_t runs_bytes = nruns > 1 ? nruns * sizeof(*runs) : 0;
+
+    uint64_t origin = ctr_space_reserve(0, n16);
+    struct bounce_buffer *bb = bb_pool_get(16 + n16 + runs_bytes);
+    if (bb == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    unsigned char *host_ctr = bb->host;
+    CUdeviceptr dev_data = bb->dev + 16;
+
+    aes_ctr_counter_add(host_ctr, h_IV, origin / 16);
+    if (aes256_ctr_encrypt_pool_at(host_ctr + 16, data, nbytes,
+                                   h_IV, h_key, origin) != EXIT_SUCCESS) {
+        ret = CUDA_ERROR_UNKNOWN;
+        goto cuda_err;
     }
-    data = g_hash_table_lookup(hash_alloc, (const void *) kernel_param_dev_ptr);
-    if (!data) {
-        ret = CUDA_ERROR_NOT_FOUND;
-        PRINT_ERROR("g_hash_table_lookup failed for kernel param %llx\n", kernel_param_dev_ptr);
-        return ret;
+    // nbytes is a multiple of 16 with runs
+    memcpy(host_ctr + 16 + nbytes, runs, runs_bytes);
+    ret = memcpy_hd_on(bb->dev, host_ctr, 16 + nbytes + runs_bytes, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    ret = aes_265_ctr_gpu(nruns == 1 ? runs[0].dev : dev_data, dev_data, n16, bb->dev, stream);
+    if (ret != CUDA_SUCCESS)
+        goto cuda_err;
+    if (nruns > 1) {
+        ret = wc_kernel(wc.scatter, dev_data, dev_data + nbytes, nruns, nbytes, stream);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
     }
 
-    host_bb = data->host_bb;
-    src_host = (unsigned char *) kernel_param_src_buf;
+    bb_pool_put_async(bb, stream);
+    return CUDA_SUCCESS;
 
-    /*
-     * sync with prior launch
-     */
-    cuCtxSynchronize();
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    cu_stream_synchronize(stream);
+    bb_pool_put(bb);
+    return ret;
+}
 
-    /*
-     * Dummy encryption to account for overhead
-     */
-    int clen;
-    if (aes256_ctr_encrypt_openssl(
-        host_bb, &clen,   // c
-        src_host, byte_count, // m
-        h_IV, h_key) != EXIT_SUCCESS) {
-        ret = CUDA_ERROR_UNKNOWN;
-        return ret;
+// the device copy of the parameters of kp, kp->lock held
+static CUresult kernel_params_dev(struct kernel_params *kp)
+{
+    if (kp->dev != 0)
+        return CUDA_SUCCESS;
+    kp->last_valid = 0;
+    return cu_memalloc(&kp->dev, KERNEL_PARAM_MAX);
+}
+
+/*
+ * The 16 bytes blocks of the size bytes at params that changed since the
+ * last launch of kp, or lie past its parameters: their plaintext packed at
+ * data, and runs of consecutive blocks to their place in kp->dev. Records
+ * params as the last launch. kp->lock held, kp->dev allocated.
+ */
+static unsigned int kernel_params_delta(struct kernel_params *kp, const unsigned char *params,
+                                        size_t size, unsigned char *data,
+                                        struct wc_desc *runs, size_t *nbytes)
+{
+    size_t last16 = kp->last_valid ? ROUND_UP(kp->last_size, 16) : 0;
+    unsigned int nruns = 0;
+    unsigned char block[16];
+
+    *nbytes = 0;
+    for (size_t lo = 0; lo < size; lo += 16) {
+        size_t n = size - lo < 16 ? size - lo : 16;
+
+        memset(block, 0, sizeof(block));
+        memcpy(block, params + lo, n);
+        if (lo < last16 && memcmp(block, kp->last + lo, sizeof(block)) == 0)
+            continue;
+
+        memcpy(kp->last + lo, block, sizeof(block));
+        memcpy(data + *nbytes, block, sizeof(block));
+        if (nruns > 0 && runs[nruns - 1].dev + runs[nruns - 1].n == kp->dev + lo) {
+            runs[nruns - 1].n += 16;
+        } else {
+            runs[nruns].dev = kp->dev + lo;
+            runs[nruns].offset = *nbytes;
+            runs[nruns].n = 16;
+            nruns++;
+        }
+        *nbytes += 16;
     }
-    assert(clen <= byte_count);
+    kp->last_size = size;
+    kp->last_valid = 1;
+    return nruns;
+}
 
-    ret = aes_265_ctr_gpu(data->dev_bb, data->dev_ptr, byte_count);
-    if (ret != CUDA_SUCCESS) {
+/*
+ * Send the parameters of a launch of kp, only the blocks that changed
+ * since its last launch if it has a device copy, or all of them if kp is
+ * NULL or wc_gpu.cubin is missing.
+ */
+static CUresult kernel_params_send(struct kernel_params *kp, const unsigned char *params,
+                                   size_t size, CUstream stream)
+{
+    static __thread unsigned char delta[KERNEL_PARAM_MAX];
+    static __thread struct wc_desc runs[KERNEL_PARAM_MAX_RUNS];
+    CUresult ret;
+    unsigned int nruns;
+    size_t nbytes;
+
+    if (size == 0)
+        return CUDA_SUCCESS;
+    if (kp == NULL || wc.scatter == NULL)
+        return kernel_params_upload(params, size, NULL, 0, stream);
+
+    pthread_mutex_lock(&kp->lock);
+    if ((ret = kernel_params_dev(kp)) == CUDA_SUCCESS) {
+        nruns = kernel_params_delta(kp, params, size, delta, runs, &nbytes);
+        if (nruns != 0)
+            ret = kernel_params_upload(delta, nbytes, runs, nruns, stream);
+        if (ret != CUDA_SUCCESS)
+            kp->last_valid = 0;
+    }
+    pthread_mutex_unlock(&kp->lock);
+    return ret;
+}
+
+// cuLaunch and cuLaunchGrid run f on the NULL stream, with the parameters set
+// by cuParamSet*
+static CUresult launch_params_send(CUfunction f)
+{
+    CUresult ret;
+    struct kernel_params *kp;
+
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+
+    // kernels without parameters have none to send
+    kp = kernel_params_find(f);
+    if (kp != NULL && (ret = kernel_params_send(kp, kp->bytes, kp->size, NULL)) != CUDA_SUCCESS) {
+        PRINT_ERROR("kernel_params_send failed with %d\n", ret);
         return ret;
     }
     return CUDA_SUCCESS;
 }
 
+__attribute__((visibility("default")))
+CUresult cuLaunch(CUfunction f)
+{
+    CUresult ret;
+
+    if ((ret = launch_params_send(f)) != CUDA_SUCCESS)
+        return ret;
+
+    ret = cu_launch(f);
+    if (ret != CUDA_SUCCESS)
+        PRINT_ERROR("cu_launch failed with %d\n", ret);
+    return ret;
+}
+
 __attribute__((visibility("default")))
 CUresult cuLaunchGrid(CUfunction f, int grid_width, int grid_height)
 {
-    CUresult ret, launch_ret;
-    launch_ret = cu_launch_grid(f, grid_width, grid_height);
-    if (launch_ret != CUDA_SUCCESS) {
-        PRINT_ERROR("cu_launch_grid failed with %d\n", launch_ret);
-        return launch_ret;
+    CUresult ret;
+
+    if ((ret = launch_params_send(f)) != CUDA_SUCCESS)
+        return ret;
+
+    ret = cu_launch_grid(f, grid_width, grid_height);
+    if (ret != CUDA_SUCCESS)
+        PRINT_ERROR("cu_launch_grid failed with %d\n", ret);
+    return ret;
+}
+
+/*
+ * The parameter buffer of a cuLaunchKernel: the one given by extra, or
+ * kernelParams packed with the layout of f, in a buffer of the thread.
+ * *params is NULL for functions without a layout, whose parameters are
+ * passed as is. *kp is NULL if out of memory, the parameters are then sent
+ * whole.
+ */
+static CUresult kernel_launch_params_pack(CUfunction f, void **kernelParams, void **extra,
+                                          const unsigned char **params, size_t *size,
+                                          struct kernel_params **kp,
+                                          const struct nv_info_kparams **layout)
+{
+    static __thread unsigned char packed[KERNEL_PARAM_MAX];
+
+    *params = NULL;
+    *size = 0;
+    *layout = NULL;
+    if (extra != NULL) {
+        for (unsigned int i = 0; extra[i] != CU_LAUNCH_PARAM_END; i += 2) {
+            if (extra[i] == CU_LAUNCH_PARAM_BUFFER_POINTER)
+                *params = extra[i + 1];
+            else if (extra[i] == CU_LAUNCH_PARAM_BUFFER_SIZE)
+                *size = *(size_t *) extra[i + 1];
+        }
+        if (*params == NULL)
+            *size = 0;
+        *kp = kernel_params_get(f);
+        return *size > KERNEL_PARAM_MAX ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
     }
-    /*
-     * XXX: Encryption routine of aes_ctr_dolbeau kernel itself calls cuLaunchGrid
-     */
-    if (f != aes_ctr_dolbeau) {
-        /*
-         * XXX: We wait until kernel is launched inside the function
-         */
-        ret = launch_encryption_overhead(f, grid_width, grid_height);
-        if (ret == CUDA_ERROR_NOT_FOUND) {
-            /*
-             * Ignore not found as kernel may not have parameters to encrypt
-             */
-            return CUDA_SUCCESS;
+
+    *kp = kernel_params_find(f);
+    if (*kp == NULL || !(*kp)->has_layout || kernelParams == NULL)
+        return CUDA_SUCCESS;
+    if ((*kp)->layout.size > KERNEL_PARAM_MAX)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    memset(packed, 0, (*kp)->layout.size);
+    for (unsigned int i = 0; i < (*kp)->layout.count; i++) {
+        const struct nv_info_param *p = &(*kp)->layout.param[i];
+        if (p->offset + p->size > (*kp)->layout.size)
+            return CUDA_ERROR_INVALID_VALUE;
+        memcpy(packed + p->offset, kernelParams[i], p->size);
+    }
+    *params = packed;
+    *size = (*kp)->layout.size;
+    *layout = &(*kp)->layout;
+    return CUDA_SUCCESS;
+}
+
+static CUresult launch_batch_flush_locked(void)
+{
+    CUresult ret = CUDA_SUCCESS;
+    unsigned int slot = launch_batch.flushes % 2;
+    unsigned char *host = launch_batch.host[slot];
+    CUdeviceptr dev = launch_batch.dev[slot];
+    size_t nbytes = launch_batch.delta_used;
+    unsigned int nruns = launch_batch.nruns;
+    size_t runs_bytes = nruns > 1 ? nruns * sizeof(struct wc_desc) : 0;
+    void *args[NV_INFO_MAX_PARAMS];
+
+    if (launch_batch.count == 0)
+        return CUDA_SUCCESS;
+    DEBUG_PRINTF("launch_batch_flush: %u launches, %zu bytes changed in %u runs\n",
+                 launch_batch.count, nbytes, launch_batch.nruns);
+
+    if (nruns != 0) {
+        uint64_t origin = ctr_space_reserve(0, nbytes);
+
+        // the upload from this buffer two flushes ago
+        if ((ret = cu_event_synchronize(launch_batch.copied[slot])) != CUDA_SUCCESS)
+            goto cuda_err;
+        aes_ctr_counter_add(host, h_IV, origin / 16);
+        if (aes256_ctr_encrypt_pool_at(host + 16, launch_batch.delta, nbytes,
+                                       h_IV, h_key, origin) != EXIT_SUCCESS) {
+            ret = CUDA_ERROR_UNKNOWN;
+            goto cuda_err;
         }
-        if (ret != CUDA_SUCCESS) {
-            PRINT_ERROR("launch_encryption_overhead failed with %d\n", ret);
-            return ret;
+        memcpy(host + 16 + nbytes, launch_batch.runs, runs_bytes);
+        if ((ret = cu_memcpy_hd_async(dev, host, 16 + nbytes + runs_bytes, NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+        if ((ret = cu_event_record(launch_batch.copied[slot], NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+        // a single run is decrypted in place directly
+        ret = aes_265_ctr_gpu(nruns == 1 ? launch_batch.runs[0].dev : dev + 16, dev + 16,
+                              nbytes, dev, NULL);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+        if (nruns > 1 && (ret = wc_kernel(wc.scatter, dev + 16, dev + 16 + nbytes,
+                                          nruns, nbytes, NULL)) != CUDA_SUCCESS)
+            goto cuda_err;
+        launch_batch.flushes++;
+    }
+
+    // the driver copies the parameters at each launch
+    for (unsigned int i = 0; i < launch_batch.count; i++) {
+        const struct deferred_launch *l = &launch_batch.launch[i];
+        unsigned char *params = launch_batch.params + l->offset;
+        void **kernel_params = NULL, **extra = NULL;
+        size_t size = l->size;
+        void *buffer[] = {
+            CU_LAUNCH_PARAM_BUFFER_POINTER, params,
+            CU_LAUNCH_PARAM_BUFFER_SIZE, &size,
+            CU_LAUNCH_PARAM_END,
+        };
+
+        if (l->layout != NULL) {
+            for (unsigned int j = 0; j < l->layout->count; j++)
+                args[j] = params + l->layout->param[j].offset;
+            kernel_params = args;
+        } else {
+            extra = buffer;
+        }
+        ret = cu_launch_kernel(l->f, l->grid[0], l->grid[1], l->grid[2],
+                               l->block[0], l->block[1], l->block[2],
+                               l->shared_bytes, NULL, kernel_params, extra);
+        if (ret != CUDA_SUCCESS)
+            goto cuda_err;
+    }
+
+    launch_batch.used = 0;
+    launch_batch.delta_used = 0;
+    launch_batch.nruns = 0;
+    launch_batch.count = 0;
+    return CUDA_SUCCESS;
+
+    cuda_err:
+    CUDA_PRINT_ERROR(ret);
+    // the launches not done yet are lost, the device copies of their
+    // parameters may be stale
+    for (unsigned int i = 0; i < launch_batch.count; i++) {
+        struct kernel_params *kp = launch_batch.launch[i].kp;
+        pthread_mutex_lock(&kp->lock);
+        kp->last_valid = 0;
+        pthread_mutex_unlock(&kp->lock);
+    }
+    launch_batch.used = 0;
+    launch_batch.delta_used = 0;
+    launch_batch.nruns = 0;
+    launch_batch.count = 0;
+    return ret;
+}
+
+static CUresult launch_batch_flush(void)
+{
+    CUresult ret;
+
+    if (config.launch_batch_max == 0)
+        return CUDA_SUCCESS;
+
+    pthread_mutex_lock(&launch_batch.lock);
+    ret = launch_batch_flush_locked();
+    pthread_mutex_unlock(&launch_batch.lock);
+    return ret;
+}
+
+/*
+ * Add the changed blocks of a launch to the batch. The runs of one
+ * wc_scatter must not overlap: a block already changed by a launch of the
+ * same function in the batch only gets its plaintext updated, the kernels
+ * run after the whole scatter anyway.
+ */
+static void launch_batch_add_delta(const unsigned char *data, const struct wc_desc *runs,
+                                   unsigned int nruns, int search)
+{
+    for (unsigned int r = 0; r < nruns; r++) {
+        for (uint32_t b = 0; b < runs[r].n; b += 16) {
+            uint64_t dst = runs[r].dev + b;
+            const unsigned char *block = data + runs[r].offset + b;
+            struct wc_desc *d = NULL;
+
+            for (unsigned int i = 0; search && i < launch_batch.nruns && d == NULL; i++) {
+                if (launch_batch.runs[i].dev <= dst
+                    && dst < launch_batch.runs[i].dev + launch_batch.runs[i].n)
+                    d = &launch_batch.runs[i];
+            }
+            if (d != NULL) {
+                memcpy(launch_batch.delta + d->offset + (dst - d->dev), block, 16);
+                continue;
+            }
+
+            if (launch_batch.nruns > 0)
+                d = &launch_batch.runs[launch_batch.nruns - 1];
+            if (d != NULL && d->dev + d->n == dst && d->offset + d->n == launch_batch.delta_used) {
+                d->n += 16;
+            } else {
+                d = &launch_batch.runs[launch_batch.nruns++];
+                d->dev = dst;
+                d->offset = launch_batch.delta_used;
+                d->n = 16;
+            }
+            memcpy(launch_batch.delta + launch_batch.delta_used, block, 16);
+            launch_batch.delta_used += 16;
         }
     }
+}
+
+// defer a launch of kp on the NULL stream, with size <= KERNEL_PARAM_MAX
+// bytes of parameters
+static CUresult launch_batch_add(CUfunction f, struct kernel_params *kp,
+                                 const unsigned int grid[3], const unsigned int block[3],
+                                 unsigned int shared_bytes,
+                                 const unsigned char *params, size_t size,
+                                 const struct nv_info_kparams *layout)
+{
+    static __thread unsigned char delta[KERNEL_PARAM_MAX];
+    static __thread struct wc_desc runs[KERNEL_PARAM_MAX_RUNS];
+    CUresult ret = CUDA_SUCCESS;
+    unsigned int nruns = 0;
+    size_t nbytes = 0;
+    int search = 0;
+
+    pthread_mutex_lock(&launch_batch.lock);
+    if (launch_batch.count == config.launch_batch_max
+        || launch_batch.used + size > LAUNCH_BATCH_DATA_SIZE
+        || launch_batch.delta_used + ROUND_UP(size, 16) > LAUNCH_BATCH_DATA_SIZE
+        || launch_batch.nruns + KERNEL_PARAM_MAX / 16 > LAUNCH_BATCH_MAX_RUNS)
+        ret = launch_batch_flush_locked();
+
+    if (ret == CUDA_SUCCESS) {
+        pthread_mutex_lock(&kp->lock);
+        if ((ret = kernel_params_dev(kp)) == CUDA_SUCCESS && size != 0)
+            nruns = kernel_params_delta(kp, params, size, delta, runs, &nbytes);
+        pthread_mutex_unlock(&kp->lock);
+    }
+
+    if (ret == CUDA_SUCCESS) {
+        for (unsigned int i = 0; i < launch_batch.count && !search; i++)
+            search = launch_batch.launch[i].kp == kp;
+        launch_batch_add_delta(delta, runs, nruns, search);
+
+        struct deferred_launch *l = &launch_batch.launch[launch_batch.count++];
+        l->f = f;
+        l->kp = kp;
+        l->layout = layout;
+        memcpy(l->grid, grid, sizeof(l->grid));
+        memcpy(l->block, block, sizeof(l->block));
+        l->shared_bytes = shared_bytes;
+        l->offset = launch_batch.used;
+        l->size = size;
+        memcpy(launch_batch.params + launch_batch.used, params, size);
+        launch_batch.used += ROUND_UP(size, 16);
+    }
+    pthread_mutex_unlock(&launch_batch.lock);
+    return ret;
+}
+#else
+static CUresult launch_batch_flush(void)
+{
     return CUDA_SUCCESS;
 }
-#endif
\ No newline at end of file
+#endif
+
+/*
+ * The kernel may read the destination of pending write-combined copies, and
+ * the caller may expect them done once the context is synchronized. Its
+ * parameters are sent encrypted ahead of it, on hStream, like those of
+ * cuLaunchGrid, or deferred with the launch on the NULL stream.
+ */
+__attribute__((visibility("default")))
+CUresult cuLaunchKernel(CUfunction f,
+                        unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+                        unsigned int sharedMemBytes, CUstream hStream,
+                        void **kernelParams, void **extra)
+{
+    CUresult ret;
+
+    if ((ret = wc_flush()) != CUDA_SUCCESS)
+        return ret;
+    #if CU_ENCRYPT_KERNEL_PARAM
+    const unsigned char *params;
+    const struct nv_info_kparams *layout;
+    struct kernel_params *kp;
+    size_t size;
+
+    ret = kernel_launch_params_pack(f, kernelParams, extra, &params, &size, &kp, &layout);
+    if (ret != CUDA_SUCCESS) {
+        PRINT_ERROR("kernel_launch_params_pack failed with %d\n", ret);
+        return ret;
+    }
+    if (hStream == NULL && params != NULL && kp != NULL && config.launch_batch_max != 0) {
+        unsigned int grid[3] = {gridDimX, gridDimY, gridDimZ};
+        unsigned int block[3] = {blockDimX, blockDimY, blockDimZ};
+        return launch_batch_add(f, kp, grid, block, sharedMemBytes, params, size, layout);
+    }
+    if ((ret = launch_batch_flush()) != CUDA_SUCCESS)
+        return ret;
+    if (params != NULL && (ret = kernel_params_send(kp, params, size, hStream)) != CUDA_SUCCESS) {
+        PRINT_ERROR("kernel_params_send failed with %d\n", ret);
+        return ret;
+    }
+    #endif
+    return cu_launch_kernel(f, gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ,
+                            sharedMemBytes, hStream, kernelParams, extra);
+}
+
+__attribute__((visibility("default")))
+CUresult cuCtxSynchronize(void)
+{
+    CUresult ret;
+
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_ctx_synchronize();
+}
+
+/*
+ * The caller may expect the deferred copies and launches done once the
+ * stream is synchronized, or before the event. The library itself calls
+ * cu_stream_synchronize and cu_event_record: these flushes take
+ * launch_batch.lock and wc.lock, which its callers may hold, or take after
+ * kp->lock.
+ */
+__attribute__((visibility("default")))
+CUresult cuStreamSynchronize(CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_stream_synchronize(hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_event_record(hEvent, hStream);
+}
+
+/*
+ * A query may report the deferred work done before it was sent, and a stream
+ * waiting on an event, or an event waited on, must see the work queued before
+ * it. The library calls the raw functions, for the same reason as above.
+ */
+__attribute__((visibility("default")))
+CUresult cuStreamQuery(CUstream hStream)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_stream_query(hStream);
+}
+
+__attribute__((visibility("default")))
+CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent, unsigned int Flags)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_stream_wait_event(hStream, hEvent, Flags);
+}
+
+__attribute__((visibility("default")))
+CUresult cuEventQuery(CUevent hEvent)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_event_query(hEvent);
+}
+
+__attribute__((visibility("default")))
+CUresult cuEventSynchronize(CUevent hEvent)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_event_synchronize(hEvent);
+}
+
+// the deferred work would be lost with the context
+__attribute__((visibility("default")))
+CUresult cuCtxDestroy(CUcontext ctx)
+{
+    CUresult ret;
+
+    pthread_once(&sync_once, sync_init);
+    if ((ret = deferred_flush()) != CUDA_SUCCESS)
+        return ret;
+    return cu_ctx_destroy(ctx);
+}
+
+__attribute__((visibility("default")))
+CUresult cuCtxDestroy_v2(CUcontext ctx)
+{
+    return cuCtxDestroy(ctx);
+}
@@ -0,0 +1,121 @@
+/*
+ * GHASH of AES-GCM (NIST SP 800-38D) on the GPU, for the GCM mode of
+ * libenccuda. The CTR part of GCM is done by the AES-CTR kernel of Dolbeau.
+ *
+ * ghash_gcm(in, nbytes, H, tag) XORs GHASH_H(C) into the 16 bytes at tag,
+ * C being the nbytes at in (the last block padded with zeros), without
+ * additional data, and followed by the length block.
+ *
+ * GHASH is a polynomial in H: the message is split in one segment of
+ * consecutive blocks per thread, each thread evaluates its segment with
+ * Horner's rule, shifts the result by the blocks after the segment, and
+ * the results are XORed together. Any grid works: the number of blocks per
+ * thread follows from its size.
+ */
+
+#include <stdint.h>
+
+// x = x * y in GF(2^128), with the bit order of GCM, on big-endian halves
+__device__ static void gf128_mul(uint64_t *xh, uint64_t *xl, uint64_t yh, uint64_t yl)
+{
+    uint64_t zh = 0, zl = 0;
+
+    for (int i = 0; i < 128; i++) {
+        uint64_t bit = i < 64 ? *xh >> (63 - i) : *xl >> (127 - i);
+        uint64_t mask = 0 - (bit & 1);
+        zh ^= yh & mask;
+        zl ^= yl & mask;
+
+        uint64_t reduce = 0 - (yl & 1);
+        yl = (yl >> 1) | (yh << 63);
+        yh = (yh >> 1) ^ (0xe100000000000000ull & reduce);
+    }
+    *xh = zh;
+    *xl = zl;
+}
+
+__device__ static uint64_t load_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// block j of the message: C_j, zero padded, or the length block
+__device__ static void ghash_block(const uint8_t *in, uint32_t nbytes, uint32_t j,
+                                   uint64_t *bh, uint64_t *bl)
+{
+    uint32_t nblocks = (nbytes + 15) / 16;
+
+    if (j == nblocks) {
+        *bh = 0;
+        *bl = (uint64_t) nbytes * 8;
+    } else if (16 * j + 16 <= nbytes) {
+        *bh = load_be64(in + 16 * j);
+        *bl = load_be64(in + 16 * j + 8);
+    } else {
+        uint8_t b[16] = {0};
+        for (uint32_t i = 16 * j; i < nbytes; i++)
+            b[i - 16 * j] = in[i];
+        *bh = load_be64(b);
+        *bl = load_be64(b + 8);
+    }
+}
+
+extern "C" __global__ void ghash_gcm(const uint8_t *in, uint32_t nbytes,
+                                     const uint8_t *H, uint32_t *tag)
+{
+    __shared__ uint64_t sh[256], sl[256];
+    const uint32_t tx = threadIdx.x;
+    const uint32_t t = blockIdx.x * blockDim.x + tx;
+    const uint32_t nthreads = gridDim.x * blockDim.x;
+    // the message blocks and the length block
+    const uint32_t m = (nbytes + 15) / 16 + 1;
+    const uint32_t per = (m + nthreads - 1) / nthreads;
+
+    uint64_t hh = load_be64(H), hl = load_be64(H + 8);
+    uint64_t ah = 0, al = 0;
+
+    if ((uint64_t) t * per < m) {
+        uint32_t lo = t * per;
+        uint32_t hi = lo + per < m ? lo + per : m;
+
+        for (uint32_t j = lo; j < hi; j++) {
+            uint64_t bh, bl;
+            ghash_block(in, nbytes, j, &bh, &bl);
+            ah ^= bh;
+            al ^= bl;
+            gf128_mul(&ah, &al, hh, hl);
+        }
+
+        // times H^(m - hi), by square and multiply
+        uint64_t ph = hh, pl = hl;
+        for (uint32_t k = m - hi; k != 0; k >>= 1) {
+            if (k & 1)
+                gf128_mul(&ah, &al, ph, pl);
+            if (k > 1)
+                gf128_mul(&ph, &pl, ph, pl);
+        }
+    }
+
+    /* assume blockDim.x == 256 */
+    sh[tx] = ah;
+    sl[tx] = al;
+    __syncthreads();
+    for (uint32_t s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tx < s) {
+            sh[tx] ^= sh[tx + s];
+            sl[tx] ^= sl[tx + s];
+        }
+        __syncthreads();
+    }
+
+    // tag is big-endian bytes, the words are little-endian
+    if (tx == 0) {
+        atomicXor(&tag[0], __byte_perm((uint32_t) (sh[0] >> 32), 0, 0x0123));
+        atomicXor(&tag[1], __byte_perm((uint32_t) sh[0], 0, 0x0123));
+        atomicXor(&tag[2], __byte_perm((uint32_t) (sl[0] >> 32), 0, 0x0123));
+        atomicXor(&tag[3], __byte_perm((uint32_t) sl[0], 0, 0x0123));
+    }
+}
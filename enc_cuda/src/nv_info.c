@@ -0,0 +1,112 @@
+#include "nv_info.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A .nv.info section is a sequence of attributes: a format byte, an
+ * attribute byte, then a 16-bit value, or for EIFMT_SVAL a 16-bit size and
+ * that many bytes. EIATTR_KPARAM_INFO holds {uint32 index, uint16 ordinal,
+ * uint16 offset, uint32 flags}, the size being bits 18 to 31 of flags.
+ * EIATTR_CBANK_PARAM_SIZE is the size of the whole parameter buffer.
+ */
+#define EIFMT_SVAL 0x04
+#define EIATTR_KPARAM_INFO 0x17
+#define EIATTR_CBANK_PARAM_SIZE 0x19
+
+static uint16_t load_le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t load_le32(const unsigned char *p)
+{
+    return load_le16(p) | (uint32_t) load_le16(p + 2) << 16;
+}
+
+static int parse_kparams(const unsigned char *p, size_t len, struct nv_info_kparams *kp)
+{
+    unsigned int end = 0, size = 0;
+
+    memset(kp, 0, sizeof(*kp));
+    for (size_t i = 0; i + 4 <= len;) {
+        unsigned int fmt = p[i], attr = p[i + 1];
+        const unsigned char *val = p + i + 4;
+        size_t n = fmt == EIFMT_SVAL ? load_le16(p + i + 2) : 0;
+
+        if (i + 4 + n > len)
+            return EXIT_FAILURE;
+
+        if (attr == EIATTR_KPARAM_INFO && fmt == EIFMT_SVAL && n >= 12) {
+            unsigned int ordinal = load_le16(val + 4);
+            unsigned int offset = load_le16(val + 6);
+            unsigned int psize = (load_le32(val + 8) >> 18) & 0x3fff;
+
+            if (ordinal >= NV_INFO_MAX_PARAMS)
+                return EXIT_FAILURE;
+            kp->param[ordinal].offset = offset;
+            kp->param[ordinal].size = psize;
+            if (ordinal + 1 > kp->count)
+                kp->count = ordinal + 1;
+            if (offset + psize > end)
+                end = offset + psize;
+        } else if (attr == EIATTR_CBANK_PARAM_SIZE && fmt != EIFMT_SVAL) {
+            size = load_le16(p + i + 2);
+        }
+        i += 4 + n;
+    }
+
+    kp->size = size > end ? size : end;
+    return EXIT_SUCCESS;
+}
+
+int nv_info_kparams(const char *path, const char *kernel, struct nv_info_kparams *kp)
+{
+    int ret = EXIT_FAILURE;
+    unsigned char *image = NULL;
+    long len;
+    char name[256];
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL)
+        return EXIT_FAILURE;
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < (long) sizeof(Elf64_Ehdr))
+        goto out;
+    if ((image = malloc(len)) == NULL)
+        goto out;
+    rewind(f);
+    if (fread(image, 1, len, f) != (size_t) len)
+        goto out;
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *) image;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_shentsize != sizeof(Elf64_Shdr) || eh->e_shstrndx >= eh->e_shnum
+        || eh->e_shoff > (size_t) len
+        || eh->e_shnum > ((size_t) len - eh->e_shoff) / sizeof(Elf64_Shdr))
+        goto out;
+
+    const Elf64_Shdr *sh = (const Elf64_Shdr *) (image + eh->e_shoff);
+    const Elf64_Shdr *strtab = &sh[eh->e_shstrndx];
+    if (strtab->sh_offset > (size_t) len || strtab->sh_size > len - strtab->sh_offset)
+        goto out;
+    if (snprintf(name, sizeof(name), ".nv.info.%s", kernel) >= (int) sizeof(name))
+        goto out;
+
+    for (unsigned int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_name >= strtab->sh_size
+            || strncmp((const char *) image + strtab->sh_offset + sh[i].sh_name, name,
+                       strtab->sh_size - sh[i].sh_name) != 0)
+            continue;
+        if (sh[i].sh_offset > (size_t) len || sh[i].sh_size > len - sh[i].sh_offset)
+            break;
+        ret = parse_kparams(image + sh[i].sh_offset, sh[i].sh_size, kp);
+        break;
+    }
+
+    out:
+    free(image);
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Parameter layout of a kernel, read from the .nv.info.<kernel> section of
+ * its cubin: one EIATTR_KPARAM_INFO attribute per parameter gives its
+ * ordinal, offset and size. cuLaunchKernel only gets a pointer to each
+ * parameter, the layout tells how many bytes it points to.
+ */
+
+#define NV_INFO_MAX_PARAMS 256
+
+struct nv_info_param {
+    uint16_t offset;
+    uint16_t size;
+};
+
+struct nv_info_kparams {
+    unsigned int count; //< parameters, param[i] for ordinal i
+    unsigned int size;  //< bytes of the parameter buffer
+    struct nv_info_param param[NV_INFO_MAX_PARAMS];
+};
+
+/// @brief Read the parameter layout of kernel from the cubin at path.
+/// @return EXIT_SUCCESS, or EXIT_FAILURE if path is not a cubin, or has no
+///         parameter information for kernel.
+int nv_info_kparams(const char *path, const char *kernel, struct nv_info_kparams *kp);
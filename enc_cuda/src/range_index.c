@@ -0,0 +1,124 @@
+#include "range_index.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANGE_INDEX_MIN_ENTRIES 64
+
+struct range_entry {
+    uint64_t base, end;
+    void *value;
+};
+
+struct range_index {
+    pthread_rwlock_t lock;
+    struct range_entry *entries; //< sorted by base
+    size_t count, capacity;
+};
+
+struct range_index *range_index_create(void)
+{
+    struct range_index *ri = calloc(1, sizeof(*ri));
+    if (ri == NULL)
+        return NULL;
+
+    ri->entries = calloc(RANGE_INDEX_MIN_ENTRIES, sizeof(*ri->entries));
+    if (ri->entries == NULL) {
+        free(ri);
+        return NULL;
+    }
+    ri->capacity = RANGE_INDEX_MIN_ENTRIES;
+    pthread_rwlock_init(&ri->lock, NULL);
+    return ri;
+}
+
+void range_index_destroy(struct range_index *ri)
+{
+    if (ri == NULL)
+        return;
+
+    pthread_rwlock_destroy(&ri->lock);
+    free(ri->entries);
+    free(ri);
+}
+
+// index of the first entry with base > addr
+static size_t range_index_upper(const struct range_index *ri, uint64_t addr)
+{
+    size_t lo = 0, hi = ri->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ri->entries[mid].base <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int range_index_insert(struct range_index *ri, uint64_t base, uint64_t size, void *value)
+{
+    int ret = EXIT_FAILURE;
+
+    pthread_rwlock_wrlock(&ri->lock);
+
+    size_t i = range_index_upper(ri, base);
+    if ((i > 0 && ri->entries[i - 1].end > base)
+        || (i < ri->count && ri->entries[i].base < base + size))
+        goto out;
+
+    if (ri->count == ri->capacity) {
+        struct range_entry *entries =
+            realloc(ri->entries, 2 * ri->capacity * sizeof(*entries));
+        if (entries == NULL)
+            goto out;
+        ri->entries = entries;
+        ri->capacity *= 2;
+    }
+
+    memmove(&ri->entries[i + 1], &ri->entries[i], (ri->count - i) * sizeof(*ri->entries));
+    ri->entries[i] = (struct range_entry) {base, base + size, value};
+    ri->count++;
+    ret = EXIT_SUCCESS;
+
+    out:
+    pthread_rwlock_unlock(&ri->lock);
+    return ret;
+}
+
+void *range_index_remove(struct range_index *ri, uint64_t base)
+{
+    void *value = NULL;
+
+    pthread_rwlock_wrlock(&ri->lock);
+
+    size_t i = range_index_upper(ri, base);
+    if (i > 0 && ri->entries[i - 1].base == base) {
+        value = ri->entries[i - 1].value;
+        memmove(&ri->entries[i - 1], &ri->entries[i], (ri->count - i) * sizeof(*ri->entries));
+        ri->count--;
+    }
+
+    pthread_rwlock_unlock(&ri->lock);
+    return value;
+}
+
+void *range_index_lookup(struct range_index *ri, uint64_t addr, uint64_t *base)
+{
+    void *value = NULL;
+
+    pthread_rwlock_rdlock(&ri->lock);
+
+    size_t i = range_index_upper(ri, addr);
+    if (i > 0 && addr < ri->entries[i - 1].end) {
+        value = ri->entries[i - 1].value;
+        if (base != NULL)
+            *base = ri->entries[i - 1].base;
+    }
+
+    pthread_rwlock_unlock(&ri->lock);
+    return value;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Index of disjoint address ranges [base, base + size), resolving any
+ * address inside a range to the range's value in O(log n). Backed by a
+ * sorted array: lookups take a read lock, inserts and removals (one per
+ * cuMemAlloc / cuMemFree) a write lock and shift the tail of the array.
+ */
+
+struct range_index;
+
+struct range_index *range_index_create(void);
+void range_index_destroy(struct range_index *ri);
+
+/// @return EXIT_SUCCESS, or EXIT_FAILURE if out of memory or if the range
+///         overlaps an existing one.
+int range_index_insert(struct range_index *ri, uint64_t base, uint64_t size, void *value);
+
+/// @return the value of the range starting at base, or NULL.
+void *range_index_remove(struct range_index *ri, uint64_t base);
+
+/// @brief Find the range holding addr.
+/// @param base if not NULL, set to the base of the range found.
+/// @return the value of the range, or NULL.
+void *range_index_lookup(struct range_index *ri, uint64_t addr, uint64_t *base);
@@ -0,0 +1,267 @@
+#include "registry.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Open addressing with linear probing. A slot is written value first, key
+ * last (release), and read key first (acquire), so a reader that finds its
+ * key also sees the value. Removal leaves a tombstone key.
+ *
+ * When live entries and tombstones fill half of the table, the writer
+ * copies the live entries to a new table and publishes it. Readers still
+ * probing the old table finish there, so it is retired, not freed.
+ *
+ * Lookups that miss the thread cache count themselves in readers[phase].
+ * Each write then tries to move on: once no lookup of the previous phase
+ * is left, the tables retired before the last flip (draining) are freed,
+ * those retired since then start draining, and the phase flips. A lookup
+ * counted in the new phase loads the table after the flip, so it never
+ * sees a draining table. A lookup that read the phase before a flip sees
+ * the change and counts itself again.
+ */
+
+#define REGISTRY_EMPTY 0
+#define REGISTRY_TOMBSTONE UINT64_MAX
+#define REGISTRY_MIN_SLOTS 64
+
+// per-thread last hits, one per registry modulo this
+#define REGISTRY_TLS_CACHE 4
+
+struct registry_slot {
+    uint64_t key;
+    void *value;
+};
+
+struct registry_table {
+    size_t mask; //< number of slots - 1
+    struct registry_table *retired; //< next in registry.retired or .draining
+    struct registry_slot slots[];
+};
+
+struct registry {
+    struct registry_table *table; //< atomic
+    pthread_mutex_t lock; //< writers
+    size_t live, used; //< entries, entries + tombstones
+    unsigned long readers[2]; //< atomic, lookups in progress, by phase
+    unsigned int phase; //< atomic
+    struct registry_table *retired, *draining; //< not yet freed, writers only
+    unsigned long epoch; //< atomic, bumped when a value is removed or replaced
+    unsigned long id;
+};
+
+struct registry_cache {
+    unsigned long id, epoch;
+    uint64_t key;
+    void *value;
+};
+
+static __thread struct registry_cache tls_cache[REGISTRY_TLS_CACHE];
+
+// never reused, so that a cache entry cannot match a later registry
+static unsigned long registry_ids;
+
+// murmur3 finalizer: device pointers share their low and high bits
+static inline size_t registry_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct registry_table *registry_table_new(size_t nslots)
+{
+    struct registry_table *t =
+        calloc(1, sizeof(*t) + nslots * sizeof(struct registry_slot));
+    if (t != NULL)
+        t->mask = nslots - 1;
+    return t;
+}
+
+struct registry *registry_create(void)
+{
+    struct registry *r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    r->table = registry_table_new(REGISTRY_MIN_SLOTS);
+    if (r->table == NULL) {
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->id = __atomic_add_fetch(&registry_ids, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+static void registry_tables_free(struct registry_table *t)
+{
+    struct registry_table *next;
+
+    for (; t != NULL; t = next) {
+        next = t->retired;
+        free(t);
+    }
+}
+
+void registry_destroy(struct registry *r)
+{
+    if (r == NULL)
+        return;
+
+    free(r->table);
+    registry_tables_free(r->retired);
+    registry_tables_free(r->draining);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+// free the draining tables if no lookup may still probe them. Writers only.
+static void registry_reclaim(struct registry *r)
+{
+    unsigned int phase = __atomic_load_n(&r->phase, __ATOMIC_SEQ_CST);
+
+    if (r->retired == NULL && r->draining == NULL)
+        return;
+    if (__atomic_load_n(&r->readers[phase ^ 1], __ATOMIC_SEQ_CST) != 0)
+        return;
+
+    registry_tables_free(r->draining);
+    r->draining = r->retired;
+    r->retired = NULL;
+    __atomic_store_n(&r->phase, phase ^ 1, __ATOMIC_SEQ_CST);
+}
+
+// slot holding key, or NULL. Lock-free.
+static struct registry_slot *registry_find(struct registry_table *t, uint64_t key)
+{
+    for (size_t i = registry_hash(key);; i++) {
+        struct registry_slot *s = &t->slots[i & t->mask];
+        uint64_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return s;
+        if (k == REGISTRY_EMPTY)
+            return NULL;
+    }
+}
+
+static void registry_slot_set(struct registry_slot *s, uint64_t key, void *value)
+{
+    __atomic_store_n(&s->value, value, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->key, key, __ATOMIC_RELEASE);
+}
+
+// first free slot for key, which must not be present. Writers only.
+static struct registry_slot *registry_free_slot(struct registry_table *t, uint64_t key)
+{
+    for (size_t i = registry_hash(key);; i++) {
+        struct registry_slot *s = &t->slots[i & t->mask];
+        if (s->key == REGISTRY_EMPTY || s->key == REGISTRY_TOMBSTONE)
+            return s;
+    }
+}
+
+// make room for one more entry. Writers only.
+static int registry_reserve(struct registry *r)
+{
+    struct registry_table *old = r->table, *t;
+    size_t nslots = old->mask + 1;
+
+    if ((r->used + 1) * 2 <= nslots)
+        return EXIT_SUCCESS;
+
+    // grow if mostly live entries, otherwise just drop the tombstones
+    if ((r->live + 1) * 4 > nslots)
+        nslots *= 2;
+
+    t = registry_table_new(nslots);
+    if (t == NULL)
+        return EXIT_FAILURE;
+
+    for (size_t i = 0; i <= old->mask; i++) {
+        struct registry_slot *s = &old->slots[i];
+        if (s->key != REGISTRY_EMPTY && s->key != REGISTRY_TOMBSTONE)
+            *registry_free_slot(t, s->key) = *s;
+    }
+    r->used = r->live;
+
+    __atomic_store_n(&r->table, t, __ATOMIC_SEQ_CST);
+    old->retired = r->retired;
+    r->retired = old;
+    return EXIT_SUCCESS;
+}
+
+int registry_insert(struct registry *r, uint64_t key, void *value)
+{
+    struct registry_slot *s;
+    int ret = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&r->lock);
+
+    if ((s = registry_find(r->table, key)) != NULL) {
+        __atomic_store_n(&s->value, value, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&r->epoch, 1, __ATOMIC_RELEASE);
+    } else if ((ret = registry_reserve(r)) == EXIT_SUCCESS) {
+        s = registry_free_slot(r->table, key);
+        if (s->key == REGISTRY_EMPTY)
+            r->used++;
+        r->live++;
+        registry_slot_set(s, key, value);
+    }
+    registry_reclaim(r);
+
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+void *registry_remove(struct registry *r, uint64_t key)
+{
+    struct registry_slot *s;
+    void *value = NULL;
+
+    pthread_mutex_lock(&r->lock);
+
+    if ((s = registry_find(r->table, key)) != NULL) {
+        value = s->value;
+        registry_slot_set(s, REGISTRY_TOMBSTONE, NULL);
+        r->live--;
+        __atomic_add_fetch(&r->epoch, 1, __ATOMIC_RELEASE);
+    }
+    registry_reclaim(r);
+
+    pthread_mutex_unlock(&r->lock);
+    return value;
+}
+
+void *registry_lookup(struct registry *r, uint64_t key)
+{
+    struct registry_cache *c = &tls_cache[r->id % REGISTRY_TLS_CACHE];
+    unsigned long epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+
+    if (c->id == r->id && c->epoch == epoch && c->key == key)
+        return c->value;
+
+    unsigned int phase;
+    for (;;) {
+        phase = __atomic_load_n(&r->phase, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r->readers[phase], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->phase, __ATOMIC_SEQ_CST) == phase)
+            break;
+        __atomic_sub_fetch(&r->readers[phase], 1, __ATOMIC_SEQ_CST);
+    }
+
+    struct registry_slot *s = registry_find(__atomic_load_n(&r->table, __ATOMIC_SEQ_CST), key);
+    void *value = s != NULL ? __atomic_load_n(&s->value, __ATOMIC_ACQUIRE) : NULL;
+
+    __atomic_sub_fetch(&r->readers[phase], 1, __ATOMIC_SEQ_CST);
+
+    // tagged with the epoch read before the lookup, so that a concurrent
+    // removal invalidates it
+    if (value != NULL)
+        *c = (struct registry_cache) {r->id, epoch, key, value};
+    return value;
+}
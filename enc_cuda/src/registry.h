@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Concurrent map from a 64-bit key (device pointer, CUfunction, ...) to a
+ * pointer, for lookups on every copy and launch from any number of threads.
+ *
+ * Lookups are lock-free, and each thread keeps its last hit per registry,
+ * since applications keep copying to the same buffers. Inserts and removals
+ * are serialized by a mutex. Keys 0 and UINT64_MAX are reserved, and a NULL
+ * value cannot be told apart from a missing key.
+ *
+ * The registry frees its own tables, never the values: a caller may free a
+ * value once it is removed only if no lookup of its key can run
+ * concurrently, e.g. cuMemFree and a copy to the same buffer.
+ */
+
+struct registry;
+
+struct registry *registry_create(void);
+void registry_destroy(struct registry *r);
+
+/// @brief Associate value with key, replacing any previous value.
+/// @return EXIT_SUCCESS, or EXIT_FAILURE if out of memory.
+int registry_insert(struct registry *r, uint64_t key, void *value);
+
+/// @return the value removed, or NULL if key was not present.
+void *registry_remove(struct registry *r, uint64_t key);
+
+/// @return the value associated with key, or NULL.
+void *registry_lookup(struct registry *r, uint64_t key);
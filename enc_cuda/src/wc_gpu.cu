@@ -0,0 +1,92 @@
+/*
+ * Scatter and gather of the packed copies of libenccuda: write-combined
+ * HtoD copies, the copies of cuda_enc_memcpy_batch, and the rows of 2D and
+ * 3D copies.
+ *
+ * wc_scatter(data, desc, ndesc) copies, for each descriptor, the n bytes at
+ * data + offset to dev; wc_gather(data, desc, ndesc) the n bytes at dev to
+ * data + offset. The copies never overlap. All the threads of the grid
+ * stride over the bytes of each descriptor in turn.
+ *
+ * pitch_scatter(data, stride, dev, pitch, slice_pitch, width, height, rows)
+ * copies row r, the width bytes at data + r * stride, to
+ * dev + (r / height) * slice_pitch + (r % height) * pitch; pitch_gather the
+ * other way. The blocks of a column of the grid stride over the rows, its
+ * threads over the bytes of a row.
+ */
+
+#include <stdint.h>
+
+struct wc_desc {
+    uint64_t dev;
+    uint32_t offset;
+    uint32_t n;
+};
+
+extern "C" __global__ void wc_scatter(const uint8_t *data, const struct wc_desc *desc,
+                                      uint32_t ndesc)
+{
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t nthreads = gridDim.x * blockDim.x;
+
+    for (uint32_t i = 0; i < ndesc; i++) {
+        uint8_t *dst = (uint8_t *) desc[i].dev;
+        const uint8_t *src = data + desc[i].offset;
+
+        for (uint32_t j = t; j < desc[i].n; j += nthreads)
+            dst[j] = src[j];
+    }
+}
+
+extern "C" __global__ void wc_gather(uint8_t *data, const struct wc_desc *desc,
+                                     uint32_t ndesc)
+{
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t nthreads = gridDim.x * blockDim.x;
+
+    for (uint32_t i = 0; i < ndesc; i++) {
+        const uint8_t *src = (const uint8_t *) desc[i].dev;
+        uint8_t *dst = data + desc[i].offset;
+
+        for (uint32_t j = t; j < desc[i].n; j += nthreads)
+            dst[j] = src[j];
+    }
+}
+
+__device__ static uint8_t *pitch_row(uint8_t *dev, uint64_t pitch, uint64_t slice_pitch,
+                                     uint32_t height, uint32_t r)
+{
+    return dev + (r / height) * slice_pitch + (r % height) * pitch;
+}
+
+extern "C" __global__ void pitch_scatter(const uint8_t *data, uint32_t stride, uint8_t *dev,
+                                         uint64_t pitch, uint64_t slice_pitch,
+                                         uint32_t width, uint32_t height, uint32_t rows)
+{
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t nthreads = gridDim.x * blockDim.x;
+
+    for (uint32_t r = blockIdx.y; r < rows; r += gridDim.y) {
+        uint8_t *dst = pitch_row(dev, pitch, slice_pitch, height, r);
+        const uint8_t *src = data + (uint64_t) r * stride;
+
+        for (uint32_t j = t; j < width; j += nthreads)
+            dst[j] = src[j];
+    }
+}
+
+extern "C" __global__ void pitch_gather(uint8_t *data, uint32_t stride, const uint8_t *dev,
+                                        uint64_t pitch, uint64_t slice_pitch,
+                                        uint32_t width, uint32_t height, uint32_t rows)
+{
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    const uint32_t nthreads = gridDim.x * blockDim.x;
+
+    for (uint32_t r = blockIdx.y; r < rows; r += gridDim.y) {
+        const uint8_t *src = pitch_row((uint8_t *) dev, pitch, slice_pitch, height, r);
+        uint8_t *dst = data + (uint64_t) r * stride;
+
+        for (uint32_t j = t; j < width; j += nthreads)
+            dst[j] = src[j];
+    }
+}
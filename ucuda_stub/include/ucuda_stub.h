@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cuda.h>
+#include <stddef.h>
+
+/*
+ * Extensions of the ucuda stub library, which implements the CUDA driver
+ * API on the host: "device" memory lives in host RAM and kernels are
+ * registered CPU functions.
+ *
+ * Transfers and launches are delayed according to a simple cost model, so
+ * that the overhead of libenccuda can be measured without a GPU:
+ *
+ *   copy:   copy_latency_us + bytes / pcie_gbps
+ *           (+ bytes / pageable_gbps from or to pageable host memory)
+ *   launch: launch_latency_us, device to device copies included
+ *
+ * The model is read from the environment on cuInit:
+ *
+ *   UCUDA_STUB_PCIE_GBPS            (default 6.0, 0 disables the delay)
+ *   UCUDA_STUB_COPY_LATENCY_US      (default 10)
+ *   UCUDA_STUB_LAUNCH_LATENCY_US    (default 5)
+ *   UCUDA_STUB_PAGEABLE_GBPS        (default 6.0, 0 disables the delay)
+ *
+ * Host memory from cuMemAllocHost is pinned: it is the DMA source or
+ * destination itself. Other host memory is pageable, and copied through a
+ * staging buffer of the driver first, which pageable_gbps accounts for.
+ *
+ * Each stream runs its operations in order on a thread of its own, so work
+ * on different streams overlaps, with one DMA engine per copy direction.
+ * The NULL stream is the legacy default stream: its operations run in the
+ * calling thread once every other stream is idle, except streams created
+ * with CU_STREAM_NON_BLOCKING. cuCtxSynchronize waits for all streams.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ucuda_stub_model {
+    double pcie_gbps;               //< host <-> device bandwidth in GB/s
+    unsigned int copy_latency_us;   //< fixed cost of every copy
+    unsigned int launch_latency_us; //< fixed cost of every kernel launch
+    double pageable_gbps;           //< staging bandwidth of pageable copies
+};
+
+struct ucuda_stub_stats {
+    unsigned long long htod_count, htod_bytes;
+    unsigned long long dtoh_count, dtoh_bytes;
+    unsigned long long dtod_count, dtod_bytes;
+    unsigned long long launch_count;
+    unsigned long long alloc_count, alloc_bytes;
+    unsigned long long pageable_count, pageable_bytes; //< copies staged
+};
+
+struct ucuda_stub_dim3 {
+    unsigned int x, y, z;
+};
+
+struct ucuda_stub_launch {
+    struct ucuda_stub_dim3 grid;
+    struct ucuda_stub_dim3 block;
+    unsigned int shared_bytes;
+};
+
+#define UCUDA_STUB_MAX_ARGS 16
+
+/// @brief CPU implementation of a kernel. Called once per launch, the
+///        function iterates over the grid itself.
+///
+/// @param launch the grid and block dimensions of the launch.
+/// @param args one pointer per kernel argument, as for cuLaunchKernel.
+typedef void ucuda_stub_kernel_t(const struct ucuda_stub_launch *launch, void **args);
+
+/// @brief Register a CPU function for the kernel symbol `name`.
+///        cuModuleGetFunction resolves kernels by name in any module.
+///
+/// @param name the (mangled) kernel symbol name.
+/// @param fn the CPU implementation.
+/// @param nargs the number of kernel arguments.
+/// @param arg_sizes the size in bytes of each argument, used to unpack
+///        parameters set with cuParamSet* for cuLaunchGrid.
+///
+/// @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE.
+CUresult ucuda_stub_register_kernel(const char *name,
+                                    ucuda_stub_kernel_t *fn,
+                                    unsigned int nargs,
+                                    const unsigned int *arg_sizes);
+
+/// @brief Register a global of `bytes` bytes for the symbol `name`.
+///        cuModuleGetGlobal resolves globals by name in any module, each
+///        module getting a zeroed copy of its own.
+///
+/// @return CUDA_SUCCESS, or CUDA_ERROR_INVALID_VALUE.
+CUresult ucuda_stub_register_global(const char *name, size_t bytes);
+
+void ucuda_stub_get_model(struct ucuda_stub_model *model);
+void ucuda_stub_set_model(const struct ucuda_stub_model *model);
+
+void ucuda_stub_get_stats(struct ucuda_stub_stats *stats);
+void ucuda_stub_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
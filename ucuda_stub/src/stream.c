@@ -0,0 +1,334 @@
+#include "stub.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STUB_API __attribute__((visibility("default")))
+
+/*
+ * Streams and events. Every stream has a thread running its operations in
+ * submission order, so work queued on different streams overlaps, as does
+ * work queued on a stream with the host. The NULL stream behaves like the
+ * legacy default stream: its operations run in the calling thread once all
+ * other streams are idle, except those created with CU_STREAM_NON_BLOCKING.
+ */
+
+struct CUstream_st {
+    unsigned int flags;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //< work queued, or an operation completed
+    struct stub_op *head, *tail;
+    struct stub_op *free_ops; //< recycled, so that steady state does not allocate
+    unsigned long submitted, completed;
+    int stop;
+    struct CUstream_st *next;
+};
+
+// an event is complete once its last recorded generation has run
+struct CUevent_st {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long recorded, completed;
+    struct timespec time; //< completion time of the last record
+};
+
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CUstream_st *streams;
+
+static void stub_event_complete(CUevent e, unsigned long generation)
+{
+    pthread_mutex_lock(&e->lock);
+    if (generation > e->completed) {
+        e->completed = generation;
+        clock_gettime(CLOCK_MONOTONIC, &e->time);
+    }
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void stub_event_wait(CUevent e, unsigned long generation)
+{
+    pthread_mutex_lock(&e->lock);
+    while (e->completed < generation)
+        pthread_cond_wait(&e->cond, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void *stub_stream_worker(void *arg)
+{
+    CUstream s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->head == NULL && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->head == NULL)
+            break;
+
+        // the operation stays queued while it runs
+        struct stub_op *op = s->head;
+        pthread_mutex_unlock(&s->lock);
+
+        switch (op->type) {
+        case STUB_OP_EVENT_RECORD:
+            stub_event_complete(op->event.event, op->event.generation);
+            break;
+        case STUB_OP_EVENT_WAIT:
+            stub_event_wait(op->event.event, op->event.generation);
+            break;
+        default:
+            stub_op_run(op);
+            break;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->head = op->next;
+        if (s->head == NULL)
+            s->tail = NULL;
+        op->next = s->free_ops;
+        s->free_ops = op;
+        s->completed++;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+struct stub_op *stub_op_get(CUstream s)
+{
+    struct stub_op *op;
+
+    pthread_mutex_lock(&s->lock);
+    op = s->free_ops;
+    if (op != NULL)
+        s->free_ops = op->next;
+    pthread_mutex_unlock(&s->lock);
+
+    if (op == NULL)
+        op = malloc(sizeof(*op));
+    return op;
+}
+
+void stub_op_submit(CUstream s, struct stub_op *op)
+{
+    op->next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail != NULL)
+        s->tail->next = op;
+    else
+        s->head = op;
+    s->tail = op;
+    s->submitted++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void stub_stream_sync(CUstream s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->completed != s->submitted)
+        pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void stub_sync_streams(int non_blocking)
+{
+    pthread_mutex_lock(&streams_lock);
+    for (CUstream s = streams; s != NULL; s = s->next) {
+        if (non_blocking || !(s->flags & CU_STREAM_NON_BLOCKING))
+            stub_stream_sync(s);
+    }
+    pthread_mutex_unlock(&streams_lock);
+}
+
+void stub_sync_all(void)
+{
+    stub_sync_streams(1);
+}
+
+void stub_sync_default(void)
+{
+    stub_sync_streams(0);
+}
+
+STUB_API CUresult cuStreamCreate(CUstream *phStream, unsigned int Flags)
+{
+    CUstream s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    s->flags = Flags;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, stub_stream_worker, s) != 0) {
+        free(s);
+        return CUDA_ERROR_OPERATING_SYSTEM;
+    }
+
+    pthread_mutex_lock(&streams_lock);
+    s->next = streams;
+    streams = s;
+    pthread_mutex_unlock(&streams_lock);
+
+    *phStream = s;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuStreamDestroy(CUstream hStream)
+{
+    CUstream *ps;
+    struct stub_op *op, *next;
+
+    if (hStream == NULL)
+        return CUDA_ERROR_INVALID_HANDLE;
+
+    pthread_mutex_lock(&streams_lock);
+    for (ps = &streams; *ps != NULL && *ps != hStream; ps = &(*ps)->next)
+        ;
+    if (*ps != NULL)
+        *ps = hStream->next;
+    pthread_mutex_unlock(&streams_lock);
+
+    // pending work still runs
+    pthread_mutex_lock(&hStream->lock);
+    hStream->stop = 1;
+    pthread_cond_broadcast(&hStream->cond);
+    pthread_mutex_unlock(&hStream->lock);
+    pthread_join(hStream->thread, NULL);
+
+    for (op = hStream->free_ops; op != NULL; op = next) {
+        next = op->next;
+        free(op);
+    }
+    pthread_mutex_destroy(&hStream->lock);
+    pthread_cond_destroy(&hStream->cond);
+    free(hStream);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuStreamQuery(CUstream hStream)
+{
+    CUresult ret;
+
+    if (hStream == NULL)
+        return CUDA_SUCCESS;
+
+    pthread_mutex_lock(&hStream->lock);
+    ret = hStream->completed == hStream->submitted ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+    pthread_mutex_unlock(&hStream->lock);
+    return ret;
+}
+
+STUB_API CUresult cuStreamSynchronize(CUstream hStream)
+{
+    if (hStream == NULL)
+        stub_sync_default();
+    else
+        stub_stream_sync(hStream);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent, unsigned int Flags)
+{
+    struct stub_op *op;
+
+    pthread_mutex_lock(&hEvent->lock);
+    unsigned long generation = hEvent->recorded;
+    pthread_mutex_unlock(&hEvent->lock);
+
+    if (hStream == NULL) {
+        stub_event_wait(hEvent, generation);
+        return CUDA_SUCCESS;
+    }
+
+    if ((op = stub_op_get(hStream)) == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    op->type = STUB_OP_EVENT_WAIT;
+    op->event.event = hEvent;
+    op->event.generation = generation;
+    stub_op_submit(hStream, op);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuEventCreate(CUevent *phEvent, unsigned int Flags)
+{
+    CUevent e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    *phEvent = e;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuEventDestroy(CUevent hEvent)
+{
+    pthread_mutex_destroy(&hEvent->lock);
+    pthread_cond_destroy(&hEvent->cond);
+    free(hEvent);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuEventRecord(CUevent hEvent, CUstream hStream)
+{
+    struct stub_op *op = NULL;
+
+    if (hStream != NULL && (op = stub_op_get(hStream)) == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    pthread_mutex_lock(&hEvent->lock);
+    unsigned long generation = ++hEvent->recorded;
+    pthread_mutex_unlock(&hEvent->lock);
+
+    if (hStream == NULL) {
+        stub_sync_default();
+        stub_event_complete(hEvent, generation);
+        return CUDA_SUCCESS;
+    }
+
+    op->type = STUB_OP_EVENT_RECORD;
+    op->event.event = hEvent;
+    op->event.generation = generation;
+    stub_op_submit(hStream, op);
+    return CUDA_SUCCESS;
+}
+
+// cuEventQuery, which libenccuda overrides
+static CUresult stub_event_query(CUevent hEvent)
+{
+    CUresult ret;
+
+    pthread_mutex_lock(&hEvent->lock);
+    ret = hEvent->completed == hEvent->recorded ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+    pthread_mutex_unlock(&hEvent->lock);
+    return ret;
+}
+
+STUB_API CUresult cuEventQuery(CUevent hEvent)
+{
+    return stub_event_query(hEvent);
+}
+
+STUB_API CUresult cuEventSynchronize(CUevent hEvent)
+{
+    pthread_mutex_lock(&hEvent->lock);
+    while (hEvent->completed != hEvent->recorded)
+        pthread_cond_wait(&hEvent->cond, &hEvent->lock);
+    pthread_mutex_unlock(&hEvent->lock);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuEventElapsedTime(float *pMilliseconds, CUevent hStart, CUevent hEnd)
+{
+    if (stub_event_query(hStart) != CUDA_SUCCESS || stub_event_query(hEnd) != CUDA_SUCCESS)
+        return CUDA_ERROR_NOT_READY;
+
+    *pMilliseconds = (hEnd->time.tv_sec - hStart->time.tv_sec) * 1000.0f
+        + (hEnd->time.tv_nsec - hStart->time.tv_nsec) / 1000000.0f;
+    return CUDA_SUCCESS;
+}
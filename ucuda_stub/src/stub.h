@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ucuda_stub.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINTF(fmt...) fprintf(stderr, "[ucuda_stub] " fmt)
+#else
+#define DEBUG_PRINTF(fmt...)
+#endif
+
+#define PRINT_ERROR(fmt, ...) \
+fprintf(stderr, "[ucuda_stub] %s/%s/%d: " fmt, __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+struct stub_builtin_kernel {
+    const char *name;
+    ucuda_stub_kernel_t *fn;
+    unsigned int nargs;
+    unsigned int arg_sizes[UCUDA_STUB_MAX_ARGS];
+};
+
+// CPU versions of the kernels used by libenccuda and the apps
+extern const struct stub_builtin_kernel stub_builtin_kernels[];
+extern const unsigned int stub_builtin_kernels_count;
+
+#define STUB_PARAM_BUFFER_SIZE 4096
+
+/*
+ * Work queued on a stream, run in order by the stream's thread. Copies and
+ * launches keep everything they need (parameters included), since the
+ * caller's arguments may be gone by the time the operation runs.
+ */
+enum stub_op_type {
+    STUB_OP_HTOD,
+    STUB_OP_DTOH,
+    STUB_OP_DTOD,
+    STUB_OP_MEMSET,
+    STUB_OP_LAUNCH,
+    STUB_OP_EVENT_RECORD,
+    STUB_OP_EVENT_WAIT,
+};
+
+struct stub_op {
+    enum stub_op_type type;
+    union {
+        struct {
+            void *dst;
+            const void *src;
+            size_t bytes;
+        } copy;
+        struct {
+            unsigned char *dst;
+            size_t pitch, width, height; //< width in elements
+            unsigned int value, elem_size;
+        } set;
+        struct {
+            CUfunction f;
+            struct ucuda_stub_launch launch;
+            size_t param_size;
+            unsigned char params[STUB_PARAM_BUFFER_SIZE];
+        } launch;
+        struct {
+            CUevent event;
+            unsigned long generation;
+        } event;
+    };
+    struct stub_op *next;
+};
+
+// ucuda_stub.c: run a copy or launch
+void stub_op_run(struct stub_op *op);
+
+// stream.c
+struct stub_op *stub_op_get(CUstream stream);
+void stub_op_submit(CUstream stream, struct stub_op *op);
+// wait until every stream is idle, as cuCtxSynchronize does
+void stub_sync_all(void);
+// wait until every blocking stream is idle, as the legacy default stream does
+void stub_sync_default(void);
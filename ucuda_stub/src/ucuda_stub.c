@@ -0,0 +1,1125 @@
+#include "stub.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STUB_API __attribute__((visibility("default")))
+
+// device allocations are aligned like the ones of a real driver
+#define STUB_ALLOC_ALIGN 256
+
+struct stub_alloc {
+    CUdeviceptr base;
+    size_t size;
+    // the copy of a global of a module, NULL for cuMemAlloc
+    CUmodule module;
+    const struct stub_global *global;
+    struct stub_alloc *next;
+};
+
+struct stub_global {
+    char name[128];
+    size_t size;
+    struct stub_global *next;
+};
+
+struct stub_kernel {
+    char name[128];
+    ucuda_stub_kernel_t *fn;
+    unsigned int nargs;
+    unsigned int arg_sizes[UCUDA_STUB_MAX_ARGS];
+    struct stub_kernel *next;
+};
+
+struct CUctx_st {
+    unsigned int flags;
+};
+
+struct CUfunc_st {
+    const struct stub_kernel *kernel;
+    struct ucuda_stub_dim3 block;
+    unsigned int shared_bytes;
+    // parameters set with cuParamSet*, consumed by cuLaunchGrid
+    unsigned char params[STUB_PARAM_BUFFER_SIZE];
+    unsigned int param_size;
+    struct CUfunc_st *next;
+};
+
+struct CUmod_st {
+    char fname[256];
+    struct CUfunc_st *funcs;
+};
+
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stub_once = PTHREAD_ONCE_INIT;
+static struct stub_alloc *allocs;
+static struct stub_alloc *pinned; //< host memory from cuMemAllocHost
+static struct stub_kernel *kernels;
+static struct stub_global *globals;
+
+static struct ucuda_stub_model model = {
+    .pcie_gbps = 6.0,
+    .copy_latency_us = 10,
+    .launch_latency_us = 5,
+    .pageable_gbps = 6.0,
+};
+static struct ucuda_stub_stats stats;
+
+// one DMA engine per direction: copies in the same direction serialize,
+// even when queued on different streams
+static pthread_mutex_t copy_engines[2] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define STAT_ADD(field, v) __atomic_fetch_add(&stats.field, (v), __ATOMIC_RELAXED)
+
+static void stub_read_env_model(void)
+{
+    const char *s;
+
+    if ((s = getenv("UCUDA_STUB_PCIE_GBPS")) != NULL)
+        model.pcie_gbps = strtod(s, NULL);
+    if ((s = getenv("UCUDA_STUB_COPY_LATENCY_US")) != NULL)
+        model.copy_latency_us = strtoul(s, NULL, 0);
+    if ((s = getenv("UCUDA_STUB_LAUNCH_LATENCY_US")) != NULL)
+        model.launch_latency_us = strtoul(s, NULL, 0);
+    if ((s = getenv("UCUDA_STUB_PAGEABLE_GBPS")) != NULL)
+        model.pageable_gbps = strtod(s, NULL);
+}
+
+static CUresult stub_add_kernel(const char *name,
+                                ucuda_stub_kernel_t *fn,
+                                unsigned int nargs,
+                                const unsigned int *arg_sizes)
+{
+    struct stub_kernel *k;
+
+    if (name == NULL || fn == NULL || nargs > UCUDA_STUB_MAX_ARGS
+        || strlen(name) >= sizeof(k->name))
+        return CUDA_ERROR_INVALID_VALUE;
+
+    k = calloc(1, sizeof(*k));
+    if (k == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    strcpy(k->name, name);
+    k->fn = fn;
+    k->nargs = nargs;
+    memcpy(k->arg_sizes, arg_sizes, nargs * sizeof(*arg_sizes));
+
+    // later registrations shadow earlier ones
+    pthread_mutex_lock(&stub_lock);
+    k->next = kernels;
+    kernels = k;
+    pthread_mutex_unlock(&stub_lock);
+
+    return CUDA_SUCCESS;
+}
+
+static void stub_init_once(void)
+{
+    stub_read_env_model();
+
+    for (unsigned int i = 0; i < stub_builtin_kernels_count; i++) {
+        const struct stub_builtin_kernel *b = &stub_builtin_kernels[i];
+        stub_add_kernel(b->name, b->fn, b->nargs, b->arg_sizes);
+    }
+}
+
+static void stub_delay_ns(uint64_t ns)
+{
+    struct timespec deadline;
+
+    if (ns == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ns / 1000000000ull;
+    deadline.tv_nsec += ns % 1000000000ull;
+    if (deadline.tv_nsec >= 1000000000l) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000l;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+}
+
+static void stub_model_copy(size_t bytes, int pageable)
+{
+    uint64_t ns = model.copy_latency_us * 1000ull;
+    if (model.pcie_gbps > 0)
+        ns += (uint64_t) (bytes / model.pcie_gbps);
+    if (pageable && model.pageable_gbps > 0)
+        ns += (uint64_t) (bytes / model.pageable_gbps);
+    stub_delay_ns(ns);
+}
+
+// the host range [p, p + bytes) lies in memory from cuMemAllocHost
+static int stub_host_pinned(const void *p, size_t bytes)
+{
+    uintptr_t addr = (uintptr_t) p;
+    int found = 0;
+
+    pthread_mutex_lock(&stub_lock);
+    for (struct stub_alloc *a = pinned; a != NULL; a = a->next) {
+        if (addr >= a->base && addr + bytes <= a->base + a->size) {
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stub_lock);
+    return found;
+}
+
+static void stub_model_launch(void)
+{
+    stub_delay_ns(model.launch_latency_us * 1000ull);
+}
+
+static void stub_copy(enum stub_op_type dir, void *dst, const void *src, size_t bytes)
+{
+    if (dir == STUB_OP_DTOD) {
+        // done by the device, like a kernel
+        memmove(dst, src, bytes);
+        stub_model_launch();
+        STAT_ADD(dtod_count, 1);
+        STAT_ADD(dtod_bytes, bytes);
+        return;
+    }
+
+    pthread_mutex_t *engine = &copy_engines[dir == STUB_OP_DTOH];
+    int pageable = !stub_host_pinned(dir == STUB_OP_HTOD ? src : dst, bytes);
+
+    pthread_mutex_lock(engine);
+    memcpy(dst, src, bytes);
+    stub_model_copy(bytes, pageable);
+    pthread_mutex_unlock(engine);
+
+    if (pageable) {
+        STAT_ADD(pageable_count, 1);
+        STAT_ADD(pageable_bytes, bytes);
+    }
+
+    if (dir == STUB_OP_HTOD) {
+        STAT_ADD(htod_count, 1);
+        STAT_ADD(htod_bytes, bytes);
+    } else {
+        STAT_ADD(dtoh_count, 1);
+        STAT_ADD(dtoh_bytes, bytes);
+    }
+}
+
+// the device range [ptr, ptr + bytes) must lie in one allocation
+static int stub_device_range_valid(CUdeviceptr ptr, size_t bytes)
+{
+    int valid = 0;
+
+    pthread_mutex_lock(&stub_lock);
+    for (struct stub_alloc *a = allocs; a != NULL; a = a->next) {
+        if (ptr >= a->base && ptr + bytes <= a->base + a->size) {
+            valid = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stub_lock);
+    return valid;
+}
+
+static const struct stub_kernel *stub_find_kernel(const char *name)
+{
+    const struct stub_kernel *k;
+
+    pthread_mutex_lock(&stub_lock);
+    for (k = kernels; k != NULL; k = k->next) {
+        if (strcmp(k->name, name) == 0)
+            break;
+    }
+    pthread_mutex_unlock(&stub_lock);
+    return k;
+}
+
+STUB_API
+CUresult ucuda_stub_register_kernel(const char *name,
+                                    ucuda_stub_kernel_t *fn,
+                                    unsigned int nargs,
+                                    const unsigned int *arg_sizes)
+{
+    // the built-in kernels must not shadow user registrations
+    pthread_once(&stub_once, stub_init_once);
+    return stub_add_kernel(name, fn, nargs, arg_sizes);
+}
+
+STUB_API CUresult ucuda_stub_register_global(const char *name, size_t bytes)
+{
+    struct stub_global *g;
+
+    if (name == NULL || bytes == 0 || strlen(name) >= sizeof(g->name))
+        return CUDA_ERROR_INVALID_VALUE;
+    if ((g = calloc(1, sizeof(*g))) == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    strcpy(g->name, name);
+    g->size = bytes;
+
+    // later registrations shadow earlier ones
+    pthread_mutex_lock(&stub_lock);
+    g->next = globals;
+    globals = g;
+    pthread_mutex_unlock(&stub_lock);
+    return CUDA_SUCCESS;
+}
+
+STUB_API void ucuda_stub_get_model(struct ucuda_stub_model *m)
+{
+    *m = model;
+}
+
+STUB_API void ucuda_stub_set_model(const struct ucuda_stub_model *m)
+{
+    model = *m;
+}
+
+STUB_API void ucuda_stub_get_stats(struct ucuda_stub_stats *s)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *s = stats;
+}
+
+STUB_API void ucuda_stub_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+STUB_API CUresult cuInit(unsigned int Flags)
+{
+    pthread_once(&stub_once, stub_init_once);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuDeviceGet(CUdevice *device, int ordinal)
+{
+    if (ordinal != 0)
+        return CUDA_ERROR_INVALID_DEVICE;
+    *device = 0;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuDeviceGetCount(int *count)
+{
+    *count = 1;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev)
+{
+    if (dev != 0)
+        return CUDA_ERROR_INVALID_DEVICE;
+
+    pthread_once(&stub_once, stub_init_once);
+
+    struct CUctx_st *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    ctx->flags = flags;
+    *pctx = ctx;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuCtxDestroy(CUcontext ctx)
+{
+    free(ctx);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuCtxSynchronize(void)
+{
+    // every stream, non-blocking ones included
+    stub_sync_all();
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuModuleLoad(CUmodule *module, const char *fname)
+{
+    struct CUmod_st *mod = calloc(1, sizeof(*mod));
+    if (mod == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    // kernels are resolved by name, the image itself is not needed
+    snprintf(mod->fname, sizeof(mod->fname), "%s", fname);
+    DEBUG_PRINTF("cuModuleLoad %s\n", mod->fname);
+    *module = mod;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuModuleUnload(CUmodule hmod)
+{
+    struct CUfunc_st *f, *next;
+    struct stub_alloc **pa, *a, *freed = NULL;
+
+    for (f = hmod->funcs; f != NULL; f = next) {
+        next = f->next;
+        free(f);
+    }
+
+    pthread_mutex_lock(&stub_lock);
+    for (pa = &allocs; *pa != NULL;) {
+        a = *pa;
+        if (a->module != hmod) {
+            pa = &a->next;
+            continue;
+        }
+        *pa = a->next;
+        a->next = freed;
+        freed = a;
+    }
+    pthread_mutex_unlock(&stub_lock);
+    while ((a = freed) != NULL) {
+        freed = a->next;
+        free((void *) (uintptr_t) a->base);
+        free(a);
+    }
+
+    free(hmod);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod, const char *name)
+{
+    struct CUfunc_st *f;
+    const struct stub_kernel *k = stub_find_kernel(name);
+
+    if (k == NULL) {
+        PRINT_ERROR("no CPU implementation registered for kernel %s\n", name);
+        return CUDA_ERROR_NOT_FOUND;
+    }
+
+    // the same handle is returned for every lookup of a kernel
+    pthread_mutex_lock(&stub_lock);
+    for (f = hmod->funcs; f != NULL; f = f->next) {
+        if (f->kernel == k)
+            break;
+    }
+    if (f == NULL && (f = calloc(1, sizeof(*f))) != NULL) {
+        f->kernel = k;
+        f->block = (struct ucuda_stub_dim3) {1, 1, 1};
+        f->next = hmod->funcs;
+        hmod->funcs = f;
+    }
+    pthread_mutex_unlock(&stub_lock);
+
+    if (f == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    *hfunc = f;
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Globals are resolved by name in any module, like kernels: each module
+ * gets a zeroed copy of a registered global on its first lookup, freed by
+ * cuModuleUnload.
+ */
+STUB_API CUresult cuModuleGetGlobal(CUdeviceptr *dptr, unsigned int *bytes, CUmodule hmod,
+                                    const char *name)
+{
+    const struct stub_global *g;
+    struct stub_alloc *a;
+    void *mem;
+
+    pthread_mutex_lock(&stub_lock);
+    for (g = globals; g != NULL && strcmp(g->name, name) != 0; g = g->next)
+        ;
+    for (a = allocs; g != NULL && a != NULL; a = a->next) {
+        if (a->module == hmod && a->global == g)
+            break;
+    }
+    pthread_mutex_unlock(&stub_lock);
+
+    if (g == NULL) {
+        PRINT_ERROR("no global %s registered\n", name);
+        return CUDA_ERROR_NOT_FOUND;
+    }
+    if (a == NULL) {
+        size_t size = (g->size + STUB_ALLOC_ALIGN - 1) & ~((size_t) STUB_ALLOC_ALIGN - 1);
+        a = malloc(sizeof(*a));
+        mem = aligned_alloc(STUB_ALLOC_ALIGN, size);
+        if (a == NULL || mem == NULL) {
+            free(a);
+            free(mem);
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        memset(mem, 0, size);
+        a->base = (CUdeviceptr) (uintptr_t) mem;
+        a->size = g->size;
+        a->module = hmod;
+        a->global = g;
+
+        pthread_mutex_lock(&stub_lock);
+        a->next = allocs;
+        allocs = a;
+        pthread_mutex_unlock(&stub_lock);
+    }
+
+    if (dptr != NULL)
+        *dptr = a->base;
+    if (bytes != NULL)
+        *bytes = a->size;
+    return CUDA_SUCCESS;
+}
+
+// cuMemAlloc and cuMemAllocPitch: they do not call each other, libenccuda
+// overrides them
+static CUresult stub_mem_alloc(CUdeviceptr *dptr, size_t bytesize)
+{
+    if (bytesize == 0)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    size_t size = (bytesize + STUB_ALLOC_ALIGN - 1) & ~((size_t) STUB_ALLOC_ALIGN - 1);
+    struct stub_alloc *a = malloc(sizeof(*a));
+    void *mem = aligned_alloc(STUB_ALLOC_ALIGN, size);
+    if (a == NULL || mem == NULL) {
+        free(a);
+        free(mem);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    a->base = (CUdeviceptr) (uintptr_t) mem;
+    a->size = bytesize;
+    a->module = NULL;
+    a->global = NULL;
+
+    pthread_mutex_lock(&stub_lock);
+    a->next = allocs;
+    allocs = a;
+    pthread_mutex_unlock(&stub_lock);
+
+    STAT_ADD(alloc_count, 1);
+    STAT_ADD(alloc_bytes, bytesize);
+
+    *dptr = a->base;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuMemAlloc(CUdeviceptr *dptr, unsigned int bytesize)
+{
+    return stub_mem_alloc(dptr, bytesize);
+}
+
+STUB_API CUresult cuMemAllocPitch(CUdeviceptr *dptr, unsigned int *pPitch,
+                                  unsigned int WidthInBytes, unsigned int Height,
+                                  unsigned int ElementSizeBytes)
+{
+    if (ElementSizeBytes != 4 && ElementSizeBytes != 8 && ElementSizeBytes != 16)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    size_t pitch = ((size_t) WidthInBytes + STUB_ALLOC_ALIGN - 1) & ~((size_t) STUB_ALLOC_ALIGN - 1);
+    CUresult ret = stub_mem_alloc(dptr, pitch * Height);
+    if (ret == CUDA_SUCCESS)
+        *pPitch = pitch;
+    return ret;
+}
+
+STUB_API CUresult cuMemFree(CUdeviceptr dptr)
+{
+    struct stub_alloc **pa, *a = NULL;
+
+    pthread_mutex_lock(&stub_lock);
+    for (pa = &allocs; *pa != NULL; pa = &(*pa)->next) {
+        if ((*pa)->base == dptr && (*pa)->module == NULL) {
+            a = *pa;
+            *pa = a->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stub_lock);
+
+    if (a == NULL) {
+        PRINT_ERROR("free of unknown device pointer %llx\n", dptr);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    free((void *) (uintptr_t) a->base);
+    free(a);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuMemAllocHost(void **pp, unsigned int bytesize)
+{
+    if (bytesize == 0)
+        return CUDA_ERROR_INVALID_VALUE;
+
+    struct stub_alloc *a = malloc(sizeof(*a));
+    void *mem = malloc(bytesize);
+    if (a == NULL || mem == NULL) {
+        free(a);
+        free(mem);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    a->base = (CUdeviceptr) (uintptr_t) mem;
+    a->size = bytesize;
+    a->module = NULL;
+    a->global = NULL;
+
+    pthread_mutex_lock(&stub_lock);
+    a->next = pinned;
+    pinned = a;
+    pthread_mutex_unlock(&stub_lock);
+
+    *pp = mem;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuMemFreeHost(void *p)
+{
+    struct stub_alloc **pa, *a = NULL;
+
+    pthread_mutex_lock(&stub_lock);
+    for (pa = &pinned; *pa != NULL; pa = &(*pa)->next) {
+        if ((*pa)->base == (CUdeviceptr) (uintptr_t) p) {
+            a = *pa;
+            *pa = a->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stub_lock);
+
+    if (a == NULL) {
+        PRINT_ERROR("free of unknown host pointer %p\n", p);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    free(p);
+    free(a);
+    return CUDA_SUCCESS;
+}
+
+// run a copy on the NULL stream, or queue it on hStream. The public
+// functions are not called, libenccuda overrides them.
+static CUresult stub_memcpy(enum stub_op_type dir, void *dst, const void *src,
+                            size_t bytes, CUstream hStream)
+{
+    if (hStream == NULL) {
+        stub_sync_default();
+        stub_copy(dir, dst, src, bytes);
+        return CUDA_SUCCESS;
+    }
+
+    struct stub_op *op = stub_op_get(hStream);
+    if (op == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+
+    op->type = dir;
+    op->copy.dst = dst;
+    op->copy.src = src;
+    op->copy.bytes = bytes;
+    stub_op_submit(hStream, op);
+    return CUDA_SUCCESS;
+}
+
+static CUresult stub_memcpy_htod(CUdeviceptr dstDevice, const void *srcHost,
+                                 size_t bytes, CUstream hStream)
+{
+    if (!stub_device_range_valid(dstDevice, bytes)) {
+        PRINT_ERROR("HtoD out of bounds: %llx + %zu\n", dstDevice, bytes);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return stub_memcpy(STUB_OP_HTOD, (void *) (uintptr_t) dstDevice, srcHost, bytes, hStream);
+}
+
+static CUresult stub_memcpy_dtoh(void *dstHost, CUdeviceptr srcDevice,
+                                 size_t bytes, CUstream hStream)
+{
+    if (!stub_device_range_valid(srcDevice, bytes)) {
+        PRINT_ERROR("DtoH out of bounds: %llx + %zu\n", srcDevice, bytes);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return stub_memcpy(STUB_OP_DTOH, dstHost, (const void *) (uintptr_t) srcDevice, bytes, hStream);
+}
+
+static CUresult stub_memcpy_dtod(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                                 size_t bytes, CUstream hStream)
+{
+    if (!stub_device_range_valid(dstDevice, bytes)
+        || !stub_device_range_valid(srcDevice, bytes)) {
+        PRINT_ERROR("DtoD out of bounds: %llx -> %llx + %zu\n", srcDevice, dstDevice, bytes);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return stub_memcpy(STUB_OP_DTOD, (void *) (uintptr_t) dstDevice,
+                       (const void *) (uintptr_t) srcDevice, bytes, hStream);
+}
+
+STUB_API CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, unsigned int ByteCount)
+{
+    return stub_memcpy_htod(dstDevice, srcHost, ByteCount, NULL);
+}
+
+STUB_API CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, unsigned int ByteCount)
+{
+    return stub_memcpy_dtoh(dstHost, srcDevice, ByteCount, NULL);
+}
+
+STUB_API CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice, unsigned int ByteCount)
+{
+    return stub_memcpy_dtod(dstDevice, srcDevice, ByteCount, NULL);
+}
+
+STUB_API CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost,
+                                    unsigned int ByteCount, CUstream hStream)
+{
+    return stub_memcpy_htod(dstDevice, srcHost, ByteCount, hStream);
+}
+
+STUB_API CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice,
+                                    unsigned int ByteCount, CUstream hStream)
+{
+    return stub_memcpy_dtoh(dstHost, srcDevice, ByteCount, hStream);
+}
+
+STUB_API CUresult cuMemcpyDtoDAsync(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                                    unsigned int ByteCount, CUstream hStream)
+{
+    return stub_memcpy_dtod(dstDevice, srcDevice, ByteCount, hStream);
+}
+
+/*
+ * 2D and 3D copies, one copy per row. Arrays are not emulated.
+ */
+struct stub_copy_3d {
+    unsigned char *host[2];   //< source, destination, NULL if on the device
+    CUdeviceptr dev[2];
+    size_t pitch[2], slice_pitch[2];
+    size_t width, height, depth;
+};
+
+static CUresult stub_copy_end(CUmemorytype type, const void *host, CUdeviceptr dev,
+                              size_t x, size_t y, size_t z, size_t pitch, size_t height,
+                              struct stub_copy_3d *c, int i)
+{
+    size_t offset = (z * height + y) * pitch + x;
+
+    c->pitch[i] = pitch;
+    c->slice_pitch[i] = pitch * height;
+    if (type == CU_MEMORYTYPE_HOST) {
+        c->host[i] = (unsigned char *) host + offset;
+        c->dev[i] = 0;
+    } else if (type == CU_MEMORYTYPE_DEVICE) {
+        c->host[i] = NULL;
+        c->dev[i] = dev + offset;
+    } else {
+        PRINT_ERROR("memory type %d is not emulated\n", type);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return CUDA_SUCCESS;
+}
+
+static CUresult stub_memcpy_3d(const struct stub_copy_3d *c, CUstream hStream)
+{
+    CUresult ret = CUDA_SUCCESS;
+
+    if (c->width > c->pitch[0] || c->width > c->pitch[1])
+        return CUDA_ERROR_INVALID_VALUE;
+
+    for (size_t z = 0; z < c->depth && ret == CUDA_SUCCESS; z++) {
+        for (size_t y = 0; y < c->height && ret == CUDA_SUCCESS; y++) {
+            size_t src = z * c->slice_pitch[0] + y * c->pitch[0];
+            size_t dst = z * c->slice_pitch[1] + y * c->pitch[1];
+
+            if (c->host[0] != NULL && c->host[1] != NULL)
+                memcpy(c->host[1] + dst, c->host[0] + src, c->width);
+            else if (c->host[0] != NULL)
+                ret = stub_memcpy_htod(c->dev[1] + dst, c->host[0] + src, c->width, hStream);
+            else if (c->host[1] != NULL)
+                ret = stub_memcpy_dtoh(c->host[1] + dst, c->dev[0] + src, c->width, hStream);
+            else
+                ret = stub_memcpy_dtod(c->dev[1] + dst, c->dev[0] + src, c->width, hStream);
+        }
+    }
+    return ret;
+}
+
+static CUresult stub_memcpy_2d(const CUDA_MEMCPY2D *p, CUstream hStream)
+{
+    CUresult ret;
+    struct stub_copy_3d c = {.width = p->WidthInBytes, .height = p->Height, .depth = 1};
+
+    if ((ret = stub_copy_end(p->srcMemoryType, p->srcHost, p->srcDevice, p->srcXInBytes,
+                             p->srcY, 0, p->srcPitch, p->Height, &c, 0)) != CUDA_SUCCESS)
+        return ret;
+    if ((ret = stub_copy_end(p->dstMemoryType, p->dstHost, p->dstDevice, p->dstXInBytes,
+                             p->dstY, 0, p->dstPitch, p->Height, &c, 1)) != CUDA_SUCCESS)
+        return ret;
+    return stub_memcpy_3d(&c, hStream);
+}
+
+static CUresult stub_memcpy_3d_desc(const CUDA_MEMCPY3D *p, CUstream hStream)
+{
+    CUresult ret;
+    struct stub_copy_3d c = {.width = p->WidthInBytes, .height = p->Height, .depth = p->Depth};
+
+    if (p->srcLOD != 0 || p->dstLOD != 0)
+        return CUDA_ERROR_INVALID_VALUE;
+    if ((ret = stub_copy_end(p->srcMemoryType, p->srcHost, p->srcDevice, p->srcXInBytes,
+                             p->srcY, p->srcZ, p->srcPitch, p->srcHeight, &c, 0)) != CUDA_SUCCESS)
+        return ret;
+    if ((ret = stub_copy_end(p->dstMemoryType, p->dstHost, p->dstDevice, p->dstXInBytes,
+                             p->dstY, p->dstZ, p->dstPitch, p->dstHeight, &c, 1)) != CUDA_SUCCESS)
+        return ret;
+    return stub_memcpy_3d(&c, hStream);
+}
+
+STUB_API CUresult cuMemcpy2D(const CUDA_MEMCPY2D *pCopy)
+{
+    return stub_memcpy_2d(pCopy, NULL);
+}
+
+STUB_API CUresult cuMemcpy2DUnaligned(const CUDA_MEMCPY2D *pCopy)
+{
+    return stub_memcpy_2d(pCopy, NULL);
+}
+
+STUB_API CUresult cuMemcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream hStream)
+{
+    return stub_memcpy_2d(pCopy, hStream);
+}
+
+STUB_API CUresult cuMemcpy3D(const CUDA_MEMCPY3D *pCopy)
+{
+    return stub_memcpy_3d_desc(pCopy, NULL);
+}
+
+STUB_API CUresult cuMemcpy3DAsync(const CUDA_MEMCPY3D *pCopy, CUstream hStream)
+{
+    return stub_memcpy_3d_desc(pCopy, hStream);
+}
+
+/*
+ * Memsets, row by row, a 1D memset being one row. Done by the device, like
+ * DtoD copies.
+ */
+static void stub_fill(unsigned char *dst, size_t pitch, unsigned int value,
+                      unsigned int elem_size, size_t width, size_t height)
+{
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++)
+            memcpy(dst + y * pitch + x * elem_size, &value, elem_size);
+    }
+    stub_model_launch();
+}
+
+static CUresult stub_memset(CUdeviceptr dst, size_t pitch, unsigned int value,
+                            unsigned int elem_size, size_t width, size_t height,
+                            CUstream hStream)
+{
+    struct stub_op *op;
+
+    if (width == 0 || height == 0)
+        return CUDA_SUCCESS;
+    if (dst % elem_size != 0 || (height > 1 && pitch < width * elem_size)
+        || !stub_device_range_valid(dst, (height - 1) * pitch + width * elem_size)) {
+        PRINT_ERROR("memset out of bounds: %llx, %zu rows of %zu bytes\n",
+                    dst, height, width * elem_size);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    if (hStream == NULL) {
+        stub_sync_default();
+        stub_fill((unsigned char *) (uintptr_t) dst, pitch, value, elem_size, width, height);
+        return CUDA_SUCCESS;
+    }
+
+    if ((op = stub_op_get(hStream)) == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    op->type = STUB_OP_MEMSET;
+    op->set.dst = (unsigned char *) (uintptr_t) dst;
+    op->set.pitch = pitch;
+    op->set.width = width;
+    op->set.height = height;
+    op->set.value = value;
+    op->set.elem_size = elem_size;
+    stub_op_submit(hStream, op);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuMemsetD8(CUdeviceptr dstDevice, unsigned char uc, unsigned int N)
+{
+    return stub_memset(dstDevice, 0, uc, 1, N, 1, NULL);
+}
+
+STUB_API CUresult cuMemsetD16(CUdeviceptr dstDevice, unsigned short us, unsigned int N)
+{
+    return stub_memset(dstDevice, 0, us, 2, N, 1, NULL);
+}
+
+STUB_API CUresult cuMemsetD32(CUdeviceptr dstDevice, unsigned int ui, unsigned int N)
+{
+    return stub_memset(dstDevice, 0, ui, 4, N, 1, NULL);
+}
+
+STUB_API CUresult cuMemsetD8Async(CUdeviceptr dstDevice, unsigned char uc, unsigned int N,
+                                  CUstream hStream)
+{
+    return stub_memset(dstDevice, 0, uc, 1, N, 1, hStream);
+}
+
+STUB_API CUresult cuMemsetD16Async(CUdeviceptr dstDevice, unsigned short us, unsigned int N,
+                                   CUstream hStream)
+{
+    return stub_memset(dstDevice, 0, us, 2, N, 1, hStream);
+}
+
+STUB_API CUresult cuMemsetD32Async(CUdeviceptr dstDevice, unsigned int ui, unsigned int N,
+                                   CUstream hStream)
+{
+    return stub_memset(dstDevice, 0, ui, 4, N, 1, hStream);
+}
+
+STUB_API CUresult cuMemsetD2D8(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned char uc,
+                               unsigned int Width, unsigned int Height)
+{
+    return stub_memset(dstDevice, dstPitch, uc, 1, Width, Height, NULL);
+}
+
+STUB_API CUresult cuMemsetD2D16(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned short us,
+                                unsigned int Width, unsigned int Height)
+{
+    return stub_memset(dstDevice, dstPitch, us, 2, Width, Height, NULL);
+}
+
+STUB_API CUresult cuMemsetD2D32(CUdeviceptr dstDevice, unsigned int dstPitch, unsigned int ui,
+                                unsigned int Width, unsigned int Height)
+{
+    return stub_memset(dstDevice, dstPitch, ui, 4, Width, Height, NULL);
+}
+
+STUB_API CUresult cuMemsetD2D8Async(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                    unsigned char uc, unsigned int Width, unsigned int Height,
+                                    CUstream hStream)
+{
+    return stub_memset(dstDevice, dstPitch, uc, 1, Width, Height, hStream);
+}
+
+STUB_API CUresult cuMemsetD2D16Async(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                     unsigned short us, unsigned int Width, unsigned int Height,
+                                     CUstream hStream)
+{
+    return stub_memset(dstDevice, dstPitch, us, 2, Width, Height, hStream);
+}
+
+STUB_API CUresult cuMemsetD2D32Async(CUdeviceptr dstDevice, unsigned int dstPitch,
+                                     unsigned int ui, unsigned int Width, unsigned int Height,
+                                     CUstream hStream)
+{
+    return stub_memset(dstDevice, dstPitch, ui, 4, Width, Height, hStream);
+}
+
+STUB_API CUresult cuFuncSetBlockShape(CUfunction hfunc, int x, int y, int z)
+{
+    hfunc->block = (struct ucuda_stub_dim3) {x, y, z};
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuFuncSetSharedSize(CUfunction hfunc, unsigned int bytes)
+{
+    hfunc->shared_bytes = bytes;
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuParamSetSize(CUfunction hfunc, unsigned int numbytes)
+{
+    if (numbytes > STUB_PARAM_BUFFER_SIZE)
+        return CUDA_ERROR_INVALID_VALUE;
+    hfunc->param_size = numbytes;
+    return CUDA_SUCCESS;
+}
+
+// cuParamSet*: they do not call each other, libenccuda overrides them
+static CUresult stub_param_set(CUfunction hfunc, int offset, const void *ptr,
+                               unsigned int numbytes)
+{
+    if (offset < 0 || offset + numbytes > STUB_PARAM_BUFFER_SIZE)
+        return CUDA_ERROR_INVALID_VALUE;
+    memcpy(hfunc->params + offset, ptr, numbytes);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuParamSetv(CUfunction hfunc, int offset, void *ptr, unsigned int numbytes)
+{
+    return stub_param_set(hfunc, offset, ptr, numbytes);
+}
+
+STUB_API CUresult cuParamSeti(CUfunction hfunc, int offset, unsigned int value)
+{
+    return stub_param_set(hfunc, offset, &value, sizeof(value));
+}
+
+STUB_API CUresult cuParamSetf(CUfunction hfunc, int offset, float value)
+{
+    return stub_param_set(hfunc, offset, &value, sizeof(value));
+}
+
+// Split a packed parameter buffer into one pointer per argument. Arguments
+// are naturally aligned, as with cuParamSet* and CU_LAUNCH_PARAM_BUFFER_*.
+static CUresult stub_unpack_params(const struct stub_kernel *k,
+                                   void *buf, size_t buf_size, void **args)
+{
+    size_t offset = 0;
+
+    for (unsigned int i = 0; i < k->nargs; i++) {
+        size_t size = k->arg_sizes[i];
+        size_t align = size < 8 ? size : 8;
+        if (align > 1)
+            offset = (offset + align - 1) & ~(align - 1);
+        if (offset + size > buf_size) {
+            PRINT_ERROR("%s: parameter %u past the end of the buffer\n", k->name, i);
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+        args[i] = (unsigned char *) buf + offset;
+        offset += size;
+    }
+    return CUDA_SUCCESS;
+}
+
+// Inverse of stub_unpack_params, for launches that run after the caller's
+// kernelParams are gone.
+static CUresult stub_pack_params(const struct stub_kernel *k,
+                                 void **args, void *buf, size_t *buf_size)
+{
+    size_t offset = 0;
+
+    for (unsigned int i = 0; i < k->nargs; i++) {
+        size_t size = k->arg_sizes[i];
+        size_t align = size < 8 ? size : 8;
+        if (align > 1)
+            offset = (offset + align - 1) & ~(align - 1);
+        if (offset + size > STUB_PARAM_BUFFER_SIZE)
+            return CUDA_ERROR_INVALID_VALUE;
+        memcpy((unsigned char *) buf + offset, args[i], size);
+        offset += size;
+    }
+    *buf_size = offset;
+    return CUDA_SUCCESS;
+}
+
+static void stub_run_kernel(CUfunction f, const struct ucuda_stub_launch *launch, void **args)
+{
+    stub_model_launch();
+    f->kernel->fn(launch, args);
+    STAT_ADD(launch_count, 1);
+}
+
+void stub_op_run(struct stub_op *op)
+{
+    void *args[UCUDA_STUB_MAX_ARGS];
+
+    switch (op->type) {
+    case STUB_OP_HTOD:
+    case STUB_OP_DTOH:
+    case STUB_OP_DTOD:
+        stub_copy(op->type, op->copy.dst, op->copy.src, op->copy.bytes);
+        break;
+    case STUB_OP_MEMSET:
+        stub_fill(op->set.dst, op->set.pitch, op->set.value, op->set.elem_size,
+                  op->set.width, op->set.height);
+        break;
+    case STUB_OP_LAUNCH:
+        // checked when packed
+        stub_unpack_params(op->launch.f->kernel, op->launch.params,
+                           op->launch.param_size, args);
+        stub_run_kernel(op->launch.f, &op->launch.launch, args);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+// the public functions are not called from here, libenccuda overrides them
+static CUresult stub_launch_grid(CUfunction f, int grid_width, int grid_height)
+{
+    CUresult ret;
+    void *args[UCUDA_STUB_MAX_ARGS];
+    struct ucuda_stub_launch launch = {
+        .grid = {grid_width, grid_height, 1},
+        .block = f->block,
+        .shared_bytes = f->shared_bytes,
+    };
+
+    ret = stub_unpack_params(f->kernel, f->params, f->param_size, args);
+    if (ret != CUDA_SUCCESS)
+        return ret;
+
+    stub_sync_default();
+    stub_run_kernel(f, &launch, args);
+    return CUDA_SUCCESS;
+}
+
+STUB_API CUresult cuLaunchGrid(CUfunction f, int grid_width, int grid_height)
+{
+    return stub_launch_grid(f, grid_width, grid_height);
+}
+
+STUB_API CUresult cuLaunch(CUfunction f)
+{
+    return stub_launch_grid(f, 1, 1);
+}
+
+STUB_API CUresult cuLaunchKernel(CUfunction f,
+                                 unsigned int gridDimX,
+                                 unsigned int gridDimY,
+                                 unsigned int gridDimZ,
+                                 unsigned int blockDimX,
+                                 unsigned int blockDimY,
+                                 unsigned int blockDimZ,
+                                 unsigned int sharedMemBytes,
+                                 CUstream hStream,
+                                 void **kernelParams,
+                                 void **extra)
+{
+    CUresult ret;
+    void *args[UCUDA_STUB_MAX_ARGS];
+    struct ucuda_stub_launch launch = {
+        .grid = {gridDimX, gridDimY, gridDimZ},
+        .block = {blockDimX, blockDimY, blockDimZ},
+        .shared_bytes = sharedMemBytes,
+    };
+
+    if (kernelParams != NULL) {
+        memcpy(args, kernelParams, f->kernel->nargs * sizeof(void *));
+    } else if (extra != NULL) {
+        void *buf = NULL;
+        size_t buf_size = 0;
+        for (void **e = extra; *e != CU_LAUNCH_PARAM_END; e += 2) {
+            if (e[0] == CU_LAUNCH_PARAM_BUFFER_POINTER)
+                buf = e[1];
+            else if (e[0] == CU_LAUNCH_PARAM_BUFFER_SIZE)
+                buf_size = *(size_t *) e[1];
+        }
+        ret = stub_unpack_params(f->kernel, buf, buf_size, args);
+        if (ret != CUDA_SUCCESS)
+            return ret;
+    } else if (f->kernel->nargs != 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+
+    if (hStream == NULL) {
+        stub_sync_default();
+        stub_run_kernel(f, &launch, args);
+        return CUDA_SUCCESS;
+    }
+
+    struct stub_op *op = stub_op_get(hStream);
+    if (op == NULL)
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    op->type = STUB_OP_LAUNCH;
+    op->launch.f = f;
+    op->launch.launch = launch;
+    ret = stub_pack_params(f->kernel, args, op->launch.params, &op->launch.param_size);
+    if (ret != CUDA_SUCCESS) {
+        free(op);
+        return ret;
+    }
+    stub_op_submit(hStream, op);
+    return CUDA_SUCCESS;
+}